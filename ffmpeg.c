@@ -15,12 +15,20 @@
 #if HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#if HAVE_UNISTD_H && !defined(_WIN32)
+#include <sys/types.h>
+#include <sys/wait.h>
+#define HAVE_FORK_JOBS 1
+#else
+#define HAVE_FORK_JOBS 0
+#endif
 
 #include "libavformat/avformat.h"
 #include "libavdevice/avdevice.h"
 #include "libswresample/swresample.h"
 #include "libavutil/opt.h"
 #include "libavutil/channel_layout.h"
+#include "libavutil/cpu.h"
 #include "libavutil/parseutils.h"
 #include "libavutil/samplefmt.h"
 #include "libavutil/fifo.h"
@@ -107,9 +115,9 @@ static int64_t getmaxrss(void);
 static int ifilter_has_all_input_formats(FilterGraph *fg);
 
 static int run_as_daemon = 0; // 后台运行
-static int nb_frames_dup = 0;
-static unsigned dup_warning = 1000;
-static int nb_frames_drop = 0;
+static atomic_int nb_frames_dup = ATOMIC_VAR_INIT(0); // 编码线程中也会修改
+static atomic_uint dup_warning = ATOMIC_VAR_INIT(1000);
+static atomic_int nb_frames_drop = ATOMIC_VAR_INIT(0);
 static int64_t decode_error_stat[2];
 
 static int want_sdp = 1;
@@ -141,8 +149,19 @@ static struct termios oldtty;
 static int restore_tty;
 #endif
 
+static void free_output_scheduler(void);
+static int share_packet(OutputStream *ost, const AVPacket *pkt, int eof);
+static void free_loop_cache(InputFile *f);
+static void free_frame_cache(InputFile *f);
+static void init_frame_caches(void);
+
 #if HAVE_THREADS
 static void free_input_threads(void);
+static void free_encoder_threads(int abort);
+static void free_filtergraph_threads(int abort);
+static void free_decoder_threads(void);
+static void free_mux_threads(int abort);
+static void free_closer_thread(void);
 #endif
 
 static void term_exit_sigsafe(void)
@@ -313,17 +332,47 @@ static int read_key(void)
     return -1;
 }
 
+// ctx 不为NULL时指向一个中止标志
 static int decode_interrupt_cb(void *ctx)
 {
-    return received_nb_signals > atomic_load(&transcode_init_done);
+    atomic_int *abort_flag = ctx;
+    return received_nb_signals > atomic_load(&transcode_init_done) ||
+           (abort_flag && atomic_load(abort_flag));
 }
 
 const AVIOInterruptCB int_cb = {decode_interrupt_cb, NULL};
 
+#if HAVE_THREADS
+/* set while the demuxer threads are torn down, so that a thread blocked
+ * in a read on a stalled input does not hold up the join */
+static atomic_int input_threads_abort = ATOMIC_VAR_INIT(0);
+const AVIOInterruptCB input_int_cb = {decode_interrupt_cb, &input_threads_abort};
+
+/* input_wakeup_seq is bumped each time a demuxer thread queues a packet or
+ * stops, the main loop waits on it instead of polling when all the inputs
+ * it needs returned EAGAIN */
+static pthread_mutex_t input_wakeup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t input_wakeup_cond = PTHREAD_COND_INITIALIZER;
+static unsigned input_wakeup_seq;
+static unsigned eagain_wakeup_seq; /* input_wakeup_seq at the last reset_eagain() */
+#else
+const AVIOInterruptCB input_int_cb = {decode_interrupt_cb, NULL};
+#endif
+
 static void ffmpeg_cleanup(int ret)
 {
     int i, j;
 
+#if HAVE_THREADS
+    /* only the main thread calls exit_program(), never with an output file
+     * or filtergraph locked, so the worker threads can still be joined */
+    free_decoder_threads();
+    free_filtergraph_threads(1);
+    free_encoder_threads(1);
+    free_mux_threads(1);
+    free_closer_thread();
+#endif
+
     if (do_benchmark)
     {
         int maxrss = getmaxrss() / 1024;
@@ -368,6 +417,8 @@ static void ffmpeg_cleanup(int ret)
 
     av_freep(&subtitle_out);
 
+    free_output_scheduler();
+
     // 释放输出文件的AVFormatContext
     for (i = 0; i < nb_output_files; i++)
     {
@@ -376,10 +427,32 @@ static void ffmpeg_cleanup(int ret)
         if (!of)
             continue;
         s = of->ctx;
-        if (s && s->oformat && !(s->oformat->flags & AVFMT_NOFILE))
+        // 最后一个分段文件
+        if (of->mux_ctx && of->mux_ctx != s)
+        {
+            if (of->aio_pb)
+            {
+                of->mux_ctx->pb = NULL;
+                async_io_close(&of->aio_pb);
+            }
+            else if (!(of->mux_ctx->oformat->flags & AVFMT_NOFILE))
+                avio_closep(&of->mux_ctx->pb);
+            avformat_free_context(of->mux_ctx);
+        }
+        av_dict_free(&of->rotate_opts);
+        av_freep(&of->rotate_pattern);
+        if (of->aio_pb)
+        {
+            s->pb = NULL;
+            async_io_close(&of->aio_pb);
+        }
+        else if (s && s->oformat && !(s->oformat->flags & AVFMT_NOFILE))
             avio_closep(&s->pb);
         avformat_free_context(s); // 释放输出文件的AVFormatContext
         av_dict_free(&of->opts);
+#if HAVE_THREADS
+        pthread_mutex_destroy(&of->lock);
+#endif
 
         av_freep(&output_files[i]);
     }
@@ -411,6 +484,7 @@ static void ffmpeg_cleanup(int ret)
 
         avcodec_free_context(&ost->enc_ctx);
         avcodec_parameters_free(&ost->ref_par);
+        av_freep(&ost->enc_shares);
 
         if (ost->muxing_queue)
         {
@@ -422,6 +496,8 @@ static void ffmpeg_cleanup(int ret)
             }
             av_fifo_freep(&ost->muxing_queue);
         }
+        if (ost->muxing_queue_spill)
+            fclose(ost->muxing_queue_spill);
 
         av_freep(&output_streams[i]);
     }
@@ -433,6 +509,10 @@ static void ffmpeg_cleanup(int ret)
     for (i = 0; i < nb_input_files; i++)
     {
         avformat_close_input(&input_files[i]->ctx); // 关闭输入文件
+        free_mmap_input(&input_files[i]->mmap_pb);
+        async_io_close(&input_files[i]->aio_pb);
+        free_loop_cache(input_files[i]);
+        free_frame_cache(input_files[i]);
         av_freep(&input_files[i]);
     }
 
@@ -460,6 +540,8 @@ static void ffmpeg_cleanup(int ret)
                    av_err2str(AVERROR(errno)));
     }
     av_freep(&vstats_filename);
+    av_freep(&probe_cache_dir);
+    av_freep(&muxing_queue_spill_dir);
 
     av_freep(&input_streams);
     av_freep(&input_files);
@@ -537,438 +619,1074 @@ static void close_all_output_streams(OutputStream *ost, OSTFinished this_stream,
     for (i = 0; i < nb_output_streams; i++)
     {
         OutputStream *ost2 = output_streams[i];
-        ost2->finished |= ost == ost2 ? this_stream : others;
+        atomic_fetch_or(&ost2->finished, ost == ost2 ? this_stream : others);
     }
 }
 
-static void write_packet(OutputFile *of, AVPacket *pkt, OutputStream *ost, int unqueue)
+static void lock_output_file(OutputFile *of)
 {
-    AVFormatContext *s = of->ctx;
-    AVStream *st = ost->st;
-    int ret;
+#if HAVE_THREADS
+    pthread_mutex_lock(&of->lock);
+#endif
+}
 
-    /*
-     * Audio encoders may split the packets --  #frames in != #packets out.
-     * But there is no reordering, so we can limit the number of output packets
-     * by simply dropping them here.
-     * Counting encoded video frames needs to be done separately because of
-     * reordering, see do_video_out().
-     * Do not count the packet when unqueued because it has been counted when queued.
-     */
-    if (!(st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && ost->encoding_needed) && !unqueue)
+static void unlock_output_file(OutputFile *of)
+{
+#if HAVE_THREADS
+    pthread_mutex_unlock(&of->lock);
+#endif
+}
+
+// 访问 of->ctx->pb 之前加锁: 有复用线程时复用器由它使用, 而不是写包的线程
+static void lock_muxer(OutputFile *of)
+{
+#if HAVE_THREADS
+    if (of->mux_queue)
     {
-        if (ost->frame_number >= ost->max_frames)
-        {
-            av_packet_unref(pkt);
-            return;
-        }
-        ost->frame_number++;
+        pthread_mutex_lock(&of->mux_lock);
+        return;
     }
+#endif
+    lock_output_file(of);
+}
 
-    if (!of->header_written) // 头部还没有写入
+static void unlock_muxer(OutputFile *of)
+{
+#if HAVE_THREADS
+    if (of->mux_queue)
     {
-        AVPacket tmp_pkt = {0};
-        /* the muxer is not initialized yet, buffer the packet */
-        if (!av_fifo_space(ost->muxing_queue))
-        {
-            int new_size = FFMIN(2 * av_fifo_size(ost->muxing_queue),
-                                 ost->max_muxing_queue_size);
-            if (new_size <= av_fifo_size(ost->muxing_queue))
-            {
-                av_log(NULL, AV_LOG_ERROR,
-                       "Too many packets buffered for output stream %d:%d.\n",
-                       ost->file_index, ost->st->index);
-                exit_program(1);
-            }
-            ret = av_fifo_realloc2(ost->muxing_queue, new_size);
-            if (ret < 0)
-            {
-                exit_program(1);
-            }
-        }
-        ret = av_packet_make_refcounted(pkt);
-        if (ret < 0)
-        {
-            exit_program(1);
-        }
-        av_packet_move_ref(&tmp_pkt, pkt);
-        av_fifo_generic_write(ost->muxing_queue, &tmp_pkt, sizeof(tmp_pkt), NULL);
+        pthread_mutex_unlock(&of->mux_lock);
         return;
     }
+#endif
+    unlock_output_file(of);
+}
 
-    if ((st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && video_sync_method == VSYNC_DROP) ||
-        (st->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && audio_sync_method < 0))
+// -fs: 已写入的字节数, 包括 -rotate_time/-rotate_size 之前的文件
+static int64_t output_file_size(OutputFile *of)
+{
+    int64_t size = 0;
+
+    lock_muxer(of);
+    if (of->mux_ctx->pb)
+        size = FFMAX(avio_tell(of->mux_ctx->pb), 0);
+    size += atomic_load(&of->rotate_bytes);
+    unlock_muxer(of);
+    return size;
+}
+
+// 关闭 open_output_io() 打开的 AVIOContext, aio_pb 为 ffmpeg_aio.c 的写入时不为 NULL
+static void close_muxer_io(AVFormatContext *s, AVIOContext **aio_pb)
+{
+    if (*aio_pb)
     {
-        pkt->pts = pkt->dts = AV_NOPTS_VALUE;
+        s->pb = NULL;
+        async_io_close(aio_pb);
     }
+    else if (!(s->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&s->pb);
+}
 
-    if (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
-    {
-        int i;
-        uint8_t *sd = av_packet_get_side_data(pkt, AV_PKT_DATA_QUALITY_STATS,
-                                              NULL);
-        ost->quality = sd ? AV_RL32(sd) : -1;
-        ost->pict_type = sd ? sd[4] : AV_PICTURE_TYPE_NONE;
+// 写完一个分段文件的文件尾, 关闭并释放. of->ctx 只是模板, 不会传到这里
+static void close_muxer(OutputFile *of, AVFormatContext *s, AVIOContext *aio_pb)
+{
+    int64_t pos = 0, size = 0;
+    int ret;
 
-        for (i = 0; i < FF_ARRAY_ELEMS(ost->error); i++)
-        {
-            if (sd && i < sd[5])
-                ost->error[i] = AV_RL64(sd + 8 + 8 * i);
-            else
-                ost->error[i] = -1;
-        }
+    if (s->pb)
+        pos = avio_tell(s->pb);
+    if ((ret = av_write_trailer(s)) < 0)
+        av_log(NULL, AV_LOG_ERROR, "Error writing trailer of %s: %s\n", s->url, av_err2str(ret));
+    // 文件尾的大小, 文件头之后的部分已在 rotate_output_file() 中计入
+    if (s->pb)
+    {
+        size = avio_size(s->pb);
+        if (size <= 0)
+            size = avio_tell(s->pb);
+    }
+    if (size > pos)
+        atomic_fetch_add(&of->rotate_bytes, size - pos);
+    close_muxer_io(s, &aio_pb);
+    av_log(NULL, AV_LOG_VERBOSE, "Closed %s\n", s->url);
+    avformat_free_context(s);
+}
 
-        if (ost->frame_rate.num && ost->is_cfr)
-        {
-            if (pkt->duration > 0)
-                av_log(NULL, AV_LOG_WARNING, "Overriding packet duration by frame rate, this should not happen\n");
-            pkt->duration = av_rescale_q(1, av_inv_q(ost->frame_rate),
-                                         ost->mux_timebase);
-        }
-    }
+#if HAVE_THREADS
+// 分段文件的文件尾在关闭线程中写入, 不阻塞复用
+typedef struct RetiredMuxer
+{
+    OutputFile *of;
+    AVFormatContext *ctx;
+    AVIOContext *aio_pb;
+} RetiredMuxer;
 
-    // 将pkt 从ost->mux_timebase转成ost->st->time_base
-    // 即是从编码器转成 输出流的time_base
-    av_packet_rescale_ts(pkt, ost->mux_timebase, ost->st->time_base);
+static AVThreadMessageQueue *closer_queue;
+static pthread_t closer_thread;
 
-    if (!(s->oformat->flags & AVFMT_NOTIMESTAMPS))
-    {
-        if (pkt->dts != AV_NOPTS_VALUE &&
-            pkt->pts != AV_NOPTS_VALUE &&
-            pkt->dts > pkt->pts)
-        {
-            av_log(s, AV_LOG_WARNING, "Invalid DTS: %" PRId64 " PTS: %" PRId64 " in output stream %d:%d, replacing by guess\n",
-                   pkt->dts, pkt->pts,
-                   ost->file_index, ost->st->index);
-            pkt->pts =
-                pkt->dts = pkt->pts + pkt->dts + ost->last_mux_dts + 1 - FFMIN3(pkt->pts, pkt->dts, ost->last_mux_dts + 1) - FFMAX3(pkt->pts, pkt->dts, ost->last_mux_dts + 1);
-        }
-        if ((st->codecpar->codec_type == AVMEDIA_TYPE_AUDIO || st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO || st->codecpar->codec_type == AVMEDIA_TYPE_SUBTITLE) &&
-            pkt->dts != AV_NOPTS_VALUE &&
-            !(st->codecpar->codec_id == AV_CODEC_ID_VP9 && ost->stream_copy) &&
-            ost->last_mux_dts != AV_NOPTS_VALUE)
-        {
-            int64_t max = ost->last_mux_dts + !(s->oformat->flags & AVFMT_TS_NONSTRICT);
-            if (pkt->dts < max)
-            {
-                int loglevel = max - pkt->dts > 2 || st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO ? AV_LOG_WARNING : AV_LOG_DEBUG;
-                av_log(s, loglevel, "Non-monotonous DTS in output stream "
-                                    "%d:%d; previous: %" PRId64 ", current: %" PRId64 "; ",
-                       ost->file_index, ost->st->index, ost->last_mux_dts, pkt->dts);
-                if (exit_on_error)
-                {
-                    av_log(NULL, AV_LOG_FATAL, "aborting.\n");
-                    exit_program(1);
-                }
-                av_log(s, loglevel, "changing to %" PRId64 ". This may result "
-                                    "in incorrect timestamps in the output file.\n",
-                       max);
-                if (pkt->pts >= pkt->dts)
-                    pkt->pts = FFMAX(pkt->pts, max);
-                pkt->dts = max;
-            }
-        }
-    }
-    ost->last_mux_dts = pkt->dts;
+static void *closer_thread_main(void *arg)
+{
+    RetiredMuxer m;
 
-    ost->data_size += pkt->size;
-    ost->packets_written++;
+    while (av_thread_message_queue_recv(closer_queue, &m, 0) >= 0)
+        close_muxer(m.of, m.ctx, m.aio_pb);
 
-    pkt->stream_index = ost->index;
+    return NULL;
+}
 
-    if (debug_ts)
-    {
-        av_log(NULL, AV_LOG_INFO, "muxer <- type:%s "
-                                  "pkt_pts:%s pkt_pts_time:%s pkt_dts:%s pkt_dts_time:%s size:%d\n",
-               av_get_media_type_string(ost->enc_ctx->codec_type),
-               av_ts2str(pkt->pts), av_ts2timestr(pkt->pts, &ost->st->time_base),
-               av_ts2str(pkt->dts), av_ts2timestr(pkt->dts, &ost->st->time_base),
-               pkt->size);
-    }
+// 关闭队列中剩余的文件后退出
+static void free_closer_thread(void)
+{
+    if (!closer_queue)
+        return;
+    av_thread_message_queue_set_err_recv(closer_queue, AVERROR_EOF);
+    pthread_join(closer_thread, NULL);
+    av_thread_message_queue_free(&closer_queue);
+}
+
+static int init_closer_thread(void)
+{
+    int i, ret;
 
-    ret = av_interleaved_write_frame(s, pkt); // 交替写入packet
+    for (i = 0; i < nb_output_files && !output_files[i]->rotate_pattern; i++)
+        ;
+    if (i == nb_output_files)
+        return 0;
+
+    ret = av_thread_message_queue_alloc(&closer_queue, 16, sizeof(RetiredMuxer));
     if (ret < 0)
+        return ret;
+    if ((ret = pthread_create(&closer_thread, NULL, closer_thread_main, NULL)))
     {
-        print_error("av_interleaved_write_frame()", ret);
-        main_return_code = 1;
-        close_all_output_streams(ost, MUXER_FINISHED | ENCODER_FINISHED, ENCODER_FINISHED);
+        av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
+        av_thread_message_queue_free(&closer_queue);
+        return AVERROR(ret);
     }
-    av_packet_unref(pkt);
+    return 0;
 }
+#endif
 
-static void close_output_stream(OutputStream *ost)
+// 包括第0个文件在内都是 open_next_muxer() 打开的, 可以交给关闭线程
+static void retire_muxer(OutputFile *of, AVFormatContext *s, AVIOContext *aio_pb)
 {
-    OutputFile *of = output_files[ost->file_index];
-
-    ost->finished |= ENCODER_FINISHED;
-    if (of->shortest)
+#if HAVE_THREADS
+    if (closer_queue)
     {
-        // enc_ctx->time_base转成微妙
-        int64_t end = av_rescale_q(ost->sync_opts - ost->first_pts, ost->enc_ctx->time_base, AV_TIME_BASE_Q);
-        of->recording_time = FFMIN(of->recording_time, end);
+        RetiredMuxer m = {of, s, aio_pb};
+        if (av_thread_message_queue_send(closer_queue, &m, 0) >= 0)
+            return;
     }
+#endif
+    close_muxer(of, s, aio_pb);
 }
 
-/**
- * @brief output_packet 输出packet
- * @param of    属于哪个输出文件
- * @param pkt   输出包
- * @param ost   属于哪个输出流
- * @param eof   是否结束
- */
-static void output_packet(OutputFile *of, AVPacket *pkt,
-                          OutputStream *ost, int eof)
+// 以 of->ctx 的流为模板打开下一个分段文件, 第0个文件在 check_init_output_file() 中由这里打开
+static int open_next_muxer(OutputFile *of, AVFormatContext **next, AVIOContext **next_aio_pb)
 {
-    int ret = 0;
+    AVFormatContext *s = NULL;
+    AVIOContext *aio_pb = NULL;
+    AVDictionary *opts = NULL;
+    char filename[1024];
+    int i, j, ret;
+
+    av_get_frame_filename2(filename, sizeof(filename), of->rotate_pattern, of->rotate_index + 1, 0);
+    ret = avformat_alloc_output_context2(&s, of->ctx->oformat, NULL, filename);
+    if (!s)
+        return ret;
+    s->interrupt_callback = int_cb;
+    s->flags = of->ctx->flags;
+    s->max_delay = of->ctx->max_delay;
+    av_dict_copy(&s->metadata, of->ctx->metadata, 0);
 
-    // 是否应用输出流 bitstream过滤器
-    if (ost->nb_bitstream_filters)
+    for (i = 0; i < of->ctx->nb_streams; i++)
     {
-        int idx;
+        AVStream *in = of->ctx->streams[i];
+        AVStream *out = avformat_new_stream(s, NULL);
 
-        ret = av_bsf_send_packet(ost->bsf_ctx[0], eof ? NULL : pkt);
-        if (ret < 0)
+        if (!out)
         {
-            goto finish;
+            ret = AVERROR(ENOMEM);
+            goto fail;
         }
-
-        eof = 0;
-        idx = 1;
-        while (idx)
-        {
-            /* get a packet from the previous filter up the chain */
-            ret = av_bsf_receive_packet(ost->bsf_ctx[idx - 1], pkt);
-            if (ret == AVERROR(EAGAIN))
-            {
-                ret = 0;
-                idx--;
-                continue;
-            }
-            else if (ret == AVERROR_EOF)
+        if ((ret = avcodec_parameters_copy(out->codecpar, in->codecpar)) < 0)
+            goto fail;
+        out->id = in->id;
+        out->time_base = in->time_base;
+        out->avg_frame_rate = in->avg_frame_rate;
+        out->disposition = in->disposition;
+        av_dict_copy(&out->metadata, in->metadata, 0);
+        for (j = 0; j < in->nb_side_data; j++)
+        {
+            uint8_t *dst = av_stream_new_side_data(out, in->side_data[j].type, in->side_data[j].size);
+            if (!dst)
             {
-                eof = 1;
+                ret = AVERROR(ENOMEM);
+                goto fail;
             }
-            else if (ret < 0)
-                goto finish;
+            memcpy(dst, in->side_data[j].data, in->side_data[j].size);
+        }
+    }
+    for (i = 0; i < of->ctx->nb_programs; i++)
+    {
+        AVProgram *in = of->ctx->programs[i];
+        AVProgram *out = av_new_program(s, in->id);
 
-            /* send it to the next filter down the chain or to the muxer */
-            if (idx < ost->nb_bitstream_filters)
-            {
-                ret = av_bsf_send_packet(ost->bsf_ctx[idx], eof ? NULL : pkt);
-                if (ret < 0)
-                    goto finish;
-                idx++;
-                eof = 0;
-            }
-            else if (eof)
-                goto finish;
-            else
-                write_packet(of, pkt, ost, 0);
+        if (!out)
+        {
+            ret = AVERROR(ENOMEM);
+            goto fail;
         }
+        av_dict_copy(&out->metadata, in->metadata, 0);
+        for (j = 0; j < in->nb_stream_indexes; j++)
+            av_program_add_stream_index(s, out->id, in->stream_index[j]);
     }
-    else if (!eof)
+    // 时长和章节对应整个输出, 只写入第0个文件
+    if (of->rotate_index < 0)
     {
-        write_packet(of, pkt, ost, 0);
+        s->duration = of->ctx->duration;
+        if (of->ctx->nb_chapters &&
+            !(s->chapters = av_mallocz_array(of->ctx->nb_chapters, sizeof(*s->chapters))))
+        {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        for (i = 0; i < of->ctx->nb_chapters; i++)
+        {
+            AVChapter *in = of->ctx->chapters[i];
+            AVChapter *out = av_mallocz(sizeof(*out));
+
+            if (!out)
+            {
+                ret = AVERROR(ENOMEM);
+                goto fail;
+            }
+            out->id = in->id;
+            out->time_base = in->time_base;
+            out->start = in->start;
+            out->end = in->end;
+            av_dict_copy(&out->metadata, in->metadata, 0);
+            s->chapters[s->nb_chapters++] = out;
+        }
     }
 
-finish:
-    if (ret < 0 && ret != AVERROR_EOF)
-    {
-        av_log(NULL, AV_LOG_ERROR, "Error applying bitstream filters to an output "
-                                   "packet for stream #%d:%d.\n",
-               ost->file_index, ost->index);
-        if (exit_on_error)
-            exit_program(1);
-    }
+    // 协议参数由 open_output_io() 取走, 其余的交给复用器
+    av_dict_copy(&opts, of->rotate_opts, 0);
+    if (!(s->oformat->flags & AVFMT_NOFILE) &&
+        (ret = open_output_io(of, s, filename, &opts, &aio_pb)) < 0)
+        goto fail;
+    ret = avformat_write_header(s, &opts);
+    if (ret < 0)
+        goto fail;
+    av_dict_free(&opts);
+
+    of->rotate_index++;
+    *next = s;
+    *next_aio_pb = aio_pb;
+    return 0;
+
+fail:
+    av_log(NULL, AV_LOG_ERROR, "Could not open the next output file %s: %s\n", filename, av_err2str(ret));
+    av_dict_free(&opts);
+    close_muxer_io(s, &aio_pb);
+    avformat_free_context(s);
+    return ret;
 }
 
-static int check_recording_time(OutputStream *ost)
+// -rotate_time/-rotate_size: 到了切换点时打开下一个文件, 当前的文件交给关闭线程
+static int rotate_output_file(OutputFile *of, const AVPacket *pkt)
 {
-    OutputFile *of = output_files[ost->file_index];
-    //av_compare_ts - 1 if `ts_a` is after `ts_b`
-    if (of->recording_time != INT64_MAX &&
-        av_compare_ts(ost->sync_opts - ost->first_pts, ost->enc_ctx->time_base, of->recording_time,
-                      AV_TIME_BASE_Q) >= 0)
+    AVStream *st = of->ctx->streams[pkt->stream_index];
+    int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+    AVFormatContext *next;
+    AVIOContext *next_aio_pb;
+    int i, ret;
+
+    if (ts != AV_NOPTS_VALUE)
+        ts = av_rescale_q(ts, st->time_base, AV_TIME_BASE_Q);
+    if (of->rotate_start == AV_NOPTS_VALUE)
     {
-        close_output_stream(ost);
+        // 有视频时在第一个视频流的关键帧处切换, 否则任意包都可以
+        of->rotate_stream = -1;
+        for (i = 0; i < of->ctx->nb_streams; i++)
+        {
+            AVStream *s = of->ctx->streams[i];
+            if (s->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && !(s->disposition & AV_DISPOSITION_ATTACHED_PIC))
+            {
+                of->rotate_stream = i;
+                break;
+            }
+        }
+        of->rotate_start = ts;
         return 0;
     }
-    return 1;
+
+    if (of->rotate_stream >= 0 &&
+        (pkt->stream_index != of->rotate_stream || !(pkt->flags & AV_PKT_FLAG_KEY)))
+        return 0;
+    if (!(of->rotate_time > 0 && ts != AV_NOPTS_VALUE && of->rotate_start != AV_NOPTS_VALUE &&
+          ts - of->rotate_start >= of->rotate_time) &&
+        !(of->rotate_size > 0 && of->mux_ctx->pb && avio_tell(of->mux_ctx->pb) >= of->rotate_size))
+        return 0;
+
+#if HAVE_THREADS
+    /* 有复用线程时只有它写这个文件, 打开下一个文件期间释放 mux_lock,
+     * 主线程的 need_output() 和 print_report() 不必等待.
+     * 没有复用线程时在持有 of->lock 的线程中打开 */
+    if (of->mux_queue)
+        pthread_mutex_unlock(&of->mux_lock);
+#endif
+    ret = open_next_muxer(of, &next, &next_aio_pb);
+#if HAVE_THREADS
+    if (of->mux_queue)
+        pthread_mutex_lock(&of->mux_lock);
+#endif
+    if (ret < 0)
+        return ret;
+    av_log(NULL, AV_LOG_INFO, "Continuing output in %s\n", next->url);
+    if (of->mux_ctx->pb)
+        atomic_fetch_add(&of->rotate_bytes, avio_tell(of->mux_ctx->pb));
+    retire_muxer(of, of->mux_ctx, of->aio_pb);
+    of->mux_ctx = next;
+    of->aio_pb = next_aio_pb;
+    of->rotate_start = ts;
+    return 0;
 }
 
-// 编码音频
-static void do_audio_out(OutputFile *of, OutputStream *ost,
-                         AVFrame *frame)
+/**
+ * 将包写入复用器, 调用者需持有 lock_muxer(of).
+ * pkt 的时间戳使用 of->ctx 中流的 time_base.
+ */
+static int mux_write_packet(OutputFile *of, AVPacket *pkt)
 {
-    AVCodecContext *enc = ost->enc_ctx;
-    AVPacket pkt;
+    AVStream *st = of->ctx->streams[pkt->stream_index];
+    AVStream *mux_st;
     int ret;
 
-    av_init_packet(&pkt);
-    pkt.data = NULL;
-    pkt.size = 0;
+    if (!of->rotate_pattern)
+        return av_interleaved_write_frame(of->ctx, pkt);
 
-    if (!check_recording_time(ost))
+    if ((ret = rotate_output_file(of, pkt)) < 0)
     {
-        return;
+        av_packet_unref(pkt);
+        return ret;
     }
+    mux_st = of->mux_ctx->streams[pkt->stream_index];
+    av_packet_rescale_ts(pkt, st->time_base, mux_st->time_base);
+    ret = av_interleaved_write_frame(of->mux_ctx, pkt);
+    // 输出调度按 of->ctx 中流的 cur_dts 进行
+    if (mux_st != st && mux_st->cur_dts != AV_NOPTS_VALUE)
+        st->cur_dts = av_rescale_q(mux_st->cur_dts, mux_st->time_base, st->time_base);
+    return ret;
+}
 
-    if (frame->pts == AV_NOPTS_VALUE || audio_sync_method < 0)
+#if HAVE_THREADS
+static void free_mux_packet(void *arg)
+{
+    av_packet_unref(arg);
+}
+
+// 输出文件的复用线程: 从队列中取出包写入复用器, 慢的磁盘或管道不再阻塞编码
+static void *mux_thread(void *arg)
+{
+    OutputFile *of = arg;
+    AVPacket pkt;
+    int ret;
+
+    while (av_thread_message_queue_recv(of->mux_queue, &pkt, 0) >= 0)
     {
-        frame->pts = ost->sync_opts;
+        OutputStream *ost = output_streams[of->ost_index + pkt.stream_index];
+
+        pthread_mutex_lock(&of->mux_lock);
+        ret = mux_write_packet(of, &pkt);
+        pthread_mutex_unlock(&of->mux_lock);
+        av_packet_unref(&pkt);
+        if (ret < 0)
+        {
+            print_error("av_interleaved_write_frame()", ret);
+            of->mux_error = ret;
+            of->mux_error_ost = ost;
+            // 之后 write_packet() 送包时得到这个错误
+            av_thread_message_queue_set_err_send(of->mux_queue, ret);
+            break;
+        }
     }
-    ost->sync_opts = frame->pts + frame->nb_samples;
-    ost->samples_encoded += frame->nb_samples;
-    ost->frames_encoded++;
 
-    av_assert0(pkt.size || !pkt.data);
-    update_benchmark(NULL);
-    if (debug_ts)
+    return NULL;
+}
+
+// 调用者需持有 of->lock. 队列满时阻塞, 返回复用线程的错误
+static int send_to_mux_thread(OutputFile *of, AVPacket *pkt)
+{
+    AVPacket tmp_pkt;
+    int64_t t;
+    int ret;
+
+    ret = av_packet_make_refcounted(pkt);
+    if (ret < 0)
+        return ret;
+    av_packet_move_ref(&tmp_pkt, pkt);
+
+    of->mux_packets++;
+    ret = av_thread_message_queue_send(of->mux_queue, &tmp_pkt, AV_THREAD_MESSAGE_NONBLOCK);
+    if (ret == AVERROR(EAGAIN))
     {
-        av_log(NULL, AV_LOG_INFO, "encoder <- type:audio "
-                                  "frame_pts:%s frame_pts_time:%s time_base:%d/%d\n",
-               av_ts2str(frame->pts), av_ts2timestr(frame->pts, &enc->time_base),
-               enc->time_base.num, enc->time_base.den);
+        of->mux_blocked++;
+        t = av_gettime_relative();
+        ret = av_thread_message_queue_send(of->mux_queue, &tmp_pkt, 0);
+        of->mux_blocked_time += av_gettime_relative() - t;
     }
-
-    ret = avcodec_send_frame(enc, frame);
     if (ret < 0)
+        av_packet_unref(&tmp_pkt);
+    return ret;
+}
+
+/**
+ * 等待复用线程写完队列中的包并退出, 复用线程的错误与同步写入时一样
+ * 通过 close_all_output_streams() 结束输出.
+ * abort 不为0时丢弃队列中尚未写入的包.
+ */
+static void free_mux_thread(OutputFile *of, int abort)
+{
+    if (!of || !of->mux_queue)
+        return;
+
+    if (abort)
+        av_thread_message_flush(of->mux_queue);
+    av_thread_message_queue_set_err_recv(of->mux_queue, AVERROR_EOF);
+    pthread_join(of->mux_thread, NULL);
+    av_thread_message_flush(of->mux_queue);
+    av_thread_message_queue_free(&of->mux_queue);
+    pthread_mutex_destroy(&of->mux_lock);
+
+    if (of->mux_error < 0)
     {
-        goto error;
+        main_return_code = 1;
+        close_all_output_streams(of->mux_error_ost, MUXER_FINISHED | ENCODER_FINISHED, ENCODER_FINISHED);
     }
+}
 
-    while (1)
+static void free_mux_threads(int abort)
+{
+    int i;
+
+    for (i = 0; i < nb_output_files; i++)
+        free_mux_thread(output_files[i], abort);
+}
+
+static int init_mux_threads(void)
+{
+    int i, ret;
+
+    for (i = 0; i < nb_output_files; i++)
     {
-        ret = avcodec_receive_packet(enc, &pkt);
-        if (ret == AVERROR(EAGAIN))
-            break;
-        if (ret < 0)
-            goto error;
+        OutputFile *of = output_files[i];
 
-        update_benchmark("encode_audio %d.%d", ost->file_index, ost->index);
+        if (of->mux_queue_size <= 0)
+            continue;
 
-        av_packet_rescale_ts(&pkt, enc->time_base, ost->mux_timebase); // 转换时间戳
+        ret = av_thread_message_queue_alloc(&of->mux_queue, of->mux_queue_size, sizeof(AVPacket));
+        if (ret < 0)
+            return ret;
+        av_thread_message_queue_set_free_func(of->mux_queue, free_mux_packet);
+        pthread_mutex_init(&of->mux_lock, NULL);
 
-        if (debug_ts)
+        if ((ret = pthread_create(&of->mux_thread, NULL, mux_thread, of)))
         {
-            av_log(NULL, AV_LOG_INFO, "encoder -> type:audio "
-                                      "pkt_pts:%s pkt_pts_time:%s pkt_dts:%s pkt_dts_time:%s\n",
-                   av_ts2str(pkt.pts), av_ts2timestr(pkt.pts, &enc->time_base),
-                   av_ts2str(pkt.dts), av_ts2timestr(pkt.dts, &enc->time_base));
+            av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
+            av_thread_message_queue_free(&of->mux_queue);
+            pthread_mutex_destroy(&of->mux_lock);
+            return AVERROR(ret);
         }
-
-        output_packet(of, &pkt, ost, 0);
     }
 
-    return;
-error:
-    av_log(NULL, AV_LOG_FATAL, "Audio encoding failed\n");
-    exit_program(1);
+    return 0;
 }
+#endif
 
-// 编码视频.
-static void do_video_out(OutputFile *of,
-                         OutputStream *ost,
-                         AVFrame *next_picture,
-                         double sync_ipts)
+/*
+ * 溢出到磁盘的包在 muxing_queue 中只保留 AVPacket 结构 (data 为 NULL, size 为原大小),
+ * 数据按入队顺序写入临时文件, 出队时按相同顺序读回.
+ */
+static FILE *open_muxing_queue_spill(OutputStream *ost)
 {
-    int ret, format_video_sync;
-    AVPacket pkt;
-    AVCodecContext *enc = ost->enc_ctx;
-    AVCodecParameters *mux_par = ost->st->codecpar;
-    AVRational frame_rate;
-    int nb_frames, nb0_frames, i;
-    double delta, delta0;
-    double duration = 0;
-    int frame_size = 0;
-    InputStream *ist = NULL;
-    AVFilterContext *filter = ost->filter->filter;
+    FILE *f = NULL;
+#if HAVE_MKSTEMP
+    char *path = av_asprintf("%s/ffmpeg-muxq-%d-%d-XXXXXX", muxing_queue_spill_dir,
+                             ost->file_index, ost->index);
+    int fd = path ? mkstemp(path) : -1;
 
-    if (ost->source_index >= 0)
-        ist = input_streams[ost->source_index];
+    if (fd >= 0)
+    {
+        // 文件删除后仍可通过 f 读写, 退出时自动释放
+        unlink(path);
+        if (!(f = fdopen(fd, "w+b")))
+            close(fd);
+    }
+    av_free(path);
+#else
+    f = tmpfile();
+#endif
+    if (!f)
+        av_log(NULL, AV_LOG_ERROR, "Cannot create a muxing queue file in %s for output stream %d:%d: %s\n",
+               muxing_queue_spill_dir, ost->file_index, ost->index, strerror(errno));
+    return f;
+}
 
-    frame_rate = av_buffersink_get_frame_rate(filter);
-    if (frame_rate.num > 0 && frame_rate.den > 0)
-        duration = 1 / (av_q2d(frame_rate) * av_q2d(enc->time_base));
+static int muxing_queue_spill(OutputStream *ost, AVPacket *pkt)
+{
+    if (!ost->muxing_queue_spill)
+    {
+        if (!(ost->muxing_queue_spill = open_muxing_queue_spill(ost)))
+            return AVERROR(errno);
+        av_log(NULL, AV_LOG_VERBOSE, "Muxing queue of output stream %d:%d is over %" PRId64 " bytes, "
+               "buffering it on disk\n", ost->file_index, ost->index, ost->muxing_queue_data_threshold);
+    }
+    if (fwrite(pkt->data, 1, pkt->size, ost->muxing_queue_spill) != (size_t)pkt->size)
+        return AVERROR(errno);
+    ost->muxing_queue_spilled += pkt->size;
 
-    if (ist && ist->st->start_time != AV_NOPTS_VALUE && ist->st->first_dts != AV_NOPTS_VALUE && ost->frame_rate.num)
-        duration = FFMIN(duration, 1 / (av_q2d(ost->frame_rate) * av_q2d(enc->time_base)));
+    av_buffer_unref(&pkt->buf);
+    pkt->data = NULL;
+    return 0;
+}
 
-    if (!ost->filters_script &&
-        !ost->filters &&
-        (nb_filtergraphs == 0 || !filtergraphs[0]->graph_desc) &&
-        next_picture &&
-        ist &&
-        lrintf(next_picture->pkt_duration * av_q2d(ist->st->time_base) / av_q2d(enc->time_base)) > 0)
+// 从 muxing_queue 取出一个包, 溢出到磁盘的数据读回内存
+static int muxing_queue_read(OutputStream *ost, AVPacket *pkt)
+{
+    int ret;
+
+    av_fifo_generic_read(ost->muxing_queue, pkt, sizeof(*pkt), NULL);
+    if (pkt->data || !pkt->size)
     {
-        duration = lrintf(next_picture->pkt_duration * av_q2d(ist->st->time_base) / av_q2d(enc->time_base));
+        ost->muxing_queue_data_size -= pkt->size;
+        return 0;
     }
 
-    if (!next_picture)
+    if ((ret = av_buffer_realloc(&pkt->buf, pkt->size + AV_INPUT_BUFFER_PADDING_SIZE)) < 0)
+        return ret;
+    pkt->data = pkt->buf->data;
+    memset(pkt->data + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    if (fread(pkt->data, 1, pkt->size, ost->muxing_queue_spill) != (size_t)pkt->size)
+        return AVERROR(EIO);
+    return 0;
+}
+
+/*
+ * 调用者需持有 of->lock. 返回<0为致命错误, 调用者先释放 of->lock 再处理:
+ * 主线程中 exit_program(), 编码线程中把错误交给主线程.
+ * 写入复用器失败不是致命错误, 它结束该文件的所有输出流.
+ */
+static int write_packet(OutputFile *of, AVPacket *pkt, OutputStream *ost, int unqueue)
+{
+    AVFormatContext *s = of->ctx;
+    AVStream *st = ost->st;
+    int ret;
+
+    /*
+     * Audio encoders may split the packets --  #frames in != #packets out.
+     * But there is no reordering, so we can limit the number of output packets
+     * by simply dropping them here.
+     * Counting encoded video frames needs to be done separately because of
+     * reordering, see do_video_out().
+     * Do not count the packet when unqueued because it has been counted when queued.
+     */
+    if (!(st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && ost->encoding_needed) && !unqueue)
     {
-        //end, flushing
-        nb0_frames = nb_frames = mid_pred(ost->last_nb0_frames[0],
-                                          ost->last_nb0_frames[1],
-                                          ost->last_nb0_frames[2]);
+        if (ost->frame_number >= ost->max_frames)
+        {
+            av_packet_unref(pkt);
+            return 0;
+        }
+        ost->frame_number++;
     }
-    else
-    {
-        delta0 = sync_ipts - ost->sync_opts; // delta0 is the "drift" between the input frame (next_picture) and where it would fall in the output.
-        delta = delta0 + duration;
 
-        /* by default, we output a single frame */
-        nb0_frames = 0; // tracks the number of times the PREVIOUS frame should be duplicated, mostly for variable framerate (VFR)
-        nb_frames = 1;
+    if (!of->header_written) // 头部还没有写入
+    {
+        AVPacket tmp_pkt = {0};
+        // 数据量超过阈值后, 要么溢出到磁盘, 要么限制包的个数
+        int over_size = ost->muxing_queue_data_size + pkt->size > ost->muxing_queue_data_threshold;
+        int spill = over_size && muxing_queue_spill_dir && pkt->size;
 
-        format_video_sync = video_sync_method;
-        if (format_video_sync == VSYNC_AUTO)
+        /* the muxer is not initialized yet, buffer the packet */
+        if (!av_fifo_space(ost->muxing_queue))
         {
-            if (!strcmp(of->ctx->oformat->name, "avi"))
-            {
-                format_video_sync = VSYNC_VFR;
-            }
-            else
-                format_video_sync = (of->ctx->oformat->flags & AVFMT_VARIABLE_FPS) ? ((of->ctx->oformat->flags & AVFMT_NOTIMESTAMPS) ? VSYNC_PASSTHROUGH : VSYNC_VFR) : VSYNC_CFR;
-            if (ist && format_video_sync == VSYNC_CFR && input_files[ist->file_index]->ctx->nb_streams == 1 && input_files[ist->file_index]->input_ts_offset == 0)
+            int limit = over_size && !spill ? ost->max_muxing_queue_size : INT_MAX;
+            int new_size = FFMIN(2 * (int64_t)av_fifo_size(ost->muxing_queue), limit);
+            if (new_size <= av_fifo_size(ost->muxing_queue))
             {
-                format_video_sync = VSYNC_VSCFR;
+                av_log(NULL, AV_LOG_ERROR,
+                       "Too many packets buffered for output stream %d:%d. "
+                       "Consider raising -max_muxing_queue_size or -muxing_queue_data_threshold, "
+                       "or setting -muxing_queue_spill_dir.\n",
+                       ost->file_index, ost->st->index);
+                av_packet_unref(pkt);
+                return AVERROR(ENOSPC);
             }
-            if (format_video_sync == VSYNC_CFR && copy_ts)
+            ret = av_fifo_realloc2(ost->muxing_queue, new_size);
+            if (ret < 0)
             {
-                format_video_sync = VSYNC_VSCFR;
+                av_packet_unref(pkt);
+                return ret;
             }
         }
-        ost->is_cfr = (format_video_sync == VSYNC_CFR || format_video_sync == VSYNC_VSCFR);
-
-        if (delta0 < 0 &&
-            delta > 0 &&
-            format_video_sync != VSYNC_PASSTHROUGH &&
-            format_video_sync != VSYNC_DROP)
+        if (spill)
         {
-            if (delta0 < -0.6)
+            ret = muxing_queue_spill(ost, pkt);
+            if (ret < 0)
             {
-                av_log(NULL, AV_LOG_VERBOSE, "Past duration %f too large\n", -delta0);
+                av_log(NULL, AV_LOG_ERROR, "Error buffering output stream %d:%d on disk: %s\n",
+                       ost->file_index, ost->st->index, av_err2str(ret));
+                av_packet_unref(pkt);
+                return ret;
             }
-            else
-                av_log(NULL, AV_LOG_DEBUG, "Clipping frame in rate conversion by %f\n", -delta0);
-            sync_ipts = ost->sync_opts;
-            duration += delta0;
-            delta0 = 0;
         }
-
-        switch (format_video_sync)
+        else
         {
-        case VSYNC_VSCFR:
-            if (ost->frame_number == 0 && delta0 >= 0.5)
+            ret = av_packet_make_refcounted(pkt);
+            if (ret < 0)
             {
-                av_log(NULL, AV_LOG_DEBUG, "Not duplicating %d initial frames\n", (int)lrintf(delta0));
-                delta = duration;
-                delta0 = 0;
-                ost->sync_opts = lrint(sync_ipts);
+                av_packet_unref(pkt);
+                return ret;
             }
-        case VSYNC_CFR:
-            // FIXME set to 0.5 after we fix some dts/pts bugs like in avidec.c
-            if (frame_drop_threshold && delta < frame_drop_threshold && ost->frame_number)
+            ost->muxing_queue_data_size += pkt->size;
+        }
+        av_packet_move_ref(&tmp_pkt, pkt);
+        av_fifo_generic_write(ost->muxing_queue, &tmp_pkt, sizeof(tmp_pkt), NULL);
+        return 0;
+    }
+
+    if ((st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && video_sync_method == VSYNC_DROP) ||
+        (st->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && audio_sync_method < 0))
+    {
+        pkt->pts = pkt->dts = AV_NOPTS_VALUE;
+    }
+
+    if (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+        int i;
+        uint8_t *sd = av_packet_get_side_data(pkt, AV_PKT_DATA_QUALITY_STATS,
+                                              NULL);
+        ost->quality = sd ? AV_RL32(sd) : -1;
+        ost->pict_type = sd ? sd[4] : AV_PICTURE_TYPE_NONE;
+
+        for (i = 0; i < FF_ARRAY_ELEMS(ost->error); i++)
+        {
+            if (sd && i < sd[5])
+                ost->error[i] = AV_RL64(sd + 8 + 8 * i);
+            else
+                ost->error[i] = -1;
+        }
+
+        if (ost->frame_rate.num && ost->is_cfr)
+        {
+            if (pkt->duration > 0)
+                av_log(NULL, AV_LOG_WARNING, "Overriding packet duration by frame rate, this should not happen\n");
+            pkt->duration = av_rescale_q(1, av_inv_q(ost->frame_rate),
+                                         ost->mux_timebase);
+        }
+    }
+
+    // 将pkt 从ost->mux_timebase转成ost->st->time_base
+    // 即是从编码器转成 输出流的time_base
+    av_packet_rescale_ts(pkt, ost->mux_timebase, ost->st->time_base);
+
+    if (!(s->oformat->flags & AVFMT_NOTIMESTAMPS))
+    {
+        if (pkt->dts != AV_NOPTS_VALUE &&
+            pkt->pts != AV_NOPTS_VALUE &&
+            pkt->dts > pkt->pts)
+        {
+            av_log(s, AV_LOG_WARNING, "Invalid DTS: %" PRId64 " PTS: %" PRId64 " in output stream %d:%d, replacing by guess\n",
+                   pkt->dts, pkt->pts,
+                   ost->file_index, ost->st->index);
+            pkt->pts =
+                pkt->dts = pkt->pts + pkt->dts + ost->last_mux_dts + 1 - FFMIN3(pkt->pts, pkt->dts, ost->last_mux_dts + 1) - FFMAX3(pkt->pts, pkt->dts, ost->last_mux_dts + 1);
+        }
+        if ((st->codecpar->codec_type == AVMEDIA_TYPE_AUDIO || st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO || st->codecpar->codec_type == AVMEDIA_TYPE_SUBTITLE) &&
+            pkt->dts != AV_NOPTS_VALUE &&
+            !(st->codecpar->codec_id == AV_CODEC_ID_VP9 && ost->stream_copy) &&
+            ost->last_mux_dts != AV_NOPTS_VALUE)
+        {
+            int64_t max = ost->last_mux_dts + !(s->oformat->flags & AVFMT_TS_NONSTRICT);
+            if (pkt->dts < max)
+            {
+                int loglevel = max - pkt->dts > 2 || st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO ? AV_LOG_WARNING : AV_LOG_DEBUG;
+                av_log(s, loglevel, "Non-monotonous DTS in output stream "
+                                    "%d:%d; previous: %" PRId64 ", current: %" PRId64 "; ",
+                       ost->file_index, ost->st->index, ost->last_mux_dts, pkt->dts);
+                if (exit_on_error)
+                {
+                    av_log(NULL, AV_LOG_FATAL, "aborting.\n");
+                    av_packet_unref(pkt);
+                    return AVERROR(EINVAL);
+                }
+                av_log(s, loglevel, "changing to %" PRId64 ". This may result "
+                                    "in incorrect timestamps in the output file.\n",
+                       max);
+                if (pkt->pts >= pkt->dts)
+                    pkt->pts = FFMAX(pkt->pts, max);
+                pkt->dts = max;
+            }
+        }
+    }
+    ost->last_mux_dts = pkt->dts;
+
+    ost->data_size += pkt->size;
+    ost->packets_written++;
+
+    pkt->stream_index = ost->index;
+
+    if (debug_ts)
+    {
+        av_log(NULL, AV_LOG_INFO, "muxer <- type:%s "
+                                  "pkt_pts:%s pkt_pts_time:%s pkt_dts:%s pkt_dts_time:%s size:%d\n",
+               av_get_media_type_string(ost->enc_ctx->codec_type),
+               av_ts2str(pkt->pts), av_ts2timestr(pkt->pts, &ost->st->time_base),
+               av_ts2str(pkt->dts), av_ts2timestr(pkt->dts, &ost->st->time_base),
+               pkt->size);
+    }
+
+#if HAVE_THREADS
+    if (of->mux_queue)
+        ret = send_to_mux_thread(of, pkt); // 写入的错误由复用线程打印
+    else
+#endif
+    {
+        ret = mux_write_packet(of, pkt); // 交替写入packet
+        if (ret < 0)
+            print_error("av_interleaved_write_frame()", ret);
+    }
+    if (ret < 0)
+    {
+        main_return_code = 1;
+        close_all_output_streams(ost, MUXER_FINISHED | ENCODER_FINISHED, ENCODER_FINISHED);
+    }
+    av_packet_unref(pkt);
+    return 0;
+}
+
+static void close_output_stream(OutputStream *ost)
+{
+    OutputFile *of = output_files[ost->file_index];
+
+    atomic_fetch_or(&ost->finished, ENCODER_FINISHED);
+    if (of->shortest)
+    {
+        int64_t end;
+        // 各个流的编码线程都可能缩短 recording_time, 在 of->lock 内读写
+        lock_output_file(of);
+        // enc_ctx->time_base转成微妙
+        end = av_rescale_q(ost->sync_opts - ost->first_pts, ost->enc_ctx->time_base, AV_TIME_BASE_Q);
+        of->recording_time = FFMIN(of->recording_time, end);
+        unlock_output_file(of);
+    }
+}
+
+static int64_t get_recording_time(OutputFile *of)
+{
+    int64_t recording_time;
+
+    lock_output_file(of);
+    recording_time = of->recording_time;
+    unlock_output_file(of);
+    return recording_time;
+}
+
+/**
+ * @brief output_packet 输出packet
+ * @param of    属于哪个输出文件
+ * @param pkt   输出包
+ * @param ost   属于哪个输出流
+ * @param eof   是否结束
+ * @return <0 为致命错误, 见 write_packet()
+ */
+static int output_packet(OutputFile *of, AVPacket *pkt,
+                         OutputStream *ost, int eof)
+{
+    int ret = 0;
+
+    // 先分发给 -share_encoder 的流, 它们有各自的 bitstream 过滤器和复用器
+    if (ost->nb_enc_shares && (ret = share_packet(ost, pkt, eof)) < 0)
+        return ret;
+
+    // 是否应用输出流 bitstream过滤器
+    if (ost->nb_bitstream_filters)
+    {
+        int idx;
+
+        ret = av_bsf_send_packet(ost->bsf_ctx[0], eof ? NULL : pkt);
+        if (ret < 0)
+        {
+            goto finish;
+        }
+
+        eof = 0;
+        idx = 1;
+        while (idx)
+        {
+            /* get a packet from the previous filter up the chain */
+            ret = av_bsf_receive_packet(ost->bsf_ctx[idx - 1], pkt);
+            if (ret == AVERROR(EAGAIN))
+            {
+                ret = 0;
+                idx--;
+                continue;
+            }
+            else if (ret == AVERROR_EOF)
+            {
+                eof = 1;
+            }
+            else if (ret < 0)
+                goto finish;
+
+            /* send it to the next filter down the chain or to the muxer */
+            if (idx < ost->nb_bitstream_filters)
+            {
+                ret = av_bsf_send_packet(ost->bsf_ctx[idx], eof ? NULL : pkt);
+                if (ret < 0)
+                    goto finish;
+                idx++;
+                eof = 0;
+            }
+            else if (eof)
+                goto finish;
+            else
+            {
+                lock_output_file(of);
+                ret = write_packet(of, pkt, ost, 0);
+                unlock_output_file(of);
+                if (ret < 0)
+                    return ret;
+            }
+        }
+    }
+    else if (!eof)
+    {
+        lock_output_file(of);
+        ret = write_packet(of, pkt, ost, 0);
+        unlock_output_file(of);
+        return ret;
+    }
+
+finish:
+    if (ret < 0 && ret != AVERROR_EOF)
+    {
+        av_log(NULL, AV_LOG_ERROR, "Error applying bitstream filters to an output "
+                                   "packet for stream #%d:%d.\n",
+               ost->file_index, ost->index);
+        if (exit_on_error)
+            return ret;
+    }
+    return 0;
+}
+
+static int check_recording_time(OutputStream *ost)
+{
+    OutputFile *of = output_files[ost->file_index];
+    int64_t recording_time = get_recording_time(of);
+    //av_compare_ts - 1 if `ts_a` is after `ts_b`
+    if (recording_time != INT64_MAX &&
+        av_compare_ts(ost->sync_opts - ost->first_pts, ost->enc_ctx->time_base, recording_time,
+                      AV_TIME_BASE_Q) >= 0)
+    {
+        close_output_stream(ost);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * sync_opts 和 frame_number 可能在编码线程中修改, 修改时持有 of->lock,
+ * 主线程的 need_output() 等在锁内读取. 编码线程读取自己的值不需要加锁.
+ */
+static void set_sync_opts(OutputFile *of, OutputStream *ost, int64_t sync_opts)
+{
+    lock_output_file(of);
+    ost->sync_opts = sync_opts;
+    unlock_output_file(of);
+}
+
+// 编码音频, 返回<0为致命错误
+static int do_audio_out(OutputFile *of, OutputStream *ost,
+                        AVFrame *frame)
+{
+    AVCodecContext *enc = ost->enc_ctx;
+    AVPacket pkt;
+    int ret;
+
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+
+    if (!check_recording_time(ost))
+    {
+        return 0;
+    }
+
+    if (frame->pts == AV_NOPTS_VALUE || audio_sync_method < 0)
+    {
+        frame->pts = ost->sync_opts;
+    }
+    set_sync_opts(of, ost, frame->pts + frame->nb_samples);
+    ost->samples_encoded += frame->nb_samples;
+    ost->frames_encoded++;
+
+    av_assert0(pkt.size || !pkt.data);
+    update_benchmark(NULL);
+    if (debug_ts)
+    {
+        av_log(NULL, AV_LOG_INFO, "encoder <- type:audio "
+                                  "frame_pts:%s frame_pts_time:%s time_base:%d/%d\n",
+               av_ts2str(frame->pts), av_ts2timestr(frame->pts, &enc->time_base),
+               enc->time_base.num, enc->time_base.den);
+    }
+
+    ret = avcodec_send_frame(enc, frame);
+    if (ret < 0)
+    {
+        goto error;
+    }
+
+    while (1)
+    {
+        ret = avcodec_receive_packet(enc, &pkt);
+        if (ret == AVERROR(EAGAIN))
+            break;
+        if (ret < 0)
+            goto error;
+
+        update_benchmark("encode_audio %d.%d", ost->file_index, ost->index);
+
+        av_packet_rescale_ts(&pkt, enc->time_base, ost->mux_timebase); // 转换时间戳
+
+        if (debug_ts)
+        {
+            av_log(NULL, AV_LOG_INFO, "encoder -> type:audio "
+                                      "pkt_pts:%s pkt_pts_time:%s pkt_dts:%s pkt_dts_time:%s\n",
+                   av_ts2str(pkt.pts), av_ts2timestr(pkt.pts, &enc->time_base),
+                   av_ts2str(pkt.dts), av_ts2timestr(pkt.dts, &enc->time_base));
+        }
+
+        if ((ret = output_packet(of, &pkt, ost, 0)) < 0)
+            return ret;
+    }
+
+    return 0;
+error:
+    av_log(NULL, AV_LOG_FATAL, "Audio encoding failed\n");
+    return ret;
+}
+
+// 确定 -vsync auto 时实际使用的方法
+static int get_video_sync_method(OutputFile *of, InputStream *ist)
+{
+    int format_video_sync = video_sync_method;
+
+    if (format_video_sync == VSYNC_AUTO)
+    {
+        if (!strcmp(of->ctx->oformat->name, "avi"))
+        {
+            format_video_sync = VSYNC_VFR;
+        }
+        else
+            format_video_sync = (of->ctx->oformat->flags & AVFMT_VARIABLE_FPS) ? ((of->ctx->oformat->flags & AVFMT_NOTIMESTAMPS) ? VSYNC_PASSTHROUGH : VSYNC_VFR) : VSYNC_CFR;
+        if (ist && format_video_sync == VSYNC_CFR && input_files[ist->file_index]->ctx->nb_streams == 1 && input_files[ist->file_index]->input_ts_offset == 0)
+        {
+            format_video_sync = VSYNC_VSCFR;
+        }
+        if (format_video_sync == VSYNC_CFR && copy_ts)
+        {
+            format_video_sync = VSYNC_VSCFR;
+        }
+    }
+    return format_video_sync;
+}
+
+// 编码视频, 返回<0为致命错误.
+// frame_rate 为 buffersink 的输出帧率, 由调用者传入, 编码线程中不能访问filtergraph
+static int do_video_out(OutputFile *of,
+                        OutputStream *ost,
+                        AVFrame *next_picture,
+                        double sync_ipts,
+                        AVRational frame_rate)
+{
+    int ret, format_video_sync;
+    AVPacket pkt;
+    AVCodecContext *enc = ost->enc_ctx;
+    AVCodecParameters *mux_par = ost->st->codecpar;
+    int nb_frames, nb0_frames, i;
+    unsigned warning;
+    double delta, delta0;
+    double duration = 0;
+    int frame_size = 0;
+    InputStream *ist = NULL;
+
+    if (ost->source_index >= 0)
+        ist = input_streams[ost->source_index];
+
+    if (frame_rate.num > 0 && frame_rate.den > 0)
+        duration = 1 / (av_q2d(frame_rate) * av_q2d(enc->time_base));
+
+    if (ist && ist->st->start_time != AV_NOPTS_VALUE && ist->st->first_dts != AV_NOPTS_VALUE && ost->frame_rate.num)
+        duration = FFMIN(duration, 1 / (av_q2d(ost->frame_rate) * av_q2d(enc->time_base)));
+
+    if (!ost->filters_script &&
+        !ost->filters &&
+        (nb_filtergraphs == 0 || !filtergraphs[0]->graph_desc) &&
+        next_picture &&
+        ist &&
+        lrintf(next_picture->pkt_duration * av_q2d(ist->st->time_base) / av_q2d(enc->time_base)) > 0)
+    {
+        duration = lrintf(next_picture->pkt_duration * av_q2d(ist->st->time_base) / av_q2d(enc->time_base));
+    }
+
+    if (!next_picture)
+    {
+        //end, flushing
+        nb0_frames = nb_frames = mid_pred(ost->last_nb0_frames[0],
+                                          ost->last_nb0_frames[1],
+                                          ost->last_nb0_frames[2]);
+    }
+    else
+    {
+        delta0 = sync_ipts - ost->sync_opts; // delta0 is the "drift" between the input frame (next_picture) and where it would fall in the output.
+        delta = delta0 + duration;
+
+        /* by default, we output a single frame */
+        nb0_frames = 0; // tracks the number of times the PREVIOUS frame should be duplicated, mostly for variable framerate (VFR)
+        nb_frames = 1;
+
+        format_video_sync = get_video_sync_method(of, ist);
+        ost->is_cfr = (format_video_sync == VSYNC_CFR || format_video_sync == VSYNC_VSCFR);
+
+        if (delta0 < 0 &&
+            delta > 0 &&
+            format_video_sync != VSYNC_PASSTHROUGH &&
+            format_video_sync != VSYNC_DROP)
+        {
+            if (delta0 < -0.6)
+            {
+                av_log(NULL, AV_LOG_VERBOSE, "Past duration %f too large\n", -delta0);
+            }
+            else
+                av_log(NULL, AV_LOG_DEBUG, "Clipping frame in rate conversion by %f\n", -delta0);
+            sync_ipts = ost->sync_opts;
+            duration += delta0;
+            delta0 = 0;
+        }
+
+        switch (format_video_sync)
+        {
+        case VSYNC_VSCFR:
+            if (ost->frame_number == 0 && delta0 >= 0.5)
+            {
+                av_log(NULL, AV_LOG_DEBUG, "Not duplicating %d initial frames\n", (int)lrintf(delta0));
+                delta = duration;
+                delta0 = 0;
+                set_sync_opts(of, ost, lrint(sync_ipts));
+            }
+        case VSYNC_CFR:
+            // FIXME set to 0.5 after we fix some dts/pts bugs like in avidec.c
+            if (frame_drop_threshold && delta < frame_drop_threshold && ost->frame_number)
             {
                 nb_frames = 0;
             }
@@ -985,11 +1703,11 @@ static void do_video_out(OutputFile *of,
             if (delta <= -0.6)
                 nb_frames = 0;
             else if (delta > 0.6)
-                ost->sync_opts = lrint(sync_ipts);
+                set_sync_opts(of, ost, lrint(sync_ipts));
             break;
         case VSYNC_DROP:
         case VSYNC_PASSTHROUGH:
-            ost->sync_opts = lrint(sync_ipts);
+            set_sync_opts(of, ost, lrint(sync_ipts));
             break;
         default:
             av_assert0(0);
@@ -1017,14 +1735,16 @@ static void do_video_out(OutputFile *of,
         {
             av_log(NULL, AV_LOG_ERROR, "%d frame duplication too large, skipping\n", nb_frames - 1);
             nb_frames_drop++;
-            return;
+            return 0;
         }
         nb_frames_dup += nb_frames - (nb0_frames && ost->last_dropped) - (nb_frames > nb0_frames);
         av_log(NULL, AV_LOG_VERBOSE, "*** %d dup!\n", nb_frames - 1);
-        if (nb_frames_dup > dup_warning)
+        // 多个编码线程同时超过时只有一个打印警告
+        warning = atomic_load(&dup_warning);
+        if (nb_frames_dup > warning &&
+            atomic_compare_exchange_strong(&dup_warning, &warning, warning * 10))
         {
-            av_log(NULL, AV_LOG_WARNING, "More than %d frames duplicated\n", dup_warning);
-            dup_warning *= 10;
+            av_log(NULL, AV_LOG_WARNING, "More than %u frames duplicated\n", warning);
         }
     }
     ost->last_dropped = nb_frames == nb0_frames && next_picture;
@@ -1047,12 +1767,12 @@ static void do_video_out(OutputFile *of,
             in_picture = next_picture;
 
         if (!in_picture)
-            return;
+            return 0;
 
         in_picture->pts = ost->sync_opts;
 
         if (!check_recording_time(ost))
-            return;
+            return 0;
 
         if (enc->flags & (AV_CODEC_FLAG_INTERLACED_DCT | AV_CODEC_FLAG_INTERLACED_ME) &&
             ost->top_field_first >= 0)
@@ -1118,291 +1838,797 @@ static void do_video_out(OutputFile *of,
             av_log(NULL, AV_LOG_DEBUG, "Forced keyframe at time %f\n", pts_time);
         }
 
-        update_benchmark(NULL);
-        if (debug_ts)
+        update_benchmark(NULL);
+        if (debug_ts)
+        {
+            av_log(NULL, AV_LOG_INFO, "encoder <- type:video "
+                                      "frame_pts:%s frame_pts_time:%s time_base:%d/%d\n",
+                   av_ts2str(in_picture->pts), av_ts2timestr(in_picture->pts, &enc->time_base),
+                   enc->time_base.num, enc->time_base.den);
+        }
+
+        ost->frames_encoded++;
+
+        ret = avcodec_send_frame(enc, in_picture);
+        if (ret < 0)
+            goto error;
+        // Make sure Closed Captions will not be duplicated
+        av_frame_remove_side_data(in_picture, AV_FRAME_DATA_A53_CC);
+
+        while (1)
+        {
+            ret = avcodec_receive_packet(enc, &pkt);
+            update_benchmark("encode_video %d.%d", ost->file_index, ost->index);
+            if (ret == AVERROR(EAGAIN))
+                break;
+            if (ret < 0)
+                goto error;
+
+            if (debug_ts)
+            {
+                av_log(NULL, AV_LOG_INFO, "encoder -> type:video "
+                                          "pkt_pts:%s pkt_pts_time:%s pkt_dts:%s pkt_dts_time:%s\n",
+                       av_ts2str(pkt.pts), av_ts2timestr(pkt.pts, &enc->time_base),
+                       av_ts2str(pkt.dts), av_ts2timestr(pkt.dts, &enc->time_base));
+            }
+
+            if (pkt.pts == AV_NOPTS_VALUE && !(enc->codec->capabilities & AV_CODEC_CAP_DELAY))
+                pkt.pts = ost->sync_opts;
+
+            av_packet_rescale_ts(&pkt, enc->time_base, ost->mux_timebase);
+
+            if (debug_ts)
+            {
+                av_log(NULL, AV_LOG_INFO, "encoder -> type:video "
+                                          "pkt_pts:%s pkt_pts_time:%s pkt_dts:%s pkt_dts_time:%s\n",
+                       av_ts2str(pkt.pts), av_ts2timestr(pkt.pts, &ost->mux_timebase),
+                       av_ts2str(pkt.dts), av_ts2timestr(pkt.dts, &ost->mux_timebase));
+            }
+
+            frame_size = pkt.size;
+            if ((ret = output_packet(of, &pkt, ost, 0)) < 0)
+                return ret;
+
+            /* if two pass, output log */
+            if (ost->logfile && enc->stats_out)
+            {
+                fprintf(ost->logfile, "%s", enc->stats_out);
+            }
+        }
+        /*
+         * For video, number of frames in == number of packets out.
+         * But there may be reordering, so we can't throw away frames on encoder
+         * flush, we need to limit them here, before they go into encoder.
+         */
+        lock_output_file(of);
+        ost->sync_opts++;
+        ost->frame_number++;
+        unlock_output_file(of);
+
+        if (vstats_filename && frame_size && (ret = do_video_stats(ost, frame_size)) < 0)
+            return ret;
+    }
+
+    if (!ost->last_frame)
+        ost->last_frame = av_frame_alloc();
+    av_frame_unref(ost->last_frame);
+    if (next_picture && ost->last_frame)
+        av_frame_ref(ost->last_frame, next_picture);
+    else
+        av_frame_free(&ost->last_frame);
+
+    return 0;
+error:
+    av_log(NULL, AV_LOG_FATAL, "Video encoding failed\n");
+    return ret;
+}
+
+static double psnr(double d)
+{
+    return -10.0 * log10(d);
+}
+
+#if HAVE_THREADS
+static pthread_mutex_t vstats_lock = PTHREAD_MUTEX_INITIALIZER; // 多个编码线程共用 vstats_file
+#endif
+
+static int do_video_stats(OutputStream *ost, int frame_size)
+{
+    AVCodecContext *enc;
+    int frame_number, ret;
+    double ti1, bitrate, avg_bitrate;
+
+#if HAVE_THREADS
+    pthread_mutex_lock(&vstats_lock);
+#endif
+
+    /* this is executed just the first time do_video_stats is called */
+    if (!vstats_file)
+    {
+        vstats_file = fopen(vstats_filename, "w");
+        if (!vstats_file)
+        {
+            ret = AVERROR(errno);
+            perror("fopen");
+#if HAVE_THREADS
+            pthread_mutex_unlock(&vstats_lock);
+#endif
+            return ret;
+        }
+    }
+
+    enc = ost->enc_ctx;
+    if (enc->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+        frame_number = ost->st->nb_frames;
+        if (vstats_version <= 1)
+        {
+            fprintf(vstats_file, "frame= %5d q= %2.1f ", frame_number,
+                    ost->quality / (float)FF_QP2LAMBDA);
+        }
+        else
+        {
+            fprintf(vstats_file, "out= %2d st= %2d frame= %5d q= %2.1f ", ost->file_index, ost->index, frame_number,
+                    ost->quality / (float)FF_QP2LAMBDA);
+        }
+
+        if (ost->error[0] >= 0 && (enc->flags & AV_CODEC_FLAG_PSNR))
+            fprintf(vstats_file, "PSNR= %6.2f ", psnr(ost->error[0] / (enc->width * enc->height * 255.0 * 255.0)));
+
+        fprintf(vstats_file, "f_size= %6d ", frame_size);
+        /* compute pts value */
+        ti1 = av_stream_get_end_pts(ost->st) * av_q2d(ost->st->time_base);
+        if (ti1 < 0.01)
+            ti1 = 0.01;
+
+        bitrate = (frame_size * 8) / av_q2d(enc->time_base) / 1000.0;
+        avg_bitrate = (double)(ost->data_size * 8) / ti1 / 1000.0;
+        fprintf(vstats_file, "s_size= %8.0fkB time= %0.3f br= %7.1fkbits/s avg_br= %7.1fkbits/s ",
+                (double)ost->data_size / 1024, ti1, bitrate, avg_bitrate);
+        fprintf(vstats_file, "type= %c\n", av_get_picture_type_char(ost->pict_type));
+    }
+
+#if HAVE_THREADS
+    pthread_mutex_unlock(&vstats_lock);
+#endif
+    return 0;
+}
+
+static int init_output_stream(OutputStream *ost, char *error, int error_len);
+
+static void finish_output_stream(OutputStream *ost)
+{
+    OutputFile *of = output_files[ost->file_index];
+    int i;
+
+    atomic_store(&ost->finished, ENCODER_FINISHED | MUXER_FINISHED);
+
+    if (of->shortest)
+    {
+        for (i = 0; i < of->ctx->nb_streams; i++)
+            atomic_store(&output_streams[of->ost_index + i]->finished, ENCODER_FINISHED | MUXER_FINISHED);
+    }
+}
+
+/**
+ * 将编码器输出的包 (ost->mux_timebase) 按引用分发给共享这个编码器的流.
+ * 每个流按自己输出文件的 -t 和 -fs 结束, 编码器本身只随 ost 的输出结束.
+ * 共享的流与 ost 的 -ss 相同, -t 和 check_recording_time() 一样从 ost->first_pts 算起.
+ */
+static int share_packet(OutputStream *ost, const AVPacket *pkt, int eof)
+{
+    int i, ret;
+
+    for (i = 0; i < ost->nb_enc_shares; i++)
+    {
+        OutputStream *dep = ost->enc_shares[i];
+        OutputFile *of = output_files[dep->file_index];
+        AVPacket dep_pkt = {0};
+        int64_t recording_time;
+
+        if (atomic_load(&dep->finished) & MUXER_FINISHED)
+            continue;
+
+        av_init_packet(&dep_pkt);
+        if (!eof)
+        {
+            recording_time = get_recording_time(of);
+            if (recording_time != INT64_MAX && pkt->pts != AV_NOPTS_VALUE &&
+                av_compare_ts(pkt->pts - av_rescale_q(ost->first_pts, ost->enc_ctx->time_base, ost->mux_timebase),
+                              ost->mux_timebase, recording_time, AV_TIME_BASE_Q) >= 0)
+            {
+                finish_output_stream(dep);
+                continue;
+            }
+            if (of->limit_filesize != UINT64_MAX && output_file_size(of) >= of->limit_filesize)
+            {
+                finish_output_stream(dep);
+                continue;
+            }
+
+            if ((ret = av_packet_ref(&dep_pkt, pkt)) < 0)
+                return ret;
+            av_packet_rescale_ts(&dep_pkt, ost->mux_timebase, dep->mux_timebase);
+        }
+        ret = output_packet(of, &dep_pkt, dep, eof);
+        av_packet_unref(&dep_pkt);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+/**
+ * @brief encode_frame 将一帧送入编码器, 在主线程或编码线程中运行
+ * @param frame         过滤后的帧, NULL表示视频流结束
+ * @param float_pts     编码器time_base下的精确pts
+ * @param frame_rate    buffersink 的输出帧率
+ * @return <0 为致命错误, 编码线程中不能 exit_program(), 由调用者记录在 ost->enc_error
+ */
+static int encode_frame(OutputStream *ost, AVFrame *frame, double float_pts,
+                        AVRational frame_rate)
+{
+    OutputFile *of = output_files[ost->file_index];
+    AVCodecContext *enc = ost->enc_ctx;
+
+    switch (enc->codec_type)
+    {
+    case AVMEDIA_TYPE_VIDEO:
+        if (!frame)
+            return do_video_out(of, ost, NULL, AV_NOPTS_VALUE, frame_rate);
+
+        if (!ost->frame_aspect_ratio.num)
+            enc->sample_aspect_ratio = frame->sample_aspect_ratio;
+
+        if (debug_ts)
+        {
+            av_log(NULL, AV_LOG_INFO, "filter -> pts:%s pts_time:%s exact:%f time_base:%d/%d\n",
+                   av_ts2str(frame->pts), av_ts2timestr(frame->pts, &enc->time_base),
+                   float_pts,
+                   enc->time_base.num, enc->time_base.den);
+        }
+
+        // 编码视频
+        return do_video_out(of, ost, frame, float_pts, frame_rate);
+    case AVMEDIA_TYPE_AUDIO:
+        if (!(enc->codec->capabilities & AV_CODEC_CAP_PARAM_CHANGE) &&
+            enc->channels != frame->channels)
+        {
+            av_log(NULL, AV_LOG_ERROR,
+                   "Audio filter graph output is not normalized and encoder does not support parameter changes\n");
+            break;
+        }
+
+        // 编码音频
+        return do_audio_out(of, ost, frame);
+    default:
+        // TODO support subtitle filters
+        av_assert0(0);
+    }
+    return 0;
+}
+
+#if HAVE_THREADS
+// pipeline 模式下, 主线程与输出流编码线程之间传递的消息
+typedef struct EncodeMessage
+{
+    AVFrame *frame; /* NULL flushes the video sync logic of the stream */
+    double float_pts;
+    AVRational frame_rate;
+} EncodeMessage;
+
+static void free_encode_message(void *arg)
+{
+    EncodeMessage *msg = arg;
+    av_frame_free(&msg->frame);
+}
+
+/*
+ * 输出流的编码线程: 从队列中取出过滤后的帧, 编码后写入复用器.
+ * 每个流的包仍按编码顺序写入, 但不同流之间没有同步, 流间的交错只由
+ * av_interleaved_write_frame() 保证: 某个流超过 max_interleave_delta (默认10秒)
+ * 没有包时, 复用器不再等它, 之后到达的包的 dts 会早于已写入的其它流的包.
+ * 编码器延迟 (lookahead, 帧线程) 或某个编码线程落后超过这个时长时就会这样,
+ * 需要严格交错时用 -max_interleave_delta 加大等待时间.
+ */
+static void *encoder_thread(void *arg)
+{
+    OutputStream *ost = arg;
+    EncodeMessage msg;
+    int ret = 0;
+
+    while (av_thread_message_queue_recv(ost->enc_queue, &msg, 0) >= 0)
+    {
+        ret = encode_frame(ost, msg.frame, msg.float_pts, msg.frame_rate);
+        av_frame_free(&msg.frame);
+        // 不能在这里 exit_program(), 主线程从队列得到错误后正常结束转码
+        if (ret < 0)
+        {
+            atomic_store(&ost->enc_error, ret);
+            break;
+        }
+    }
+    av_thread_message_queue_set_err_send(ost->enc_queue, ret < 0 ? ret : AVERROR_EOF);
+
+    return NULL;
+}
+
+/**
+ * 等待编码线程处理完队列中的帧并退出.
+ * abort 不为0时丢弃队列中尚未编码的帧.
+ */
+static void free_encoder_thread(OutputStream *ost, int abort)
+{
+    if (!ost || !ost->enc_queue)
+        return;
+
+    if (abort)
+        av_thread_message_flush(ost->enc_queue);
+    av_thread_message_queue_set_err_recv(ost->enc_queue, AVERROR_EOF);
+    pthread_join(ost->enc_thread, NULL);
+    av_thread_message_flush(ost->enc_queue);
+    av_thread_message_queue_free(&ost->enc_queue);
+}
+
+static void free_encoder_threads(int abort)
+{
+    int i;
+
+    // 先让所有线程停止接收, 再逐个等待退出
+    for (i = 0; i < nb_output_streams; i++)
+    {
+        OutputStream *ost = output_streams[i];
+        if (ost && ost->enc_queue)
         {
-            av_log(NULL, AV_LOG_INFO, "encoder <- type:video "
-                                      "frame_pts:%s frame_pts_time:%s time_base:%d/%d\n",
-                   av_ts2str(in_picture->pts), av_ts2timestr(in_picture->pts, &enc->time_base),
-                   enc->time_base.num, enc->time_base.den);
+            if (abort)
+                av_thread_message_flush(ost->enc_queue);
+            av_thread_message_queue_set_err_recv(ost->enc_queue, AVERROR_EOF);
         }
+    }
+    for (i = 0; i < nb_output_streams; i++)
+        free_encoder_thread(output_streams[i], abort);
+}
 
-        ost->frames_encoded++;
+// 每个需要编码的输出流一个编码线程, 各个码率档位互不阻塞
+static int init_encoder_threads(void)
+{
+    int i, ret;
 
-        ret = avcodec_send_frame(enc, in_picture);
+    if (!pipeline_mode)
+        return 0;
+
+    for (i = 0; i < nb_output_streams; i++)
+    {
+        OutputStream *ost = output_streams[i];
+
+        if (!ost->encoding_needed || !ost->filter)
+            continue;
+
+        ret = av_thread_message_queue_alloc(&ost->enc_queue, FFMAX(pipeline_queue_size, 1),
+                                            sizeof(EncodeMessage));
         if (ret < 0)
-            goto error;
-        // Make sure Closed Captions will not be duplicated
-        av_frame_remove_side_data(in_picture, AV_FRAME_DATA_A53_CC);
+            return ret;
+        av_thread_message_queue_set_free_func(ost->enc_queue, free_encode_message);
 
-        while (1)
+        if ((ret = pthread_create(&ost->enc_thread, NULL, encoder_thread, ost)))
         {
-            ret = avcodec_receive_packet(enc, &pkt);
-            update_benchmark("encode_video %d.%d", ost->file_index, ost->index);
-            if (ret == AVERROR(EAGAIN))
-                break;
-            if (ret < 0)
-                goto error;
+            av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
+            av_thread_message_queue_free(&ost->enc_queue);
+            return AVERROR(ret);
+        }
+    }
 
-            if (debug_ts)
-            {
-                av_log(NULL, AV_LOG_INFO, "encoder -> type:video "
-                                          "pkt_pts:%s pkt_pts_time:%s pkt_dts:%s pkt_dts_time:%s\n",
-                       av_ts2str(pkt.pts), av_ts2timestr(pkt.pts, &enc->time_base),
-                       av_ts2str(pkt.dts), av_ts2timestr(pkt.dts, &enc->time_base));
-            }
+    return 0;
+}
 
-            if (pkt.pts == AV_NOPTS_VALUE && !(enc->codec->capabilities & AV_CODEC_CAP_DELAY))
-                pkt.pts = ost->sync_opts;
+// 将过滤后的帧交给输出流的编码线程, 队列满时阻塞
+static int send_to_encoder_thread(OutputStream *ost, AVFrame *frame, double float_pts,
+                                  AVRational frame_rate)
+{
+    EncodeMessage msg = {NULL, float_pts, frame_rate};
+    int ret;
 
-            av_packet_rescale_ts(&pkt, enc->time_base, ost->mux_timebase);
+    if (frame)
+    {
+        msg.frame = av_frame_alloc();
+        if (!msg.frame)
+            return AVERROR(ENOMEM);
+        av_frame_move_ref(msg.frame, frame);
+    }
 
-            if (debug_ts)
-            {
-                av_log(NULL, AV_LOG_INFO, "encoder -> type:video "
-                                          "pkt_pts:%s pkt_pts_time:%s pkt_dts:%s pkt_dts_time:%s\n",
-                       av_ts2str(pkt.pts), av_ts2timestr(pkt.pts, &ost->mux_timebase),
-                       av_ts2str(pkt.dts), av_ts2timestr(pkt.dts, &ost->mux_timebase));
-            }
+    ret = av_thread_message_queue_send(ost->enc_queue, &msg, 0);
+    if (ret < 0)
+        av_frame_free(&msg.frame);
+    return ret;
+}
 
-            frame_size = pkt.size;
-            output_packet(of, &pkt, ost, 0);
+// pipeline 模式下, 主线程与复杂过滤图线程之间传递的消息
+typedef struct FilterMessage
+{
+    int input;       /* index in FilterGraph.inputs */
+    AVFrame *frame;  /* NULL closes the input */
+    int64_t eof_pts; /* pts passed to av_buffersrc_close() */
+} FilterMessage;
 
-            /* if two pass, output log */
-            if (ost->logfile && enc->stats_out)
-            {
-                fprintf(ost->logfile, "%s", enc->stats_out);
-            }
-        }
-        ost->sync_opts++;
-        /*
-         * For video, number of frames in == number of packets out.
-         * But there may be reordering, so we can't throw away frames on encoder
-         * flush, we need to limit them here, before they go into encoder.
-         */
-        ost->frame_number++;
+static void free_filter_message(void *arg)
+{
+    FilterMessage *msg = arg;
+    av_frame_free(&msg->frame);
+}
 
-        if (vstats_filename && frame_size)
-            do_video_stats(ost, frame_size);
-    }
+// 复杂过滤图线程: 把解码后的帧送入过滤图并完成过滤, 输出帧由主线程取走
+static void *filtergraph_thread(void *arg)
+{
+    FilterGraph *fg = arg;
+    FilterMessage msg;
+    int ret;
 
-    if (!ost->last_frame)
-        ost->last_frame = av_frame_alloc();
-    av_frame_unref(ost->last_frame);
-    if (next_picture && ost->last_frame)
-        av_frame_ref(ost->last_frame, next_picture);
-    else
-        av_frame_free(&ost->last_frame);
+    while (av_thread_message_queue_recv(fg->in_queue, &msg, 0) >= 0)
+    {
+        InputFilter *ifilter = fg->inputs[msg.input];
 
-    return;
-error:
-    av_log(NULL, AV_LOG_FATAL, "Video encoding failed\n");
-    exit_program(1);
+        pthread_mutex_lock(&fg->lock);
+        if (msg.frame)
+            ret = av_buffersrc_add_frame_flags(ifilter->filter, msg.frame, AV_BUFFERSRC_FLAG_PUSH);
+        else
+            ret = av_buffersrc_close(ifilter->filter, msg.eof_pts, AV_BUFFERSRC_FLAG_PUSH);
+        pthread_mutex_unlock(&fg->lock);
+        av_frame_free(&msg.frame);
+
+        if (ret < 0 && ret != AVERROR_EOF)
+            av_log(NULL, AV_LOG_ERROR, "Error while filtering: %s\n", av_err2str(ret));
+
+        pthread_mutex_lock(&fg->queue_lock);
+        if (ret < 0 && ret != AVERROR_EOF && !fg->thread_ret)
+            fg->thread_ret = ret;
+        fg->nb_pending--;
+        pthread_cond_broadcast(&fg->queue_cond);
+        pthread_mutex_unlock(&fg->queue_lock);
+    }
+    av_thread_message_queue_set_err_send(fg->in_queue, AVERROR_EOF);
+
+    return NULL;
 }
 
-static double psnr(double d)
+/**
+ * 等待过滤图线程处理完已发送的消息.
+ * 返回值: 1 等待过, 0 线程本来就空闲.
+ */
+static int filtergraph_wait_idle(FilterGraph *fg)
 {
-    return -10.0 * log10(d);
+    int waited = 0;
+
+    pthread_mutex_lock(&fg->queue_lock);
+    while (fg->nb_pending > 0)
+    {
+        waited = 1;
+        pthread_cond_wait(&fg->queue_cond, &fg->queue_lock);
+    }
+    pthread_mutex_unlock(&fg->queue_lock);
+
+    return waited;
 }
 
-static void do_video_stats(OutputStream *ost, int frame_size)
+// 将解码后的帧(frame 为NULL时是EOF)交给过滤图线程, 队列满时阻塞
+static int send_to_filtergraph_thread(InputFilter *ifilter, AVFrame *frame, int64_t eof_pts)
 {
-    AVCodecContext *enc;
-    int frame_number;
-    double ti1, bitrate, avg_bitrate;
+    FilterGraph *fg = ifilter->graph;
+    FilterMessage msg = {0, NULL, eof_pts};
+    int ret;
 
-    /* this is executed just the first time do_video_stats is called */
-    if (!vstats_file)
+    for (msg.input = 0; fg->inputs[msg.input] != ifilter; msg.input++)
+        ;
+
+    pthread_mutex_lock(&fg->queue_lock);
+    ret = fg->thread_ret;
+    if (!ret)
+        fg->nb_pending++;
+    pthread_mutex_unlock(&fg->queue_lock);
+    if (ret < 0)
+        return ret;
+
+    if (frame)
     {
-        vstats_file = fopen(vstats_filename, "w");
-        if (!vstats_file)
-        {
-            perror("fopen");
-            exit_program(1);
-        }
+        msg.frame = av_frame_alloc();
+        if (!msg.frame)
+            ret = AVERROR(ENOMEM);
+        else
+            av_frame_move_ref(msg.frame, frame);
     }
+    if (ret >= 0)
+        ret = av_thread_message_queue_send(fg->in_queue, &msg, 0);
 
-    enc = ost->enc_ctx;
-    if (enc->codec_type == AVMEDIA_TYPE_VIDEO)
+    if (ret < 0)
     {
-        frame_number = ost->st->nb_frames;
-        if (vstats_version <= 1)
-        {
-            fprintf(vstats_file, "frame= %5d q= %2.1f ", frame_number,
-                    ost->quality / (float)FF_QP2LAMBDA);
-        }
-        else
-        {
-            fprintf(vstats_file, "out= %2d st= %2d frame= %5d q= %2.1f ", ost->file_index, ost->index, frame_number,
-                    ost->quality / (float)FF_QP2LAMBDA);
-        }
+        av_frame_free(&msg.frame);
+        pthread_mutex_lock(&fg->queue_lock);
+        fg->nb_pending--;
+        pthread_cond_broadcast(&fg->queue_cond);
+        pthread_mutex_unlock(&fg->queue_lock);
+    }
+    return ret;
+}
 
-        if (ost->error[0] >= 0 && (enc->flags & AV_CODEC_FLAG_PSNR))
-            fprintf(vstats_file, "PSNR= %6.2f ", psnr(ost->error[0] / (enc->width * enc->height * 255.0 * 255.0)));
+/**
+ * 等待过滤图线程退出.
+ * abort 为0时先处理完队列中的帧, 否则丢弃.
+ */
+static void free_filtergraph_thread(FilterGraph *fg, int abort)
+{
+    if (!fg || !fg->in_queue)
+        return;
 
-        fprintf(vstats_file, "f_size= %6d ", frame_size);
-        /* compute pts value */
-        ti1 = av_stream_get_end_pts(ost->st) * av_q2d(ost->st->time_base);
-        if (ti1 < 0.01)
-            ti1 = 0.01;
+    if (abort)
+        av_thread_message_flush(fg->in_queue);
+    av_thread_message_queue_set_err_recv(fg->in_queue, AVERROR_EOF);
+    pthread_join(fg->thread, NULL);
+    av_thread_message_flush(fg->in_queue);
+    av_thread_message_queue_free(&fg->in_queue);
 
-        bitrate = (frame_size * 8) / av_q2d(enc->time_base) / 1000.0;
-        avg_bitrate = (double)(ost->data_size * 8) / ti1 / 1000.0;
-        fprintf(vstats_file, "s_size= %8.0fkB time= %0.3f br= %7.1fkbits/s avg_br= %7.1fkbits/s ",
-                (double)ost->data_size / 1024, ti1, bitrate, avg_bitrate);
-        fprintf(vstats_file, "type= %c\n", av_get_picture_type_char(ost->pict_type));
-    }
+    pthread_mutex_destroy(&fg->lock);
+    pthread_mutex_destroy(&fg->queue_lock);
+    pthread_cond_destroy(&fg->queue_cond);
 }
 
-static int init_output_stream(OutputStream *ost, char *error, int error_len);
-
-static void finish_output_stream(OutputStream *ost)
+static void free_filtergraph_threads(int abort)
 {
-    OutputFile *of = output_files[ost->file_index];
     int i;
 
-    ost->finished = ENCODER_FINISHED | MUXER_FINISHED;
+    for (i = 0; i < nb_filtergraphs; i++)
+        free_filtergraph_thread(filtergraphs[i], abort);
+}
+
+// 每个复杂过滤图一个线程, 互相独立的过滤图可以并行, 并与解码重叠
+static int init_filtergraph_threads(void)
+{
+    pthread_mutexattr_t attr;
+    int i, ret;
+
+    if (!pipeline_mode)
+        return 0;
 
-    if (of->shortest)
+    for (i = 0; i < nb_filtergraphs; i++)
     {
-        for (i = 0; i < of->ctx->nb_streams; i++)
-            output_streams[of->ost_index + i]->finished = ENCODER_FINISHED | MUXER_FINISHED;
+        FilterGraph *fg = filtergraphs[i];
+
+        if (filtergraph_is_simple(fg))
+            continue;
+
+        ret = av_thread_message_queue_alloc(&fg->in_queue, FFMAX(pipeline_queue_size, 1),
+                                            sizeof(FilterMessage));
+        if (ret < 0)
+            return ret;
+        av_thread_message_queue_set_free_func(fg->in_queue, free_filter_message);
+
+        // 出错退出时 ffmpeg_cleanup() 需要能安全地解锁
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+        pthread_mutex_init(&fg->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        pthread_mutex_init(&fg->queue_lock, NULL);
+        pthread_cond_init(&fg->queue_cond, NULL);
+        fg->nb_pending = 0;
+        fg->thread_ret = 0;
+
+        if ((ret = pthread_create(&fg->thread, NULL, filtergraph_thread, fg)))
+        {
+            av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
+            av_thread_message_queue_free(&fg->in_queue);
+            pthread_mutex_destroy(&fg->lock);
+            pthread_mutex_destroy(&fg->queue_lock);
+            pthread_cond_destroy(&fg->queue_cond);
+            return AVERROR(ret);
+        }
     }
+
+    return 0;
 }
+#endif
 
-// 从过滤图中获取并 编码 AVFrame
-// 返回值: 0成功, <0报错.
-static int reap_filters(int flush)
+static void lock_filtergraph(FilterGraph *fg)
+{
+#if HAVE_THREADS
+    if (fg->in_queue)
+        pthread_mutex_lock(&fg->lock);
+#endif
+}
+
+// 返回值: 0 成功, 非0 过滤图线程正在使用该过滤图
+static int trylock_filtergraph(FilterGraph *fg)
+{
+#if HAVE_THREADS
+    if (fg->in_queue)
+        return pthread_mutex_trylock(&fg->lock);
+#endif
+    return 0;
+}
+
+static void unlock_filtergraph(FilterGraph *fg)
+{
+#if HAVE_THREADS
+    if (fg->in_queue)
+        pthread_mutex_unlock(&fg->lock);
+#endif
+}
+
+// 取出一个输出流 buffersink 中的所有帧并编码, 调用者需持有过滤图的锁
+static int reap_filter(OutputStream *ost, int flush)
 {
+    OutputFile *of = output_files[ost->file_index];
+    AVFilterContext *filter = ost->filter->filter;
+    AVCodecContext *enc = ost->enc_ctx;
     AVFrame *filtered_frame = NULL;
-    int i;
+    int ret = 0;
 
-    // 获取缓冲池中存在的所有缓冲
-    for (i = 0; i < nb_output_streams; i++)
-    {
-        OutputStream *ost = output_streams[i];
-        OutputFile *of = output_files[ost->file_index];
-        AVFilterContext *filter;
-        AVCodecContext *enc = ost->enc_ctx;
-        int ret = 0;
+    // 编码或复用出错后不再编码, 转码随之结束
+    if ((ret = atomic_load(&ost->enc_error)) < 0)
+        return ret;
 
-        // 对应的stream copy的时候没有filter
-        if (!ost->filter || !ost->filter->graph->graph)
+    if (!ost->initialized)
+    {
+        // 只初始化一次
+        char error[1024] = "";
+        ret = init_output_stream(ost, error, sizeof(error));
+        if (ret < 0)
         {
-            continue; // 还没有创建graph
+            av_log(NULL, AV_LOG_ERROR, "Error initializing output stream %d:%d -- %s\n",
+                   ost->file_index, ost->index, error);
+            // 持有过滤图的锁, 不能 exit_program()
+            atomic_store(&ost->enc_error, ret);
+            return ret;
         }
+    }
 
-        filter = ost->filter->filter;
+    if (!ost->filtered_frame && !(ost->filtered_frame = av_frame_alloc()))
+    {
+        return AVERROR(ENOMEM);
+    }
+    filtered_frame = ost->filtered_frame;
 
-        if (!ost->initialized)
+    while (1)
+    {
+        double float_pts = AV_NOPTS_VALUE;
+
+        // 从 AVFilterContext中取出一帧解码后的数据AVFrame
+        ret = av_buffersink_get_frame_flags(filter, filtered_frame,
+                                            AV_BUFFERSINK_FLAG_NO_REQUEST);
+        if (ret < 0)
         {
-            // 只初始化一次
-            char error[1024] = "";
-            ret = init_output_stream(ost, error, sizeof(error));
-            if (ret < 0)
+            if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
             {
-                av_log(NULL, AV_LOG_ERROR, "Error initializing output stream %d:%d -- %s\n",
-                       ost->file_index, ost->index, error);
-                exit_program(1);
+                av_log(NULL, AV_LOG_WARNING,
+                       "Error in av_buffersink_get_frame_flags(): %s\n", av_err2str(ret));
+            }
+            else if (flush && ret == AVERROR_EOF)
+            {
+                if (av_buffersink_get_type(filter) == AVMEDIA_TYPE_VIDEO)
+                {
+#if HAVE_THREADS
+                    if (ost->enc_queue)
+                    {
+                        ret = send_to_encoder_thread(ost, NULL, AV_NOPTS_VALUE,
+                                                    av_buffersink_get_frame_rate(filter));
+                        if (ret < 0)
+                            return ret;
+                        break;
+                    }
+#endif
+                    ret = encode_frame(ost, NULL, AV_NOPTS_VALUE, av_buffersink_get_frame_rate(filter));
+                    if (ret < 0)
+                    {
+                        atomic_store(&ost->enc_error, ret);
+                        return ret;
+                    }
+                }
             }
+            break;
         }
 
-        if (!ost->filtered_frame && !(ost->filtered_frame = av_frame_alloc()))
+        if (atomic_load(&ost->finished))
         {
-            return AVERROR(ENOMEM);
+            av_frame_unref(filtered_frame);
+            continue;
         }
-        filtered_frame = ost->filtered_frame;
 
-        while (1)
+        if (filtered_frame->pts != AV_NOPTS_VALUE)
         {
-            double float_pts = AV_NOPTS_VALUE;
+            int64_t start_time = (of->start_time == AV_NOPTS_VALUE) ? 0 : of->start_time;
+            AVRational filter_tb = av_buffersink_get_time_base(filter); // filter out的time_base
+            AVRational tb = enc->time_base;                             // 编码器的time_base
+            int extra_bits = av_clip(29 - av_log2(tb.den), 0, 16);
 
-            // 从 AVFilterContext中取出一帧解码后的数据AVFrame
-            ret = av_buffersink_get_frame_flags(filter, filtered_frame,
-                                                AV_BUFFERSINK_FLAG_NO_REQUEST);
-            if (ret < 0)
-            {
-                if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
-                {
-                    av_log(NULL, AV_LOG_WARNING,
-                           "Error in av_buffersink_get_frame_flags(): %s\n", av_err2str(ret));
-                }
-                else if (flush && ret == AVERROR_EOF)
-                {
-                    if (av_buffersink_get_type(filter) == AVMEDIA_TYPE_VIDEO)
-                        do_video_out(of, ost, NULL, AV_NOPTS_VALUE);
-                }
-                break;
-            }
+            tb.den <<= extra_bits;
+            float_pts =
+                av_rescale_q(filtered_frame->pts, filter_tb, tb) -
+                av_rescale_q(start_time, AV_TIME_BASE_Q, tb); // 转成统一的timebase对比
+            float_pts /= 1 << extra_bits;
+            // avoid exact midoints to reduce the chance of rounding differences, this can be removed in case the fps code is changed to work with integers
+            float_pts += FFSIGN(float_pts) * 1.0 / (1 << 17);
 
-            if (ost->finished)
-            {
-                av_frame_unref(filtered_frame);
-                continue;
-            }
+            filtered_frame->pts =
+                av_rescale_q(filtered_frame->pts, filter_tb, enc->time_base) -
+                av_rescale_q(start_time, AV_TIME_BASE_Q, enc->time_base);
+        }
 
-            if (filtered_frame->pts != AV_NOPTS_VALUE)
+#if HAVE_THREADS
+        if (ost->enc_queue)
+        {
+            // pipeline 模式: 交给该输出流的编码线程
+            ret = send_to_encoder_thread(ost, filtered_frame, float_pts,
+                                         av_buffersink_get_frame_rate(filter));
+            if (ret < 0)
             {
-                int64_t start_time = (of->start_time == AV_NOPTS_VALUE) ? 0 : of->start_time;
-                AVRational filter_tb = av_buffersink_get_time_base(filter); // filter out的time_base
-                AVRational tb = enc->time_base;                             // 编码器的time_base
-                int extra_bits = av_clip(29 - av_log2(tb.den), 0, 16);
-
-                tb.den <<= extra_bits;
-                float_pts =
-                    av_rescale_q(filtered_frame->pts, filter_tb, tb) -
-                    av_rescale_q(start_time, AV_TIME_BASE_Q, tb); // 转成统一的timebase对比
-                float_pts /= 1 << extra_bits;
-                // avoid exact midoints to reduce the chance of rounding differences, this can be removed in case the fps code is changed to work with integers
-                float_pts += FFSIGN(float_pts) * 1.0 / (1 << 17);
-
-                filtered_frame->pts =
-                    av_rescale_q(filtered_frame->pts, filter_tb, enc->time_base) -
-                    av_rescale_q(start_time, AV_TIME_BASE_Q, enc->time_base);
+                av_frame_unref(filtered_frame);
+                return ret;
             }
+            continue;
+        }
+#endif
+        ret = encode_frame(ost, filtered_frame, float_pts, av_buffersink_get_frame_rate(filter));
 
-            switch (av_buffersink_get_type(filter))
-            {
-            case AVMEDIA_TYPE_VIDEO:
-                if (!ost->frame_aspect_ratio.num)
-                    enc->sample_aspect_ratio = filtered_frame->sample_aspect_ratio;
+        // 释放资源
+        av_frame_unref(filtered_frame);
+        if (ret < 0)
+        {
+            atomic_store(&ost->enc_error, ret);
+            return ret;
+        }
+    }
 
-                if (debug_ts)
-                {
-                    av_log(NULL, AV_LOG_INFO, "filter -> pts:%s pts_time:%s exact:%f time_base:%d/%d\n",
-                           av_ts2str(filtered_frame->pts), av_ts2timestr(filtered_frame->pts, &enc->time_base),
-                           float_pts,
-                           enc->time_base.num, enc->time_base.den);
-                }
+    return 0;
+}
 
-                // 编码视频
-                do_video_out(of, ost, filtered_frame, float_pts);
-                break;
-            case AVMEDIA_TYPE_AUDIO:
-                if (!(enc->codec->capabilities & AV_CODEC_CAP_PARAM_CHANGE) &&
-                    enc->channels != filtered_frame->channels)
-                {
-                    av_log(NULL, AV_LOG_ERROR,
-                           "Audio filter graph output is not normalized and encoder does not support parameter changes\n");
-                    break;
-                }
+// 从过滤图中获取并 编码 AVFrame
+// 返回值: 0成功, <0报错.
+static int reap_filters(int flush)
+{
+    int i, ret;
 
-                // 编码音频
-                do_audio_out(of, ost, filtered_frame);
-                break;
-            default:
-                // TODO support subtitle filters
-                av_assert0(0);
-            }
+    // 获取缓冲池中存在的所有缓冲
+    for (i = 0; i < nb_output_streams; i++)
+    {
+        OutputStream *ost = output_streams[i];
+        FilterGraph *fg;
 
-            // 释放资源
-            av_frame_unref(filtered_frame);
+        // 对应的stream copy的时候没有filter
+        if (!ost->filter || !ost->filter->graph->graph)
+        {
+            continue; // 还没有创建graph
         }
+        fg = ost->filter->graph;
+
+        // 过滤图线程正在过滤时先跳过, flush 时等待它
+        if (flush)
+            lock_filtergraph(fg);
+        else if (trylock_filtergraph(fg))
+            continue;
+        ret = reap_filter(ost, flush);
+        unlock_filtergraph(fg);
+        if (ret < 0)
+            return ret;
     }
 
     return 0;
 }
 
+// -async_io, -io_buffer_size/-io_cache_mode 的完成统计
+static void print_async_io_stats(AVIOContext *pb)
+{
+    AsyncIOStats s;
+
+    async_io_get_stats(pb, &s);
+    if (s.nb_reads)
+        av_log(NULL, AV_LOG_INFO, "  Async I/O: %" PRId64 " reads (%" PRId64 " bytes), avg latency %.2f ms; "
+               "%" PRId64 " reads ready, %" PRId64 " waited; max %d in flight\n",
+               s.nb_reads, s.read_bytes, s.read_time / 1000.0 / s.nb_reads,
+               s.ready, s.waits, s.max_in_flight);
+    if (s.nb_writes)
+        av_log(NULL, AV_LOG_INFO, "  Async I/O: %" PRId64 " writes (%" PRId64 " bytes), avg latency %.2f ms; "
+               "%" PRId64 " stalls on a full queue; max %d in flight; %" PRId64 " syscalls\n",
+               s.nb_writes, s.write_bytes, s.write_time / 1000.0 / s.nb_writes,
+               s.waits, s.max_in_flight, s.nb_syscalls);
+}
+
 static void print_final_stats(int64_t total_size)
 {
     uint64_t video_size = 0, audio_size = 0, extra_size = 0, other_size = 0;
@@ -1487,6 +2713,15 @@ static void print_final_stats(int64_t total_size)
 
         av_log(NULL, AV_LOG_VERBOSE, "  Total: %" PRIu64 " packets (%" PRIu64 " bytes) demuxed\n",
                total_packets, total_size);
+#if HAVE_THREADS
+        if (f->nb_depth_samples)
+            av_log(NULL, AV_LOG_VERBOSE, "  Thread queue: depth min %d avg %.1f max %d packets; "
+                   "final limit %d packets; %" PRId64 " blocked sends\n",
+                   f->depth_min, (double)f->depth_sum / f->nb_depth_samples, f->depth_max,
+                   f->thread_queue_size, f->blocked_sends);
+#endif
+        if (f->aio_pb)
+            print_async_io_stats(f->aio_pb);
     }
 
     for (i = 0; i < nb_output_files; i++)
@@ -1524,6 +2759,14 @@ static void print_final_stats(int64_t total_size)
 
         av_log(NULL, AV_LOG_VERBOSE, "  Total: %" PRIu64 " packets (%" PRIu64 " bytes) muxed\n",
                total_packets, total_size);
+#if HAVE_THREADS
+        if (of->mux_queue_size > 0)
+            av_log(NULL, AV_LOG_VERBOSE, "  Mux thread: %" PRId64 " packets queued; %" PRId64 " blocked sends, "
+                   "%.3fs waiting on the full queue\n",
+                   of->mux_packets, of->mux_blocked, of->mux_blocked_time / 1000000.0);
+#endif
+        if (of->aio_pb)
+            print_async_io_stats(of->aio_pb);
     }
     if (video_size + data_size + audio_size + subtitle_size + extra_size == 0)
     {
@@ -1576,18 +2819,29 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
 
     oc = output_files[0]->ctx;
 
-    total_size = avio_size(oc->pb);
+    lock_muxer(output_files[0]);
+    total_size = avio_size(output_files[0]->mux_ctx->pb);
     if (total_size <= 0) // FIXME improve avio_size() so it works with non seekable output too
-        total_size = avio_tell(oc->pb);
+        total_size = avio_tell(output_files[0]->mux_ctx->pb);
+    // 加上 -rotate_time/-rotate_size 之前的文件
+    if (total_size >= 0)
+        total_size += atomic_load(&output_files[0]->rotate_bytes);
+    unlock_muxer(output_files[0]);
 
     vid = 0;
     av_bprint_init(&buf, 0, AV_BPRINT_SIZE_AUTOMATIC);
     av_bprint_init(&buf_script, 0, AV_BPRINT_SIZE_AUTOMATIC);
     for (i = 0; i < nb_output_streams; i++)
     {
+        OutputFile *of;
+        AVStream *st;
+        int64_t end_pts;
         float q = -1;
         ost = output_streams[i];
+        of = output_files[ost->file_index];
         enc = ost->enc_ctx;
+        // quality, frame_number 等由写包的线程在 of->lock 内更新
+        lock_output_file(of);
         if (!ost->stream_copy)
             q = ost->quality / (float)FF_QP2LAMBDA;
 
@@ -1657,10 +2911,15 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
             }
             vid = 1;
         }
+        unlock_output_file(of);
         /* compute min output value */
-        if (av_stream_get_end_pts(ost->st) != AV_NOPTS_VALUE)
-            pts = FFMAX(pts, av_rescale_q(av_stream_get_end_pts(ost->st),
-                                          ost->st->time_base, AV_TIME_BASE_Q));
+        lock_muxer(of);
+        // 分段后 ost->st 不再写入, 取当前文件中的流
+        st = of->mux_ctx->streams[ost->index];
+        end_pts = av_stream_get_end_pts(st);
+        unlock_muxer(of);
+        if (end_pts != AV_NOPTS_VALUE)
+            pts = FFMAX(pts, av_rescale_q(end_pts, st->time_base, AV_TIME_BASE_Q));
         if (is_last_report)
             nb_frames_drop += ost->last_dropped;
     }
@@ -1724,6 +2983,23 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
     av_bprintf(&buf_script, "dup_frames=%d\n", nb_frames_dup);
     av_bprintf(&buf_script, "drop_frames=%d\n", nb_frames_drop);
 
+#if HAVE_THREADS
+    for (i = 0; i < nb_input_files; i++)
+    {
+        InputFile *f = input_files[i];
+        int64_t queued;
+
+        if (!f->readahead_size || !f->in_thread_queue)
+            continue;
+        pthread_mutex_lock(&f->queue_lock);
+        queued = f->queued_bytes;
+        pthread_mutex_unlock(&f->queue_lock);
+        av_bprintf(&buf, " ra%d=%3d%%", i, (int)(100 * queued / f->readahead_size));
+        av_bprintf(&buf_script, "readahead_fill%d=%" PRId64 "/%" PRId64 "\n",
+                   i, queued, f->readahead_size);
+    }
+#endif
+
     if (speed < 0)
     {
         av_bprintf(&buf, " speed=N/A");
@@ -1792,7 +3068,8 @@ static void flush_encoders(void)
         AVCodecContext *enc = ost->enc_ctx;
         OutputFile *of = output_files[ost->file_index];
 
-        if (!ost->encoding_needed)
+        // 出错的编码器不再刷新
+        if (!ost->encoding_needed || atomic_load(&ost->enc_error))
             continue;
 
         // Try to enable encoding with no input frames.
@@ -1894,21 +3171,22 @@ static void flush_encoders(void)
             }
             if (ret == AVERROR_EOF)
             {
-                output_packet(of, &pkt, ost, 1);
+                if (output_packet(of, &pkt, ost, 1) < 0)
+                    exit_program(1);
                 break;
             }
-            if (ost->finished & MUXER_FINISHED)
+            if (atomic_load(&ost->finished) & MUXER_FINISHED)
             {
                 av_packet_unref(&pkt);
                 continue;
             }
             av_packet_rescale_ts(&pkt, enc->time_base, ost->mux_timebase);
             pkt_size = pkt.size;
-            output_packet(of, &pkt, ost, 0);
-            if (ost->enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO && vstats_filename)
-            {
-                do_video_stats(ost, pkt_size);
-            }
+            if (output_packet(of, &pkt, ost, 0) < 0)
+                exit_program(1);
+            if (ost->enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO && vstats_filename &&
+                do_video_stats(ost, pkt_size) < 0)
+                exit_program(1);
         }
     }
 }
@@ -1922,7 +3200,7 @@ static int check_output_constraints(InputStream *ist, OutputStream *ost)
     if (ost->source_index != ist_index)
         return 0;
 
-    if (ost->finished)
+    if (atomic_load(&ost->finished))
         return 0;
 
     if (of->start_time != AV_NOPTS_VALUE && ist->pts < of->start_time)
@@ -1938,6 +3216,7 @@ static void do_streamcopy(InputStream *ist, OutputStream *ost, const AVPacket *p
     InputFile *f = input_files[ist->file_index];
     int64_t start_time = (of->start_time == AV_NOPTS_VALUE) ? 0 : of->start_time;
     int64_t ost_tb_start_time = av_rescale_q(start_time, AV_TIME_BASE_Q, ost->mux_timebase);
+    int64_t recording_time;
     AVPacket opkt = {0};
 
     av_init_packet(&opkt);
@@ -1945,7 +3224,8 @@ static void do_streamcopy(InputStream *ist, OutputStream *ost, const AVPacket *p
     // EOF: flush output bitstream filters.
     if (!pkt)
     {
-        output_packet(of, &opkt, ost, 1);
+        if (output_packet(of, &opkt, ost, 1) < 0)
+            exit_program(1);
         return;
     }
 
@@ -1964,8 +3244,9 @@ static void do_streamcopy(InputStream *ist, OutputStream *ost, const AVPacket *p
             return;
     }
 
-    if (of->recording_time != INT64_MAX &&
-        ist->pts >= of->recording_time + start_time)
+    recording_time = get_recording_time(of);
+    if (recording_time != INT64_MAX &&
+        ist->pts >= recording_time + start_time)
     {
         close_output_stream(ost);
         return;
@@ -2024,7 +3305,8 @@ static void do_streamcopy(InputStream *ist, OutputStream *ost, const AVPacket *p
 
     av_copy_packet_side_data(&opkt, pkt);
 
-    output_packet(of, &opkt, ost, 0);
+    if (output_packet(of, &opkt, ost, 0) < 0)
+        exit_program(1);
 }
 
 int guess_input_channel_layout(InputStream *ist)
@@ -2125,6 +3407,12 @@ static int ifilter_send_frame(InputFilter *ifilter, AVFrame *frame)
             return ret;
     }
 
+#if HAVE_THREADS
+    // 重新配置前, 过滤图线程需要处理完已经送出的帧
+    if (fg->in_queue && (need_reinit || !fg->graph))
+        filtergraph_wait_idle(fg);
+#endif
+
     /* (re)init the graph if possible, otherwise buffer the frame and return */
     if (need_reinit || !fg->graph)
     {
@@ -2166,6 +3454,11 @@ static int ifilter_send_frame(InputFilter *ifilter, AVFrame *frame)
         }
     }
 
+#if HAVE_THREADS
+    if (fg->in_queue)
+        return send_to_filtergraph_thread(ifilter, frame, AV_NOPTS_VALUE);
+#endif
+
     // av_buffersrc_add_frame()  // 将解码后的数据(一个AVFrame) 送至 AVFilterContext
     //frame数据的控制权交给了av_buffersrc_add_frame_flags，然后外部的frame被reset
     ret = av_buffersrc_add_frame_flags(ifilter->filter, frame, AV_BUFFERSRC_FLAG_PUSH);
@@ -2185,6 +3478,10 @@ static int ifilter_send_eof(InputFilter *ifilter, int64_t pts)
 
     ifilter->eof = 1;
 
+#if HAVE_THREADS
+    if (ifilter->filter && ifilter->graph->in_queue)
+        return send_to_filtergraph_thread(ifilter, NULL, pts);
+#endif
     if (ifilter->filter)
     {
         ret = av_buffersrc_close(ifilter->filter, pts, AV_BUFFERSRC_FLAG_PUSH);
@@ -2206,30 +3503,388 @@ static int ifilter_send_eof(InputFilter *ifilter, int64_t pts)
     return 0;
 }
 
+#if HAVE_THREADS
+// pipeline 模式下, 主线程交给解码线程的包
+typedef struct DecodePacket
+{
+    AVPacket pkt; /* an empty packet flushes the decoder */
+    enum AVDiscard skip_frame;
+} DecodePacket;
+
+// 解码线程返回的结果: 一帧, 或者解码错误/EOF
+typedef struct DecodeResult
+{
+    AVFrame *frame;
+    int ret;
+    DecoderState state; /* dec_ctx after producing this result */
+} DecodeResult;
+#endif
+
+static void get_decoder_state(const AVCodecContext *avctx, DecoderState *s)
+{
+    s->has_b_frames = avctx->has_b_frames;
+    s->width = avctx->width;
+    s->height = avctx->height;
+    s->pix_fmt = avctx->pix_fmt;
+    s->framerate = avctx->framerate;
+    s->ticks_per_frame = avctx->ticks_per_frame;
+    s->sample_rate = avctx->sample_rate;
+}
+
+#if HAVE_THREADS
+// 把结果放入帧队列, 队列满时阻塞. 返回<0表示线程被中止
+static int push_decode_result(InputStream *ist, AVFrame *frame, int ret)
+{
+    DecodeResult res = {frame, ret};
+
+    // 主线程不能在解码线程使用 dec_ctx 时读取它, 随结果带回
+    get_decoder_state(ist->dec_ctx, &res.state);
+
+    pthread_mutex_lock(&ist->dec_lock);
+    while (!ist->dec_abort && av_fifo_space(ist->dec_frame_queue) < sizeof(res))
+        pthread_cond_wait(&ist->dec_cond, &ist->dec_lock);
+    if (ist->dec_abort)
+    {
+        pthread_mutex_unlock(&ist->dec_lock);
+        av_frame_free(&frame);
+        return AVERROR_EXIT;
+    }
+    av_fifo_generic_write(ist->dec_frame_queue, &res, sizeof(res), NULL);
+    pthread_cond_broadcast(&ist->dec_cond);
+    pthread_mutex_unlock(&ist->dec_lock);
+    return 0;
+}
+
+// 输入流的解码线程: 与 decode() 一样送入一个包, 然后取出所有能取出的帧
+static void *decoder_thread(void *arg)
+{
+    InputStream *ist = arg;
+    DecodePacket msg;
+    AVFrame *frame;
+    int ret;
+
+    while (1)
+    {
+        pthread_mutex_lock(&ist->dec_lock);
+        while (!ist->dec_abort && !av_fifo_size(ist->dec_pkt_queue))
+            pthread_cond_wait(&ist->dec_cond, &ist->dec_lock);
+        if (ist->dec_abort)
+        {
+            pthread_mutex_unlock(&ist->dec_lock);
+            break;
+        }
+        av_fifo_generic_read(ist->dec_pkt_queue, &msg, sizeof(msg), NULL);
+        pthread_cond_broadcast(&ist->dec_cond);
+        pthread_mutex_unlock(&ist->dec_lock);
+
+        ist->dec_ctx->skip_frame = msg.skip_frame;
+        ret = avcodec_send_packet(ist->dec_ctx, &msg.pkt);
+        av_packet_unref(&msg.pkt);
+        if (ret < 0 && ret != AVERROR_EOF)
+        {
+            if (push_decode_result(ist, NULL, ret) < 0)
+                break;
+            continue;
+        }
+
+        do
+        {
+            frame = av_frame_alloc();
+            ret = frame ? avcodec_receive_frame(ist->dec_ctx, frame) : AVERROR(ENOMEM);
+            if (ret < 0)
+                av_frame_free(&frame);
+            if (ret == AVERROR(EAGAIN))
+                break;
+            if (push_decode_result(ist, frame, ret) < 0)
+                return NULL;
+        } while (ret >= 0);
+    }
+
+    return NULL;
+}
+
+// 把还没有送出的包放入包队列, 调用者需持有 dec_lock 并确认队列有空位
+static void send_pending_packet(InputStream *ist)
+{
+    DecodePacket msg;
+
+    msg.pkt = ist->dec_pending;
+    msg.skip_frame = ist->dec_pending_skip_frame;
+    av_fifo_generic_write(ist->dec_pkt_queue, &msg, sizeof(msg), NULL);
+    pthread_cond_broadcast(&ist->dec_cond);
+    ist->dec_has_pending = 0;
+}
+
+/**
+ * decode() 的异步版本. 包交给解码线程, 帧从帧队列中取出, 所以帧相对包的延迟
+ * 就像解码器本身多了几帧延迟, next_pts/next_dts 的计算方式不变.
+ * 刷新解码器时等待, 直到取出所有剩余的帧和EOF.
+ * 没有取到帧时返回前包一定已送出, 解码错误推迟到那时返回.
+ */
+static int decode_async(InputStream *ist, AVFrame *frame, int *got_frame, AVPacket *pkt)
+{
+    DecodeResult res;
+    DecodePacket msg;
+    int ret = 0;
+
+    *got_frame = 0;
+    pthread_mutex_lock(&ist->dec_lock);
+
+    if (pkt)
+    {
+        /*
+         * 调用者在取到帧之后出错时不再取帧, 上一个包可能还没有送出. 这里不能等
+         * 包队列的空位: 解码线程可能正阻塞在已满的帧队列上. 与同步解码时
+         * avcodec_send_packet() 返回 EAGAIN 一样, 没有空位时不接受新的包.
+         */
+        if (ist->dec_has_pending)
+        {
+            if (av_fifo_space(ist->dec_pkt_queue) < sizeof(msg))
+            {
+                ret = AVERROR(EAGAIN);
+                goto end;
+            }
+            send_pending_packet(ist);
+        }
+        ret = av_packet_ref(&ist->dec_pending, pkt);
+        if (ret < 0)
+            goto end;
+        ist->dec_pending_skip_frame = ist->dec_skip_frame;
+        ist->dec_has_pending = 1;
+        if (!pkt->data && !pkt->size)
+            ist->dec_flushing = 1;
+        else
+            ist->dec_eof = 0;
+    }
+
+    while (1)
+    {
+        if (ist->dec_has_pending && av_fifo_space(ist->dec_pkt_queue) >= sizeof(msg))
+            send_pending_packet(ist);
+        // 先取帧, 解码线程可能正阻塞在已满的帧队列上
+        if (av_fifo_size(ist->dec_frame_queue))
+        {
+            av_fifo_generic_read(ist->dec_frame_queue, &res, sizeof(res), NULL);
+            pthread_cond_broadcast(&ist->dec_cond);
+            ist->dec_state = res.state;
+            if (res.frame)
+            {
+                av_frame_move_ref(frame, res.frame);
+                av_frame_free(&res.frame);
+                *got_frame = 1;
+            }
+            else if (res.ret != AVERROR_EOF && ist->dec_has_pending)
+            {
+                // 调用者收到错误后不再取帧, 先把包送出再返回错误
+                if (!ist->dec_error)
+                    ist->dec_error = res.ret;
+                continue;
+            }
+            else
+            {
+                ret = res.ret;
+                if (ret == AVERROR_EOF)
+                {
+                    ist->dec_flushing = 0;
+                    ist->dec_eof = 1;
+                }
+            }
+            break;
+        }
+        if (!ist->dec_has_pending && ist->dec_error)
+        {
+            ret = ist->dec_error;
+            ist->dec_error = 0;
+            break;
+        }
+        // 包已送出, 并且不需要等刷新的结果
+        if (!ist->dec_has_pending && !ist->dec_flushing)
+        {
+            ret = ist->dec_eof ? AVERROR_EOF : 0;
+            break;
+        }
+        pthread_cond_wait(&ist->dec_cond, &ist->dec_lock);
+    }
+
+end:
+    pthread_mutex_unlock(&ist->dec_lock);
+    return ret;
+}
+
+// 停止所有解码线程, 丢弃队列中剩余的包和帧
+static void free_decoder_threads(void)
+{
+    DecodePacket msg;
+    DecodeResult res;
+    int i;
+
+    for (i = 0; i < nb_input_streams; i++)
+    {
+        InputStream *ist = input_streams[i];
+
+        if (!ist || !ist->dec_pkt_queue)
+            continue;
+
+        pthread_mutex_lock(&ist->dec_lock);
+        ist->dec_abort = 1;
+        pthread_cond_broadcast(&ist->dec_cond);
+        pthread_mutex_unlock(&ist->dec_lock);
+        pthread_join(ist->dec_thread, NULL);
+
+        while (av_fifo_size(ist->dec_pkt_queue))
+        {
+            av_fifo_generic_read(ist->dec_pkt_queue, &msg, sizeof(msg), NULL);
+            av_packet_unref(&msg.pkt);
+        }
+        while (av_fifo_size(ist->dec_frame_queue))
+        {
+            av_fifo_generic_read(ist->dec_frame_queue, &res, sizeof(res), NULL);
+            av_frame_free(&res.frame);
+        }
+        if (ist->dec_has_pending)
+            av_packet_unref(&ist->dec_pending);
+        ist->dec_has_pending = 0;
+        av_fifo_freep(&ist->dec_pkt_queue);
+        av_fifo_freep(&ist->dec_frame_queue);
+        pthread_mutex_destroy(&ist->dec_lock);
+        pthread_cond_destroy(&ist->dec_cond);
+    }
+}
+
+/**
+ * pipeline 模式下每个解码音视频的输入流一个解码线程, 多个重负载的解码器可以并行.
+ * 字幕和硬件解码仍在主线程中同步解码.
+ */
+static int init_decoder_threads(void)
+{
+    int i, ret;
+
+    if (!pipeline_mode)
+        return 0;
+
+    for (i = 0; i < nb_input_streams; i++)
+    {
+        InputStream *ist = input_streams[i];
+        int size = FFMAX(pipeline_queue_size, 1);
+
+        if (!ist->decoding_needed || ist->hwaccel_id != HWACCEL_NONE ||
+            (ist->dec_ctx->codec_type != AVMEDIA_TYPE_VIDEO &&
+             ist->dec_ctx->codec_type != AVMEDIA_TYPE_AUDIO))
+            continue;
+
+        ist->dec_pkt_queue = av_fifo_alloc(size * sizeof(DecodePacket));
+        ist->dec_frame_queue = av_fifo_alloc(size * sizeof(DecodeResult));
+        if (!ist->dec_pkt_queue || !ist->dec_frame_queue)
+        {
+            av_fifo_freep(&ist->dec_pkt_queue);
+            av_fifo_freep(&ist->dec_frame_queue);
+            return AVERROR(ENOMEM);
+        }
+        ist->dec_abort = 0;
+        ist->dec_skip_frame = ist->dec_ctx->skip_frame;
+        pthread_mutex_init(&ist->dec_lock, NULL);
+        pthread_cond_init(&ist->dec_cond, NULL);
+
+        if ((ret = pthread_create(&ist->dec_thread, NULL, decoder_thread, ist)))
+        {
+            av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
+            av_fifo_freep(&ist->dec_pkt_queue);
+            av_fifo_freep(&ist->dec_frame_queue);
+            pthread_mutex_destroy(&ist->dec_lock);
+            pthread_cond_destroy(&ist->dec_cond);
+            return AVERROR(ret);
+        }
+    }
+
+    return 0;
+}
+#endif
+
 // This does not quite work like avcodec_decode_audio4/avcodec_decode_video2.
 // There is the following difference: if you got a frame, you must call  it again with pkt=NULL. pkt==NULL is treated differently from pkt->size==0
 // (pkt==NULL means get more output, pkt->size==0 is a flush/drain packet)
 static int decode(AVCodecContext *avctx, AVFrame *frame, int *got_frame, AVPacket *pkt)
 {
+    InputStream *ist = avctx->opaque;
     int ret;
 
-    *got_frame = 0;
-    if (pkt)
+#if HAVE_THREADS
+    if (ist && ist->dec_pkt_queue)
+        return decode_async(ist, frame, got_frame, pkt);
+#endif
+
+    *got_frame = 0;
+    if (pkt)
+    {
+        ret = avcodec_send_packet(avctx, pkt);
+        // In particular, we don't expect AVERROR(EAGAIN), because we read all
+        // decoded frames with avcodec_receive_frame() until done.
+        if (ret < 0 && ret != AVERROR_EOF)
+            goto end;
+    }
+
+    ret = avcodec_receive_frame(avctx, frame);
+    if (ret >= 0)
+        *got_frame = 1;
+    else if (ret == AVERROR(EAGAIN))
+        ret = 0;
+
+end:
+    if (ist)
+        get_decoder_state(avctx, &ist->dec_state);
+    return ret;
+}
+
+// -frame_cache_size 中缓存的一帧
+typedef struct FrameCacheEntry
+{
+    InputStream *ist;
+    AVFrame *frame;
+    AVRational time_base; /* time base of frame->pts */
+} FrameCacheEntry;
+
+static void free_frame_cache(InputFile *f)
+{
+    FrameCacheEntry entry;
+
+    if (!f->frame_cache)
+        return;
+    while (av_fifo_size(f->frame_cache))
     {
-        ret = avcodec_send_packet(avctx, pkt);
-        // In particular, we don't expect AVERROR(EAGAIN), because we read all
-        // decoded frames with avcodec_receive_frame() until done.
-        if (ret < 0 && ret != AVERROR_EOF)
-            return ret;
+        av_fifo_generic_read(f->frame_cache, &entry, sizeof(entry), NULL);
+        av_frame_free(&entry.frame);
     }
+    av_fifo_freep(&f->frame_cache);
+    f->frame_cache_bytes = 0;
+}
 
-    ret = avcodec_receive_frame(avctx, frame);
-    if (ret < 0 && ret != AVERROR(EAGAIN))
-        return ret;
-    if (ret >= 0)
-        *got_frame = 1;
+// 第一遍解码时缓存一帧的引用, 超过 -frame_cache_size 或是硬件帧时放弃缓存
+static void frame_cache_add(InputFile *f, InputStream *ist, AVFrame *frame)
+{
+    FrameCacheEntry entry = {ist, NULL, ist->st->time_base};
+    int64_t size = 0;
+    int i;
 
-    return 0;
+    if (ist->dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO)
+        entry.time_base = (AVRational){1, frame->sample_rate};
+    for (i = 0; i < FF_ARRAY_ELEMS(frame->buf) && frame->buf[i]; i++)
+        size += frame->buf[i]->size;
+    for (i = 0; i < frame->nb_extended_buf; i++)
+        size += frame->extended_buf[i]->size;
+
+    if (frame->hw_frames_ctx || f->frame_cache_bytes + size > f->frame_cache_size ||
+        (!av_fifo_space(f->frame_cache) &&
+         av_fifo_realloc2(f->frame_cache, 2 * av_fifo_size(f->frame_cache)) < 0) ||
+        !(entry.frame = av_frame_clone(frame)))
+    {
+        av_log(f->ctx, AV_LOG_VERBOSE, "Decoded frames do not fit into -frame_cache_size, "
+                                       "decoding every loop instead\n");
+        free_frame_cache(f);
+        f->frame_cache_state = LOOP_CACHE_OFF;
+        return;
+    }
+    av_fifo_generic_write(f->frame_cache, &entry, sizeof(entry), NULL);
+    f->frame_cache_bytes += size;
 }
 
 static int send_frame_to_filters(InputStream *ist, AVFrame *decoded_frame)
@@ -2237,6 +3892,9 @@ static int send_frame_to_filters(InputStream *ist, AVFrame *decoded_frame)
     int i, ret;
     AVFrame *f;
 
+    if (input_files[ist->file_index]->frame_cache_state == LOOP_CACHE_FILLING)
+        frame_cache_add(input_files[ist->file_index], ist, decoded_frame);
+
     av_assert1(ist->nb_filters > 0); /* ensure ret is initialized */
     for (i = 0; i < ist->nb_filters; i++)
     { // 可能接入多个filter，目前我们只看一个的
@@ -2284,9 +3942,10 @@ static int decode_audio(InputStream *ist, AVPacket *pkt, int *got_output,
     if (ret < 0)
         *decode_failed = 1;
 
-    if (ret >= 0 && avctx->sample_rate <= 0)
+    // 解码线程可能正在使用 avctx, 采样率取 decode() 得到的 dec_state
+    if (ret >= 0 && ist->dec_state.sample_rate <= 0)
     {
-        av_log(avctx, AV_LOG_ERROR, "Sample rate %d invalid\n", avctx->sample_rate);
+        av_log(avctx, AV_LOG_ERROR, "Sample rate %d invalid\n", ist->dec_state.sample_rate);
         ret = AVERROR_INVALIDDATA;
     }
 
@@ -2302,9 +3961,9 @@ static int decode_audio(InputStream *ist, AVPacket *pkt, int *got_output,
     /* increment next_dts to use for the case where the input stream does not
        have timestamps or there are multiple frames in the packet */
     ist->next_pts += ((int64_t)AV_TIME_BASE * decoded_frame->nb_samples) /
-                     avctx->sample_rate; // 计算下一帧pts
+                     ist->dec_state.sample_rate; // 计算下一帧pts
     ist->next_dts += ((int64_t)AV_TIME_BASE * decoded_frame->nb_samples) /
-                     avctx->sample_rate; // 计算下一帧dts
+                     ist->dec_state.sample_rate; // 计算下一帧dts
 
     if (decoded_frame->pts != AV_NOPTS_VALUE)
     {
@@ -2322,8 +3981,8 @@ static int decode_audio(InputStream *ist, AVPacket *pkt, int *got_output,
     }
     if (decoded_frame->pts != AV_NOPTS_VALUE)
         decoded_frame->pts = av_rescale_delta(decoded_frame_tb, decoded_frame->pts,
-                                              (AVRational){1, avctx->sample_rate}, decoded_frame->nb_samples, &ist->filter_in_rescale_delta_last,
-                                              (AVRational){1, avctx->sample_rate});
+                                              (AVRational){1, ist->dec_state.sample_rate}, decoded_frame->nb_samples, &ist->filter_in_rescale_delta_last,
+                                              (AVRational){1, ist->dec_state.sample_rate});
     ist->nb_samples = decoded_frame->nb_samples;
     err = send_frame_to_filters(ist, decoded_frame); // 先把帧发送到filter
 
@@ -2332,6 +3991,130 @@ static int decode_audio(InputStream *ist, AVPacket *pkt, int *got_output,
     return err < 0 ? err : ret;
 }
 
+/* 不改变帧时间戳, 也不增删帧的filter, -decode_decimate 只在这样的过滤图上生效.
+ * trim 只会在两端丢帧, 不影响中间的帧是否被vsync丢弃.
+ * 输出不能依赖之前的帧或帧序号: hqdn3d 是时域降噪, drawtext 可以画出 %{n}, 都不在此列 */
+static const char *const decimate_safe_filters[] = {
+    "buffer", "buffersink", "format", "null", "scale", "crop", "pad", "hflip", "vflip",
+    "transpose", "rotate", "setsar", "setdar", "trim", "colorspace", "eq", "lut", "lutyuv",
+    "lutrgb", "unsharp", NULL
+};
+
+/**
+ * -decode_decimate: 过滤图配置好后, 判断该输入流是否可以跳过vsync必然丢弃的帧.
+ * 要求: 只有一个简单过滤图和一个视频输出流, 用 -r 指定了输出帧率并且远小于输入帧率,
+ * vsync 是 cfr/vfr, 过滤图中没有改变时间的filter.
+ */
+static void init_decode_decimation(InputStream *ist)
+{
+    FilterGraph *fg;
+    OutputStream *ost;
+    OutputFile *of;
+    AVRational in_rate;
+    int i, j, method;
+
+    ist->decimate = 0;
+    if (ist->nb_filters != 1 || ist->framerate.num)
+        return;
+    fg = ist->filters[0]->graph;
+    if (!fg->graph)
+    {
+        ist->decimate = -1; // 还没有配置, 下一个包再判断
+        return;
+    }
+    if (!filtergraph_is_simple(fg) || fg->nb_outputs != 1)
+        return;
+    ost = fg->outputs[0]->ost;
+    of = output_files[ost->file_index];
+    if (!ost->frame_rate.num || ost->enc_timebase.num)
+        return;
+
+    for (i = 0; i < fg->graph->nb_filters; i++)
+    {
+        const char *name = fg->graph->filters[i]->filter->name;
+        for (j = 0; decimate_safe_filters[j] && strcmp(decimate_safe_filters[j], name); j++)
+            ;
+        if (!decimate_safe_filters[j])
+            return;
+    }
+
+    method = get_video_sync_method(of, ist);
+    if (method == VSYNC_CFR || method == VSYNC_VSCFR)
+        ist->decimate_threshold = 1.1;
+    else if (method == VSYNC_VFR)
+        ist->decimate_threshold = 0.6;
+    else
+        return;
+
+    in_rate = av_buffersink_get_frame_rate(fg->outputs[0]->filter);
+    if (in_rate.num <= 0 || in_rate.den <= 0)
+        return;
+    ist->decimate_tb = av_inv_q(ost->frame_rate);
+    ist->decimate_duration = av_q2d(av_div_q(ost->frame_rate, in_rate));
+    // 输出帧率至少要低一半才有帧可以跳过
+    if (ist->decimate_duration > 0.5)
+        return;
+    ist->decimate_offset = of->start_time == AV_NOPTS_VALUE ? 0 :
+                           of->start_time * av_q2d(AV_TIME_BASE_Q) / av_q2d(ist->decimate_tb);
+    ist->decimate_warmup = NAN;
+    ist->decimate = 1;
+    av_log(NULL, AV_LOG_VERBOSE, "Input stream #%d:%d: skipping non-reference frames dropped by -r %d/%d\n",
+           ist->file_index, ist->st->index, ost->frame_rate.num, ost->frame_rate.den);
+}
+
+/**
+ * vsync 是否必然丢弃pts为 pkt->pts 的帧.
+ * 稳定状态下, cfr 在 delta = u + d - N >= -1.1 时输出一帧并且 N 加一 (vfr 时为 -0.6),
+ * u 是帧在输出时间基下的pts, d 是输入帧的时长, N 是下一个输出帧的序号.
+ * 所以只有 (u + c, u + c + d] 中有整数的帧才会被输出, c 是阈值.
+ * 区间两端各放宽半帧, 开头的几个输出帧之前不跳过, 这时 N 还没有进入稳定状态.
+ */
+static int decimate_can_skip(InputStream *ist, AVPacket *pkt)
+{
+    double u, lo, hi, eps = ist->decimate_duration / 2;
+
+    if (ist->decimate <= 0 || !pkt || pkt->pts == AV_NOPTS_VALUE)
+        return 0;
+    u = pkt->pts * av_q2d(ist->st->time_base) / av_q2d(ist->decimate_tb) - ist->decimate_offset;
+    if (isnan(ist->decimate_warmup))
+        ist->decimate_warmup = u + ist->decimate_threshold + 2;
+    if (u < ist->decimate_warmup)
+        return 0;
+    lo = u + ist->decimate_threshold - eps;
+    hi = u + ist->decimate_threshold + ist->decimate_duration + eps;
+    return floor(hi) <= lo;
+}
+
+// 根据 -ss 精确seek 和 -decode_decimate 设置这个包的 skip_frame
+static void update_skip_frame(InputStream *ist, AVPacket *pkt)
+{
+    enum AVDiscard skip_frame = ist->user_skip_frame;
+
+    // 精确seek时, 起点之前的非参考帧不需要重建, 到达起点后恢复正常解码
+    if (ist->skip_nonref_until != AV_NOPTS_VALUE)
+    {
+        if (pkt && pkt->pts != AV_NOPTS_VALUE && pkt->pts < ist->skip_nonref_until)
+            skip_frame = FFMAX(skip_frame, AVDISCARD_NONREF);
+        else if (!pkt || pkt->pts != AV_NOPTS_VALUE) // 没有pts的包无法判断, 正常解码
+            ist->skip_nonref_until = AV_NOPTS_VALUE;
+    }
+
+    if (ist->decimate < 0)
+        init_decode_decimation(ist);
+    if (decimate_can_skip(ist, pkt))
+        skip_frame = FFMAX(skip_frame, AVDISCARD_NONREF);
+
+#if HAVE_THREADS
+    // 解码线程在送入这个包之前设置
+    if (ist->dec_pkt_queue)
+    {
+        ist->dec_skip_frame = skip_frame;
+        return;
+    }
+#endif
+    ist->dec_ctx->skip_frame = skip_frame;
+}
+
 // 解码视频帧AVPacket
 static int decode_video(InputStream *ist, AVPacket *pkt, int *got_output, int64_t *duration_pts,
                         int eof, int *decode_failed)
@@ -2382,6 +4165,8 @@ static int decode_video(InputStream *ist, AVPacket *pkt, int *got_output, int64_
         ist->dts_buffer[ist->nb_dts_buffer++] = dts; // 存储dts
     }
 
+    update_skip_frame(ist, pkt);
+
     update_benchmark(NULL);
     ret = decode(ist->dec_ctx, decoded_frame, got_output, pkt ? &avpkt : NULL);
     update_benchmark("decode_video %d.%d", ist->file_index, ist->st->index);
@@ -2392,11 +4177,12 @@ static int decode_video(InputStream *ist, AVPacket *pkt, int *got_output, int64_
 
     // The following line may be required in some cases where there is no parser
     // or the parser does not has_b_frames correctly
-    if (ist->st->codecpar->video_delay < ist->dec_ctx->has_b_frames)
+    // 解码线程在使用 dec_ctx, 读 decode() 得到的 dec_state
+    if (ist->st->codecpar->video_delay < ist->dec_state.has_b_frames)
     {
         if (ist->dec_ctx->codec_id == AV_CODEC_ID_H264)
         {
-            ist->st->codecpar->video_delay = ist->dec_ctx->has_b_frames; // 存在B帧时延迟
+            ist->st->codecpar->video_delay = ist->dec_state.has_b_frames; // 存在B帧时延迟
         }
         else
             av_log(ist->dec_ctx, AV_LOG_WARNING,
@@ -2404,7 +4190,7 @@ static int decode_video(InputStream *ist, AVPacket *pkt, int *got_output, int64_
                    "If you want to help, upload a sample "
                    "of this file to ftp://upload.ffmpeg.org/incoming/ "
                    "and contact the ffmpeg-devel mailing list. (ffmpeg-devel@ffmpeg.org)\n",
-                   ist->dec_ctx->has_b_frames,
+                   ist->dec_state.has_b_frames,
                    ist->st->codecpar->video_delay);
     }
 
@@ -2416,17 +4202,17 @@ static int decode_video(InputStream *ist, AVPacket *pkt, int *got_output, int64_
     if (*got_output && ret >= 0)
     {
         // 检测解码后的宽高、格式是否和dec_ctx预计的一致
-        if (ist->dec_ctx->width != decoded_frame->width ||
-            ist->dec_ctx->height != decoded_frame->height ||
-            ist->dec_ctx->pix_fmt != decoded_frame->format)
+        if (ist->dec_state.width != decoded_frame->width ||
+            ist->dec_state.height != decoded_frame->height ||
+            ist->dec_state.pix_fmt != decoded_frame->format)
         {
             av_log(NULL, AV_LOG_DEBUG, "Frame parameters mismatch context %d,%d,%d != %d,%d,%d\n",
                    decoded_frame->width,
                    decoded_frame->height,
                    decoded_frame->format,
-                   ist->dec_ctx->width,
-                   ist->dec_ctx->height,
-                   ist->dec_ctx->pix_fmt);
+                   ist->dec_state.width,
+                   ist->dec_state.height,
+                   ist->dec_state.pix_fmt);
         }
     }
 
@@ -2524,7 +4310,7 @@ static int process_input_packet(InputStream *ist, const AVPacket *pkt, int no_eo
     AVPacket avpkt;
     if (!ist->saw_first_ts) // 为了计算下一帧的pts和dts
     {
-        ist->dts = ist->st->avg_frame_rate.num ? -ist->dec_ctx->has_b_frames * AV_TIME_BASE / av_q2d(ist->st->avg_frame_rate) : 0;
+        ist->dts = ist->st->avg_frame_rate.num ? -ist->dec_state.has_b_frames * AV_TIME_BASE / av_q2d(ist->st->avg_frame_rate) : 0;
         ist->pts = 0;
         if (pkt && pkt->pts != AV_NOPTS_VALUE && !ist->decoding_needed)
         {
@@ -2588,12 +4374,12 @@ static int process_input_packet(InputStream *ist, const AVPacket *pkt, int no_eo
                 {
                     duration_dts = av_rescale_q(pkt->duration, ist->st->time_base, AV_TIME_BASE_Q);
                 }
-                else if (ist->dec_ctx->framerate.num != 0 && ist->dec_ctx->framerate.den != 0)
+                else if (ist->dec_state.framerate.num != 0 && ist->dec_state.framerate.den != 0)
                 {
-                    int ticks = av_stream_get_parser(ist->st) ? av_stream_get_parser(ist->st)->repeat_pict + 1 : ist->dec_ctx->ticks_per_frame;
+                    int ticks = av_stream_get_parser(ist->st) ? av_stream_get_parser(ist->st)->repeat_pict + 1 : ist->dec_state.ticks_per_frame;
                     duration_dts = ((int64_t)AV_TIME_BASE *
-                                    ist->dec_ctx->framerate.den * ticks) /
-                                   ist->dec_ctx->framerate.num / ist->dec_ctx->ticks_per_frame;
+                                    ist->dec_state.framerate.den * ticks) /
+                                   ist->dec_state.framerate.num / ist->dec_state.ticks_per_frame;
                 }
 
                 if (ist->dts != AV_NOPTS_VALUE && duration_dts)
@@ -2724,7 +4510,7 @@ static int process_input_packet(InputStream *ist, const AVPacket *pkt, int no_eo
     {
         OutputStream *ost = output_streams[i];
 
-        if (!check_output_constraints(ist, ost) || ost->encoding_needed)
+        if (!check_output_constraints(ist, ost) || ost->encoding_needed || ost->enc_share)
             continue;
 
         do_streamcopy(ist, ost, pkt);
@@ -2939,7 +4725,12 @@ static int init_input_stream(int ist_index, char *error, int error_len)
         ist->dec_ctx->pkt_timebase = ist->st->time_base; // AVCodecContext 的 timebase 从 AVStream中获取
 
         if (!av_dict_get(ist->decoder_opts, "threads", NULL, 0))
-            av_dict_set(&ist->decoder_opts, "threads", "auto", 0);
+        {
+            if (ist->nb_threads > 0)
+                av_dict_set_int(&ist->decoder_opts, "threads", ist->nb_threads, 0);
+            else
+                av_dict_set(&ist->decoder_opts, "threads", "auto", 0);
+        }
 
         /* Attached pics are sparse, therefore we would not want to delay their decoding till EOF. */
         if (ist->st->disposition & AV_DISPOSITION_ATTACHED_PIC)
@@ -2972,6 +4763,47 @@ static int init_input_stream(int ist_index, char *error, int error_len)
 
     ist->next_pts = AV_NOPTS_VALUE;
     ist->next_dts = AV_NOPTS_VALUE;
+    get_decoder_state(ist->dec_ctx, &ist->dec_state);
+
+    // 与 configure_input_video_filter() 中trim的起点一致
+    ist->skip_nonref_until = AV_NOPTS_VALUE;
+    if (ist->decoding_needed && ist->dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+        InputFile *f = input_files[ist->file_index];
+        int64_t tsoffset = 0;
+
+        ist->user_skip_frame = ist->dec_ctx->skip_frame;
+        ist->decimate = decode_decimate ? -1 : 0;
+        if (f->accurate_seek && f->start_time != AV_NOPTS_VALUE)
+        {
+            if (copy_ts)
+            {
+                tsoffset = f->start_time;
+                if (!start_at_zero && f->ctx->start_time != AV_NOPTS_VALUE)
+                    tsoffset += f->ctx->start_time;
+            }
+            ist->skip_nonref_until = av_rescale_q(tsoffset, AV_TIME_BASE_Q, ist->st->time_base);
+        }
+    }
+
+    if (input_files[ist->file_index]->keyframe_step)
+    {
+        if (ist->decoding_needed && ist->dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+        {
+            // 非关键帧在 process_input() 中就丢掉了, 这里防止解码器输出其它帧
+            ist->user_skip_frame = FFMAX(ist->user_skip_frame, AVDISCARD_NONKEY);
+            ist->dec_ctx->skip_frame = ist->user_skip_frame;
+            ist->st->discard = FFMAX(ist->st->discard, AVDISCARD_NONKEY);
+        }
+        else
+        {
+            if (!ist->discard)
+                av_log(NULL, AV_LOG_WARNING, "Input stream #%d:%d is not a decoded video stream, "
+                                             "it is dropped with -keyframe_step\n",
+                       ist->file_index, ist->st->index);
+            ist->st->discard = AVDISCARD_ALL;
+        }
+    }
 
     return 0;
 }
@@ -3000,14 +4832,21 @@ static int check_init_output_file(OutputFile *of, int file_index)
             return 0;
     }
 
+    lock_output_file(of);
+
     of->ctx->interrupt_callback = int_cb;
-    ret = avformat_write_header(of->ctx, &of->opts); // 初始化写入头部
+    // 分段输出时 of->ctx 只是模板, 第0个文件和之后的文件一样打开, 也一样交给关闭线程
+    if (of->rotate_pattern)
+        ret = open_next_muxer(of, &of->mux_ctx, &of->aio_pb);
+    else
+        ret = avformat_write_header(of->ctx, &of->opts); // 初始化写入头部
     if (ret < 0)
     {
         av_log(NULL, AV_LOG_ERROR,
                "Could not write header for output file #%d "
                "(incorrect codec parameters ?): %s\n",
                file_index, av_err2str(ret));
+        unlock_output_file(of);
         return ret;
     }
 
@@ -3015,7 +4854,7 @@ static int check_init_output_file(OutputFile *of, int file_index)
     of->header_written = 1;
 
     // 在屏幕上打印输出格式信息. 注意是输出格式的信息, 输入格式的信息的打印是在 parse_options() 函数运行过程中调用opt_input_file()的时候打印到屏幕上的.
-    av_dump_format(of->ctx, file_index, of->ctx->url, 1);
+    av_dump_format(of->mux_ctx, file_index, of->mux_ctx->url, 1);
 
     if (sdp_filename || want_sdp)
         print_sdp();
@@ -3025,19 +4864,42 @@ static int check_init_output_file(OutputFile *of, int file_index)
     {
         OutputStream *ost = output_streams[of->ost_index + i];
 
-        /* try to improve muxing time_base (only possible if nothing has been written yet) */
-        if (!av_fifo_size(ost->muxing_queue))
+        /* try to improve muxing time_base (only possible if nothing has been written yet)
+         * in pipeline mode the encoder thread may already be rescaling packets to it */
+        if (!av_fifo_size(ost->muxing_queue) && !(pipeline_mode && ost->encoding_needed) && !ost->enc_share)
             ost->mux_timebase = ost->st->time_base; // 改进time_base
 
+        // 头部写入后不会再有包入队, 从头读回溢出的数据
+        if (ost->muxing_queue_spill)
+        {
+            av_log(NULL, AV_LOG_VERBOSE, "Reading back %" PRId64 " bytes of output stream %d:%d buffered on disk\n",
+                   ost->muxing_queue_spilled, ost->file_index, ost->index);
+            rewind(ost->muxing_queue_spill);
+        }
+
         while (av_fifo_size(ost->muxing_queue))
         {
             // 队列
             AVPacket pkt;
-            av_fifo_generic_read(ost->muxing_queue, &pkt, sizeof(pkt), NULL);
-            write_packet(of, &pkt, ost, 1);
+            ret = muxing_queue_read(ost, &pkt);
+            if (ret < 0)
+            {
+                av_log(NULL, AV_LOG_ERROR, "Error reading back the muxing queue of output stream %d:%d: %s\n",
+                       ost->file_index, ost->index, av_err2str(ret));
+                av_packet_unref(&pkt);
+                unlock_output_file(of);
+                return ret;
+            }
+            if ((ret = write_packet(of, &pkt, ost, 1)) < 0)
+            {
+                unlock_output_file(of);
+                return ret;
+            }
         }
     }
 
+    unlock_output_file(of);
+
     return 0;
 }
 
@@ -3522,10 +5384,43 @@ static int init_output_stream_encode(OutputStream *ost)
     return 0;
 }
 
+// -share_encoder: 流参数来自已经打开的编码器
+static int init_output_stream_shared(OutputStream *ost)
+{
+    OutputStream *src = ost->enc_share;
+    int i, ret;
+
+    ret = avcodec_parameters_from_context(ost->st->codecpar, src->enc_ctx);
+    if (ret < 0)
+        return ret;
+    // FIXME: ost->st->codec should't be needed here anymore.
+    ret = avcodec_copy_context(ost->st->codec, src->enc_ctx);
+    if (ret < 0)
+        return ret;
+
+    for (i = 0; i < src->st->nb_side_data; i++)
+    {
+        const AVPacketSideData *sd = &src->st->side_data[i];
+        uint8_t *dst = av_stream_new_side_data(ost->st, sd->type, sd->size);
+        if (!dst)
+            return AVERROR(ENOMEM);
+        memcpy(dst, sd->data, sd->size);
+    }
+
+    if (ost->st->time_base.num <= 0 || ost->st->time_base.den <= 0)
+        ost->st->time_base = av_add_q(src->enc_ctx->time_base, (AVRational){0, 1});
+    ost->st->avg_frame_rate = src->st->avg_frame_rate;
+    ost->st->duration = av_rescale_q(src->st->duration, src->st->time_base, ost->st->time_base);
+    // share_packet() 从编码器的 time_base 转换过来, 之后不再改变
+    ost->mux_timebase = src->enc_ctx->time_base;
+
+    return 0;
+}
+
 // 打开输出流编码器
 static int init_output_stream(OutputStream *ost, char *error, int error_len)
 {
-    int ret = 0;
+    int ret = 0, i;
 
     // 如果需要重新编码
     if (ost->encoding_needed)
@@ -3557,7 +5452,10 @@ static int init_output_stream(OutputStream *ost, char *error, int error_len)
 
         if (!av_dict_get(ost->encoder_opts, "threads", NULL, 0))
         {
-            av_dict_set(&ost->encoder_opts, "threads", "auto", 0);
+            if (ost->nb_threads > 0)
+                av_dict_set_int(&ost->encoder_opts, "threads", ost->nb_threads, 0);
+            else
+                av_dict_set(&ost->encoder_opts, "threads", "auto", 0);
         }
 
         if (ost->enc->type == AVMEDIA_TYPE_AUDIO &&
@@ -3701,6 +5599,17 @@ static int init_output_stream(OutputStream *ost, char *error, int error_len)
             return ret;
         }
     }
+    else if (ost->enc_share)
+    {
+        // 等共享的编码器打开后再初始化, 见下面
+        if (!ost->enc_share->initialized)
+            return 0;
+        ret = init_output_stream_shared(ost);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
 
     // parse user provided disposition, and update stream values
     if (ost->disposition)
@@ -3754,6 +5663,13 @@ static int init_output_stream(OutputStream *ost, char *error, int error_len)
         return ret;
     }
 
+    for (i = 0; i < ost->nb_enc_shares; i++)
+    {
+        ret = init_output_stream(ost->enc_shares[i], error, error_len);
+        if (ret < 0)
+            return ret;
+    }
+
     return ret;
 }
 
@@ -3772,6 +5688,167 @@ static void report_new_stream(int input_index, AVPacket *pkt)
     file->nb_streams_warn = pkt->stream_index + 1;
 }
 
+// -threads_budget 中的一份, 按 weight 分配线程数
+typedef struct ThreadShare
+{
+    int *nb_threads;
+    double weight;
+    double remainder;
+} ThreadShare;
+
+// 每个像素的相对开销, 编码比解码贵得多
+static double codec_thread_cost(const AVCodec *codec, int encoder)
+{
+    switch (codec ? codec->id : AV_CODEC_ID_NONE)
+    {
+    case AV_CODEC_ID_HEVC:
+    case AV_CODEC_ID_VP9:
+    case AV_CODEC_ID_AV1:
+        return encoder ? 8 : 2;
+    case AV_CODEC_ID_H264:
+    case AV_CODEC_ID_VP8:
+        return encoder ? 4 : 1;
+    default:
+        return encoder ? 2 : 0.5;
+    }
+}
+
+static int64_t ost_thread_pixels(OutputStream *ost)
+{
+    InputStream *ist = NULL;
+
+    if (ost->enc_ctx->width > 0 && ost->enc_ctx->height > 0)
+        return (int64_t)ost->enc_ctx->width * ost->enc_ctx->height;
+    if (ost->source_index >= 0)
+        ist = input_streams[ost->source_index];
+    else if (ost->filter && ost->filter->graph->nb_inputs)
+        ist = ost->filter->graph->inputs[0]->ist;
+    if (ist && ist->st->codecpar->width > 0 && ist->st->codecpar->height > 0)
+        return (int64_t)ist->st->codecpar->width * ist->st->codecpar->height;
+    return 1920 * 1080;
+}
+
+// 用户已经指定线程数时, 从预算中扣除, 返回1
+static int thread_budget_user_set(AVDictionary *opts, int *budget)
+{
+    AVDictionaryEntry *e = av_dict_get(opts, "threads", NULL, 0);
+
+    if (!e)
+        return 0;
+    *budget -= FFMAX(atoi(e->value), 1);
+    return 1;
+}
+
+/**
+ * 按 -threads_budget 给解码器, 编码器和过滤图分配线程数.
+ * 视频的每一份至少1个线程, 其余按分辨率和编解码开销的比例分配,
+ * 音频等其他流固定1个线程. 用户显式指定的线程数保持不变, 但计入预算.
+ */
+static void allocate_thread_budget(void)
+{
+    ThreadShare *shares;
+    int nb_shares = 0, budget = threads_budget, spare, i, j;
+    double total = 0;
+
+    if (threads_budget <= 0)
+        return;
+
+    shares = av_malloc_array(nb_input_streams + nb_output_streams + nb_filtergraphs, sizeof(*shares));
+    if (!shares)
+        exit_program(1);
+
+    for (i = 0; i < nb_input_streams; i++)
+    {
+        InputStream *ist = input_streams[i];
+        AVCodecParameters *par = ist->st->codecpar;
+
+        if (!ist->decoding_needed || thread_budget_user_set(ist->decoder_opts, &budget))
+            continue;
+        if (par->codec_type != AVMEDIA_TYPE_VIDEO)
+        {
+            ist->nb_threads = 1;
+            budget--;
+            continue;
+        }
+        shares[nb_shares++] = (ThreadShare){&ist->nb_threads,
+                                            codec_thread_cost(ist->dec, 0) *
+                                                (par->width > 0 && par->height > 0 ? (int64_t)par->width * par->height : 1920 * 1080)};
+    }
+
+    for (i = 0; i < nb_output_streams; i++)
+    {
+        OutputStream *ost = output_streams[i];
+
+        if (!ost->encoding_needed || thread_budget_user_set(ost->encoder_opts, &budget))
+            continue;
+        if (ost->enc_ctx->codec_type != AVMEDIA_TYPE_VIDEO)
+        {
+            ost->nb_threads = 1;
+            budget--;
+            continue;
+        }
+        shares[nb_shares++] = (ThreadShare){&ost->nb_threads,
+                                            codec_thread_cost(ost->enc, 1) * ost_thread_pixels(ost)};
+    }
+
+    for (i = 0; i < nb_filtergraphs; i++)
+    {
+        FilterGraph *fg = filtergraphs[i];
+        int user_threads = filtergraph_is_simple(fg) ? filter_nbthreads : filter_complex_nbthreads;
+        int64_t pixels = 0;
+
+        if (user_threads)
+        {
+            budget -= FFMAX(user_threads, 1);
+            continue;
+        }
+        for (j = 0; j < fg->nb_outputs; j++)
+            if (fg->outputs[j]->ost && fg->outputs[j]->type == AVMEDIA_TYPE_VIDEO)
+                pixels += ost_thread_pixels(fg->outputs[j]->ost);
+        if (!pixels)
+        {
+            fg->nb_threads = 1;
+            budget--;
+            continue;
+        }
+        shares[nb_shares++] = (ThreadShare){&fg->nb_threads, 0.5 * pixels};
+    }
+
+    spare = budget - nb_shares;
+    if (spare < 0)
+    {
+        av_log(NULL, AV_LOG_WARNING, "Thread budget of %d is too small, "
+                                     "using 1 thread for each of the %d video codecs and filtergraphs\n",
+               threads_budget, nb_shares);
+        spare = 0;
+    }
+
+    for (i = 0; i < nb_shares; i++)
+        total += shares[i].weight;
+    for (i = 0; i < nb_shares; i++)
+    {
+        double exact = total > 0 ? spare * shares[i].weight / total : 0;
+        *shares[i].nb_threads = 1 + (int)exact;
+        shares[i].remainder = exact - (int)exact;
+        budget -= *shares[i].nb_threads;
+    }
+    // 余下的线程给小数部分最大的几份
+    while (budget > 0 && nb_shares > 0)
+    {
+        ThreadShare *best = &shares[0];
+        for (i = 1; i < nb_shares; i++)
+            if (shares[i].remainder > best->remainder)
+                best = &shares[i];
+        if (best->remainder <= 0)
+            break;
+        (*best->nb_threads)++;
+        best->remainder = 0;
+        budget--;
+    }
+
+    av_free(shares);
+}
+
 // 转码的初始化工作: 打开所有输入流/输出流的编码器, 打开所有输出文件, 写入媒体文件头.
 static int transcode_init(void)
 {
@@ -3781,6 +5858,9 @@ static int transcode_init(void)
     InputStream *ist;    // 输入流
     char error[1024] = {0};
 
+    allocate_thread_budget();
+    init_frame_caches();
+
     // 初始化filter
     for (i = 0; i < nb_filtergraphs; i++)
     {
@@ -3891,11 +5971,18 @@ dump_format:
                        ist->filters[j]->name);
                 if (nb_filtergraphs > 1)
                     av_log(NULL, AV_LOG_INFO, " (graph %d)", ist->filters[j]->graph->index);
+                if (ist->nb_threads)
+                    av_log(NULL, AV_LOG_INFO, " [threads: %d dec]", ist->nb_threads);
                 av_log(NULL, AV_LOG_INFO, "\n");
             }
         }
     }
 
+    for (i = 0; i < nb_filtergraphs; i++)
+        if (!filtergraph_is_simple(filtergraphs[i]) && filtergraphs[i]->nb_threads)
+            av_log(NULL, AV_LOG_INFO, "  Filtergraph %d [threads: %d filter]\n",
+                   i, filtergraphs[i]->nb_threads);
+
     for (i = 0; i < nb_output_streams; i++)
     {
         ost = output_streams[i];
@@ -3915,8 +6002,11 @@ dump_format:
             if (nb_filtergraphs > 1)
                 av_log(NULL, AV_LOG_INFO, " (graph %d)", ost->filter->graph->index);
 
-            av_log(NULL, AV_LOG_INFO, " -> Stream #%d:%d (%s)\n", ost->file_index,
+            av_log(NULL, AV_LOG_INFO, " -> Stream #%d:%d (%s)", ost->file_index,
                    ost->index, ost->enc ? ost->enc->name : "?");
+            if (ost->nb_threads)
+                av_log(NULL, AV_LOG_INFO, " [threads: %d enc]", ost->nb_threads);
+            av_log(NULL, AV_LOG_INFO, "\n");
             continue;
         }
 
@@ -3931,6 +6021,9 @@ dump_format:
                    ost->sync_ist->st->index);
         if (ost->stream_copy)
             av_log(NULL, AV_LOG_INFO, " (copy)");
+        else if (ost->enc_share)
+            av_log(NULL, AV_LOG_INFO, " (%s shared with #%d:%d)", ost->enc->name,
+                   ost->enc_share->file_index, ost->enc_share->index);
         else
         {
             const AVCodec *in_codec = input_streams[ost->source_index]->dec;
@@ -3964,6 +6057,12 @@ dump_format:
             av_log(NULL, AV_LOG_INFO, " (%s (%s) -> %s (%s))",
                    in_codec_name, decoder_name,
                    out_codec_name, encoder_name);
+
+            if (threads_budget > 0)
+                av_log(NULL, AV_LOG_INFO, " [threads: %d dec, %d filter, %d enc]",
+                       input_streams[ost->source_index]->nb_threads,
+                       ost->filter ? ost->filter->graph->nb_threads : 0,
+                       ost->nb_threads);
         }
         av_log(NULL, AV_LOG_INFO, "\n");
     }
@@ -3979,34 +6078,153 @@ dump_format:
     return 0;
 }
 
-/* Return 1 if there remain streams where more output is wanted, 0 otherwise. */
-static int need_output(void)
+/* Return 1 if there remain streams where more output is wanted, 0 otherwise. */
+static int need_output(void)
+{
+    int i;
+
+    for (i = 0; i < nb_output_streams; i++)
+    {
+        OutputStream *ost = output_streams[i];
+        OutputFile *of = output_files[ost->file_index];
+        int frame_number;
+
+        if (atomic_load(&ost->finished) || ost->enc_share)
+            continue;
+        if (output_file_size(of) >= of->limit_filesize)
+            continue;
+        lock_output_file(of);
+        frame_number = ost->frame_number;
+        unlock_output_file(of);
+        if (frame_number >= ost->max_frames)
+        {
+            int j;
+            for (j = 0; j < of->ctx->nb_streams; j++)
+                close_output_stream(output_streams[of->ost_index + j]);
+            continue;
+        }
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * 输出流调度: 按 sched_compare() 排序的二叉最小堆.
+ * 堆中缓存每个流的键值, 由于键值只会增大 (cur_dts 单调递增, initialized/
+ * inputs_done/finished 只会被置位), 只需在取堆顶时检查并修正过期的键值,
+ * 不必在编码线程写包时更新堆.
+ */
+static OutputStream **sched_heap;
+static int nb_sched_heap;
+
+// 记录被置位的流和文件, 使 got_eagain()/reset_eagain() 不必遍历所有的流和文件
+static OutputStream **unavailable_streams;
+static int nb_unavailable_streams;
+static InputFile **eagain_files;
+static int nb_eagain_files;
+
+enum
+{
+    SCHED_UNINITIALIZED = 0, /* not initialized yet and inputs not done, picked first in index order */
+    SCHED_ACTIVE,            /* ordered by the dts of the last packet written */
+    SCHED_FINISHED,          /* never picked */
+};
+
+static void sched_get_key(OutputStream *ost, int *class, int64_t *opts)
+{
+    OutputFile *of = output_files[ost->file_index];
+    int64_t cur_dts;
+
+    *opts = 0;
+    // 共享编码器的流由编码的流带动, 自己不需要处理
+    if (ost->enc_share)
+        *class = SCHED_FINISHED;
+    else if (!ost->initialized && !ost->inputs_done)
+        *class = SCHED_UNINITIALIZED;
+    else if (atomic_load(&ost->finished))
+        *class = SCHED_FINISHED;
+    else
+    {
+        *class = SCHED_ACTIVE;
+        // 有复用线程时 cur_dts 由它在 mux_lock 内更新
+        lock_muxer(of);
+        cur_dts = ost->st->cur_dts;
+        unlock_muxer(of);
+        // 转换成微妙
+        *opts = cur_dts == AV_NOPTS_VALUE ? INT64_MIN : av_rescale_q(cur_dts, ost->st->time_base, AV_TIME_BASE_Q);
+    }
+}
+
+static int sched_compare(const OutputStream *a, const OutputStream *b)
+{
+    if (a->sched_class != b->sched_class)
+        return a->sched_class < b->sched_class ? -1 : 1;
+    if (a->sched_opts != b->sched_opts)
+        return a->sched_opts < b->sched_opts ? -1 : 1;
+    // 与原来的线性扫描一致, 相同时取 output_streams 中靠前的流
+    return FFDIFFSIGN(output_files[a->file_index]->ost_index + a->index,
+                      output_files[b->file_index]->ost_index + b->index);
+}
+
+static void sched_swap(int i, int j)
+{
+    OutputStream *tmp = sched_heap[i];
+    sched_heap[i] = sched_heap[j];
+    sched_heap[j] = tmp;
+    sched_heap[i]->sched_index = i;
+    sched_heap[j]->sched_index = j;
+}
+
+static void sched_sift_down(int i)
+{
+    while (1)
+    {
+        int min = i, child = 2 * i + 1;
+        if (child < nb_sched_heap && sched_compare(sched_heap[child], sched_heap[min]) < 0)
+            min = child;
+        if (child + 1 < nb_sched_heap && sched_compare(sched_heap[child + 1], sched_heap[min]) < 0)
+            min = child + 1;
+        if (min == i)
+            break;
+        sched_swap(i, min);
+        i = min;
+    }
+}
+
+static int init_output_scheduler(void)
 {
     int i;
 
+    sched_heap = av_malloc_array(nb_output_streams, sizeof(*sched_heap));
+    unavailable_streams = av_malloc_array(nb_output_streams, sizeof(*unavailable_streams));
+    eagain_files = av_malloc_array(nb_input_files, sizeof(*eagain_files));
+    if (!sched_heap || !unavailable_streams || (nb_input_files && !eagain_files))
+        return AVERROR(ENOMEM);
+
     for (i = 0; i < nb_output_streams; i++)
     {
         OutputStream *ost = output_streams[i];
-        OutputFile *of = output_files[ost->file_index];
-        AVFormatContext *os = output_files[ost->file_index]->ctx;
-
-        if (ost->finished ||
-            (os->pb && avio_tell(os->pb) >= of->limit_filesize))
-            continue;
-        if (ost->frame_number >= ost->max_frames)
-        {
-            int j;
-            for (j = 0; j < of->ctx->nb_streams; j++)
-                close_output_stream(output_streams[of->ost_index + j]);
-            continue;
-        }
-
-        return 1;
+        sched_get_key(ost, &ost->sched_class, &ost->sched_opts);
+        ost->sched_index = i;
+        sched_heap[i] = ost;
     }
+    nb_sched_heap = nb_output_streams;
+    for (i = nb_sched_heap / 2 - 1; i >= 0; i--)
+        sched_sift_down(i);
 
     return 0;
 }
 
+static void free_output_scheduler(void)
+{
+    av_freep(&sched_heap);
+    av_freep(&unavailable_streams);
+    av_freep(&eagain_files);
+    nb_sched_heap = nb_unavailable_streams = nb_eagain_files = 0;
+}
+
 /**
  * Select the output stream to process. 选择时间戳小的输出流
  * 为什么要选择最小的呢？是为了输出流能够统一进度？
@@ -4015,30 +6233,36 @@ static int need_output(void)
  */
 static OutputStream *choose_output(void)
 {
-    int i;
-    int64_t opts_min = INT64_MAX;
-    OutputStream *ost_min = NULL;
+    OutputStream *ost;
 
-    for (i = 0; i < nb_output_streams; i++)
-    {
-        OutputStream *ost = output_streams[i];
-        // 转换成微妙
-        int64_t opts = ost->st->cur_dts == AV_NOPTS_VALUE ? INT64_MIN : av_rescale_q(ost->st->cur_dts, ost->st->time_base, AV_TIME_BASE_Q);
-        if (ost->st->cur_dts == AV_NOPTS_VALUE)
-            av_log(NULL, AV_LOG_DEBUG,
-                   "cur_dts is invalid st:%d (%d) [init:%d i_done:%d finish:%d] (this is harmless if it occurs once at the start per stream)\n",
-                   ost->st->index, ost->st->id, ost->initialized, ost->inputs_done, ost->finished);
+    if (!nb_sched_heap)
+        return NULL;
 
-        if (!ost->initialized && !ost->inputs_done) // 如果没有初始化则直接返回该流
-            return ost;
+    // 修正堆顶过期的键值, 直到堆顶的键值是最新的
+    while (1)
+    {
+        int class;
+        int64_t opts;
 
-        if (!ost->finished && opts < opts_min)
-        { // stream没有结束且小于最小的opts_min
-            opts_min = opts;
-            ost_min = ost->unavailable ? NULL : ost;
-        }
+        ost = sched_heap[0];
+        sched_get_key(ost, &class, &opts);
+        if (class == ost->sched_class && opts == ost->sched_opts)
+            break;
+        ost->sched_class = class;
+        ost->sched_opts = opts;
+        sched_sift_down(0);
     }
-    return ost_min;
+
+    if (ost->sched_class == SCHED_ACTIVE && ost->sched_opts == INT64_MIN)
+        av_log(NULL, AV_LOG_DEBUG,
+               "cur_dts is invalid st:%d (%d) [init:%d i_done:%d finish:%d] (this is harmless if it occurs once at the start per stream)\n",
+               ost->st->index, ost->st->id, ost->initialized, ost->inputs_done, atomic_load(&ost->finished));
+
+    if (ost->sched_class == SCHED_UNINITIALIZED) // 如果没有初始化则直接返回该流
+        return ost;
+    if (ost->sched_class == SCHED_FINISHED)
+        return NULL;
+    return ost->unavailable ? NULL : ost;
 }
 
 static void set_tty_echo(int on)
@@ -4116,6 +6340,7 @@ static int check_keyboard_interaction(int64_t cur_time)
                 FilterGraph *fg = filtergraphs[i];
                 if (fg->graph)
                 {
+                    lock_filtergraph(fg);
                     if (time < 0)
                     {
                         ret = avfilter_graph_send_command(fg->graph, target, command, arg, buf, sizeof(buf),
@@ -4133,6 +6358,7 @@ static int check_keyboard_interaction(int64_t cur_time)
                         if (ret < 0)
                             fprintf(stderr, "Queuing command failed with error %s\n", av_err2str(ret));
                     }
+                    unlock_filtergraph(fg);
                 }
             }
         }
@@ -4204,11 +6430,99 @@ static int check_keyboard_interaction(int64_t cur_time)
 }
 
 #if HAVE_THREADS
+static void signal_input_wakeup(void)
+{
+    pthread_mutex_lock(&input_wakeup_lock);
+    input_wakeup_seq++;
+    pthread_cond_broadcast(&input_wakeup_cond);
+    pthread_mutex_unlock(&input_wakeup_lock);
+}
+
+/* halve an adaptive queue limit which stayed mostly unused
+ * for a while, called with queue_lock held */
+static void thread_queue_shrink(InputFile *f, int depth)
+{
+    f->window_max = FFMAX(f->window_max, depth);
+    if (++f->window_len < 4 * f->thread_queue_size)
+        return;
+
+    if (f->thread_queue_adaptive && f->thread_queue_size > f->thread_queue_min &&
+        f->window_max < f->thread_queue_size / 4)
+    {
+        f->thread_queue_size = FFMAX(f->thread_queue_size / 2, f->thread_queue_min);
+        av_log(f->ctx, AV_LOG_VERBOSE, "Thread queue shrunk to %d packets\n",
+               f->thread_queue_size);
+    }
+    f->window_max = 0;
+    f->window_len = 0;
+}
+
+/**
+ * 读线程送出一个包之前调用, 等待队列有空位.
+ * 队列满时, 自适应的队列先在 thread_queue_max_bytes 以内加倍, 否则阻塞.
+ * 设置了 -readahead_size 时还要等待字节预算, 队列为空时总是放行.
+ */
+static void thread_queue_acquire(InputFile *f, int size)
+{
+    int blocked = 0;
+
+    pthread_mutex_lock(&f->queue_lock);
+
+    f->depth_min = f->nb_depth_samples ? FFMIN(f->depth_min, f->nb_queued) : f->nb_queued;
+    f->depth_max = FFMAX(f->depth_max, f->nb_queued);
+    f->depth_sum += f->nb_queued;
+    f->nb_depth_samples++;
+    thread_queue_shrink(f, f->nb_queued);
+
+    while (f->nb_queued >= f->thread_queue_size ||
+           (f->readahead_size && f->queued_bytes > 0 &&
+            f->queued_bytes + size > f->readahead_size))
+    {
+        if (f->nb_queued >= f->thread_queue_size && f->thread_queue_adaptive &&
+            f->thread_queue_size < f->thread_queue_alloc &&
+            f->queued_bytes < f->thread_queue_max_bytes)
+        {
+            f->thread_queue_size = FFMIN(2 * f->thread_queue_size, f->thread_queue_alloc);
+            f->window_max = 0;
+            f->window_len = 0;
+            av_log(f->ctx, AV_LOG_VERBOSE, "Thread queue grown to %d packets\n",
+                   f->thread_queue_size);
+            continue;
+        }
+        if (!blocked)
+        {
+            blocked = 1;
+            f->blocked_sends++;
+            // 实时输入阻塞可能会丢包
+            if (f->non_blocking && f->blocked_sends == 1)
+                av_log(f->ctx, AV_LOG_WARNING,
+                       "Thread message queue blocking; consider raising the "
+                       "thread_queue_size option (current value: %d) or "
+                       "thread_queue_max_bytes\n",
+                       f->thread_queue_size);
+        }
+        pthread_cond_wait(&f->queue_cond, &f->queue_lock);
+    }
+    f->nb_queued++;
+    f->queued_bytes += size;
+
+    pthread_mutex_unlock(&f->queue_lock);
+}
+
+static void thread_queue_release(InputFile *f, int size)
+{
+    pthread_mutex_lock(&f->queue_lock);
+    f->nb_queued--;
+    f->queued_bytes -= size;
+    pthread_cond_signal(&f->queue_cond);
+    pthread_mutex_unlock(&f->queue_lock);
+}
+
 static void *input_thread(void *arg)
 {
     InputFile *f = arg;
-    unsigned flags = f->non_blocking ? AV_THREAD_MESSAGE_NONBLOCK : 0;
     int ret = 0;
+    int64_t eagain_wait = 1000;
 
     while (1)
     {
@@ -4217,34 +6531,35 @@ static void *input_thread(void *arg)
 
         if (ret == AVERROR(EAGAIN))
         {
-            av_usleep(10000);
+            /* the demuxer was opened in blocking mode, so this is only hit by
+             * demuxers that poll internally; back off up to 10 ms */
+            av_usleep(eagain_wait);
+            eagain_wait = FFMIN(2 * eagain_wait, 10000);
             continue;
         }
+        eagain_wait = 1000;
         if (ret < 0)
         {
             av_thread_message_queue_set_err_recv(f->in_thread_queue, ret);
+            signal_input_wakeup();
             break;
         }
-        ret = av_thread_message_queue_send(f->in_thread_queue, &pkt, flags);
-        if (flags && ret == AVERROR(EAGAIN))
-        {
-            flags = 0;
-            ret = av_thread_message_queue_send(f->in_thread_queue, &pkt, flags);
-            av_log(f->ctx, AV_LOG_WARNING,
-                   "Thread message queue blocking; consider raising the "
-                   "thread_queue_size option (current value: %d)\n",
-                   f->thread_queue_size);
-        }
+        // thread_queue_acquire() 保证队列有空位, 这里不会阻塞
+        thread_queue_acquire(f, pkt.size);
+        ret = av_thread_message_queue_send(f->in_thread_queue, &pkt, 0);
         if (ret < 0)
         {
             if (ret != AVERROR_EOF)
                 av_log(f->ctx, AV_LOG_ERROR,
                        "Unable to send packet to main thread: %s\n",
                        av_err2str(ret));
+            thread_queue_release(f, pkt.size);
             av_packet_unref(&pkt);
             av_thread_message_queue_set_err_recv(f->in_thread_queue, ret);
+            signal_input_wakeup();
             break;
         }
+        signal_input_wakeup();
     }
 
     return NULL;
@@ -4259,17 +6574,23 @@ static void free_input_thread(int i)
         return;
     av_thread_message_queue_set_err_send(f->in_thread_queue, AVERROR_EOF);
     while (av_thread_message_queue_recv(f->in_thread_queue, &pkt, 0) >= 0)
+    {
+        thread_queue_release(f, pkt.size);
         av_packet_unref(&pkt);
+    }
 
     pthread_join(f->thread, NULL);
     f->joined = 1;
     av_thread_message_queue_free(&f->in_thread_queue);
+    pthread_mutex_destroy(&f->queue_lock);
+    pthread_cond_destroy(&f->queue_cond);
 }
 
 static void free_input_threads(void)
 {
     int i;
 
+    atomic_store(&input_threads_abort, 1);
     for (i = 0; i < nb_input_files; i++)
         free_input_thread(i);
 }
@@ -4279,20 +6600,31 @@ static int init_input_thread(int i)
     int ret;
     InputFile *f = input_files[i];
 
-    if (nb_input_files == 1)
+    // 单个输入文件时只有指定了 -readahead_size 才使用读线程
+    if (nb_input_files == 1 && !pipeline_mode && !f->readahead_size)
+        return 0;
+    // -keyframe_step 在主线程中seek, 不能同时在读线程中读
+    if (f->keyframe_step)
         return 0;
 
     if (f->ctx->pb ? !f->ctx->pb->seekable : strcmp(f->ctx->iformat->name, "lavfi"))
         f->non_blocking = 1;
     ret = av_thread_message_queue_alloc(&f->in_thread_queue,
-                                        f->thread_queue_size, sizeof(AVPacket));
+                                        f->thread_queue_alloc, sizeof(AVPacket));
     if (ret < 0)
         return ret;
 
+    f->nb_queued = 0;
+    f->queued_bytes = 0;
+    pthread_mutex_init(&f->queue_lock, NULL);
+    pthread_cond_init(&f->queue_cond, NULL);
+
     if ((ret = pthread_create(&f->thread, NULL, input_thread, f)))
     {
         av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
         av_thread_message_queue_free(&f->in_thread_queue);
+        pthread_mutex_destroy(&f->queue_lock);
+        pthread_cond_destroy(&f->queue_cond);
         return AVERROR(ret);
     }
 
@@ -4303,6 +6635,8 @@ static int init_input_threads(void)
 {
     int i, ret;
 
+    atomic_store(&input_threads_abort, 0);
+
     for (i = 0; i < nb_input_files; i++)
     {
         ret = init_input_thread(i);
@@ -4315,13 +6649,64 @@ static int init_input_threads(void)
 // 多个输入文件时, 多线程读取
 static int get_input_packet_mt(InputFile *f, AVPacket *pkt)
 {
-    return av_thread_message_queue_recv(f->in_thread_queue, pkt,
-                                        f->non_blocking ? AV_THREAD_MESSAGE_NONBLOCK : 0);
+    int ret = av_thread_message_queue_recv(f->in_thread_queue, pkt,
+                                           f->non_blocking ? AV_THREAD_MESSAGE_NONBLOCK : 0);
+    if (ret >= 0)
+        thread_queue_release(f, pkt->size);
+    return ret;
 }
 #endif
 
+static void free_loop_cache(InputFile *f)
+{
+    AVPacket pkt;
+
+    if (!f->loop_cache)
+        return;
+    while (av_fifo_size(f->loop_cache))
+    {
+        av_fifo_generic_read(f->loop_cache, &pkt, sizeof(pkt), NULL);
+        av_packet_unref(&pkt);
+    }
+    av_fifo_freep(&f->loop_cache);
+    f->loop_cache_bytes = 0;
+}
+
+// 第一遍读取时缓存一个包的引用, 超过 -loop_cache_size 则放弃缓存
+static void loop_cache_add(InputFile *f, AVPacket *pkt)
+{
+    AVPacket ref;
+
+    if (f->loop_cache_bytes + pkt->size > f->loop_cache_size ||
+        (!av_fifo_space(f->loop_cache) &&
+         av_fifo_realloc2(f->loop_cache, 2 * av_fifo_size(f->loop_cache)) < 0) ||
+        av_packet_ref(&ref, pkt) < 0)
+    {
+        av_log(f->ctx, AV_LOG_VERBOSE, "Input does not fit into -loop_cache_size, "
+                                       "looping by seeking instead\n");
+        free_loop_cache(f);
+        f->loop_cache_state = LOOP_CACHE_OFF;
+        return;
+    }
+    av_fifo_generic_write(f->loop_cache, &ref, sizeof(ref), NULL);
+    f->loop_cache_bytes += pkt->size;
+}
+
+static int loop_cache_read(InputFile *f, AVPacket *pkt)
+{
+    AVPacket cached;
+
+    if (f->loop_cache_pos >= av_fifo_size(f->loop_cache))
+        return AVERROR_EOF;
+    av_fifo_generic_peek_at(f->loop_cache, &cached, f->loop_cache_pos, sizeof(cached), NULL);
+    f->loop_cache_pos += sizeof(cached);
+    return av_packet_ref(pkt, &cached);
+}
+
 static int get_input_packet(InputFile *f, AVPacket *pkt)
 {
+    int ret;
+
     if (f->rate_emu)
     {
         int i;
@@ -4335,29 +6720,88 @@ static int get_input_packet(InputFile *f, AVPacket *pkt)
         }
     }
 
+    // 循环时从内存回放, 不再读文件
+    if (f->loop_cache_state == LOOP_CACHE_REPLAY)
+        return loop_cache_read(f, pkt);
+
 #if HAVE_THREADS
-    if (nb_input_files > 1) // 多个输入文件时, 多线程读取.
-        return get_input_packet_mt(f, pkt);
+    if (f->in_thread_queue) // 多个输入文件或 pipeline 模式时, 多线程读取.
+        ret = get_input_packet_mt(f, pkt);
+    else
 #endif
-    return av_read_frame(f->ctx, pkt);
+        ret = av_read_frame(f->ctx, pkt);
+
+    if (ret >= 0 && f->loop_cache_state == LOOP_CACHE_FILLING)
+        loop_cache_add(f, pkt);
+    return ret;
+}
+
+static void set_ost_unavailable(OutputStream *ost)
+{
+    if (ost->unavailable)
+        return;
+    ost->unavailable = 1;
+    unavailable_streams[nb_unavailable_streams++] = ost;
+}
+
+static void set_input_eagain(InputFile *ifile)
+{
+    if (ifile->eagain)
+        return;
+    ifile->eagain = 1;
+    eagain_files[nb_eagain_files++] = ifile;
 }
 
 static int got_eagain(void)
 {
-    int i;
-    for (i = 0; i < nb_output_streams; i++)
-        if (output_streams[i]->unavailable)
-            return 1;
-    return 0;
+    return nb_unavailable_streams > 0;
 }
 
 static void reset_eagain(void)
 {
     int i;
-    for (i = 0; i < nb_input_files; i++)
-        input_files[i]->eagain = 0;
-    for (i = 0; i < nb_output_streams; i++)
-        output_streams[i]->unavailable = 0;
+#if HAVE_THREADS
+    pthread_mutex_lock(&input_wakeup_lock);
+    eagain_wakeup_seq = input_wakeup_seq;
+    pthread_mutex_unlock(&input_wakeup_lock);
+#endif
+    for (i = 0; i < nb_eagain_files; i++)
+        eagain_files[i]->eagain = 0;
+    for (i = 0; i < nb_unavailable_streams; i++)
+        unavailable_streams[i]->unavailable = 0;
+    nb_eagain_files = 0;
+    nb_unavailable_streams = 0;
+}
+
+/**
+ * 所有可用的输入都返回了EAGAIN, 等待新的数据.
+ * 如果这些输入都由demuxer线程读取, 则阻塞到某个线程送来新的packet为止,
+ * 否则(主线程直接读取或者 -re)仍然休眠10ms.
+ */
+static void wait_for_input(void)
+{
+#if HAVE_THREADS
+    int i, can_block = nb_eagain_files > 0;
+
+    for (i = 0; i < nb_eagain_files; i++)
+        if (!eagain_files[i]->in_thread_queue || eagain_files[i]->rate_emu)
+            can_block = 0;
+
+    if (can_block)
+    {
+        /* wake up regularly anyway to handle the keyboard and signals */
+        int64_t deadline = av_gettime() + 100000;
+        struct timespec ts = {deadline / 1000000, (deadline % 1000000) * 1000};
+
+        pthread_mutex_lock(&input_wakeup_lock);
+        while (input_wakeup_seq == eagain_wakeup_seq && !received_sigterm)
+            if (pthread_cond_timedwait(&input_wakeup_cond, &input_wakeup_lock, &ts))
+                break;
+        pthread_mutex_unlock(&input_wakeup_lock);
+        return;
+    }
+#endif
+    av_usleep(10000);
 }
 
 // set duration to max(tmp, duration) in a proper time base and return duration's time_base
@@ -4382,17 +6826,111 @@ static AVRational duration_max(int64_t tmp, int64_t *duration, AVRational tmp_ti
     return time_base;
 }
 
+/**
+ * 回放 -frame_cache_size 缓存中的下一帧, 时间戳加上之前各遍的总时长.
+ * 返回值: 0成功, 一遍回放完时返回 AVERROR_EOF.
+ */
+static int frame_cache_replay(InputFile *ifile)
+{
+    FrameCacheEntry entry;
+    InputStream *ist;
+    AVFrame *frame;
+    int ret;
+
+    if (ifile->frame_cache_pos >= av_fifo_size(ifile->frame_cache))
+        return AVERROR_EOF;
+    av_fifo_generic_peek_at(ifile->frame_cache, &entry, ifile->frame_cache_pos, sizeof(entry), NULL);
+    ifile->frame_cache_pos += sizeof(entry);
+
+    ist = entry.ist;
+    if (!ist->decoded_frame && !(ist->decoded_frame = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    if (!ist->filter_frame && !(ist->filter_frame = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    frame = ist->decoded_frame;
+    if ((ret = av_frame_ref(frame, entry.frame)) < 0)
+        return ret;
+
+    if (frame->pts != AV_NOPTS_VALUE)
+    {
+        int64_t pts;
+
+        frame->pts += av_rescale_q(ifile->duration, ifile->time_base, entry.time_base);
+        // 与按包循环时一样更新, seek_to_start() 用它们计算下一遍的偏移
+        pts = av_rescale_q(frame->pts, entry.time_base, ist->st->time_base);
+        ist->max_pts = FFMAX(pts, ist->max_pts);
+        ist->min_pts = FFMIN(pts, ist->min_pts);
+        ist->pts = ist->next_pts = av_rescale_q(frame->pts, entry.time_base, AV_TIME_BASE_Q);
+    }
+
+    ret = send_frame_to_filters(ist, frame);
+    av_frame_unref(ist->filter_frame);
+    av_frame_unref(frame);
+    return ret;
+}
+
+/**
+ * 输出流都建立后, 确定哪些输入可以缓存解码后的帧:
+ * 该输入的流都只经过 filter, 没有 stream copy 和字幕输出.
+ * 送入 filter 的字幕流由 sub2video 转成帧, 不经过帧缓存, 回放时会缺失, 也不能缓存.
+ */
+static void init_frame_caches(void)
+{
+    int i, j;
+
+    for (i = 0; i < nb_input_files; i++)
+    {
+        InputFile *f = input_files[i];
+        int usable = 1;
+
+        if (!f->frame_cache_size)
+            continue;
+        for (j = 0; j < f->nb_streams; j++)
+        {
+            InputStream *ist = input_streams[f->ist_index + j];
+            if ((ist->decoding_needed & DECODING_FOR_OST) ||
+                (ist->decoding_needed && ist->st->codecpar->codec_type == AVMEDIA_TYPE_SUBTITLE))
+                usable = 0;
+        }
+        for (j = 0; j < nb_output_streams; j++)
+        {
+            OutputStream *ost = output_streams[j];
+            if (ost->stream_copy && ost->source_index >= f->ist_index &&
+                ost->source_index < f->ist_index + f->nb_streams)
+                usable = 0;
+        }
+        if (!usable)
+        {
+            av_log(f->ctx, AV_LOG_WARNING, "-frame_cache_size needs all the streams of the "
+                                           "input to be filtered and no subtitles, ignoring it\n");
+            continue;
+        }
+
+        f->frame_cache = av_fifo_alloc(64 * sizeof(FrameCacheEntry));
+        if (!f->frame_cache)
+            exit_program(1);
+        f->frame_cache_state = LOOP_CACHE_FILLING;
+        // 帧缓存取代包缓存
+        free_loop_cache(f);
+        f->loop_cache_state = LOOP_CACHE_OFF;
+    }
+}
+
+// is 为NULL时不seek, 下一遍从 -loop_cache_size 的缓存中回放
 static int seek_to_start(InputFile *ifile, AVFormatContext *is)
 {
     InputStream *ist;
     AVCodecContext *avctx;
-    int i, ret, has_audio = 0;
+    int i, ret = 0, has_audio = 0;
     int64_t duration = 0;
 
-    ret = av_seek_frame(is, -1, is->start_time, 0);
-    if (ret < 0)
+    if (is)
     {
-        return ret;
+        ret = av_seek_frame(is, -1, is->start_time, 0);
+        if (ret < 0)
+        {
+            return ret;
+        }
     }
 
     for (i = 0; i < ifile->nb_streams; i++)
@@ -4455,6 +6993,52 @@ static int seek_to_start(InputFile *ifile, AVFormatContext *is)
     return ret;
 }
 
+/**
+ * -keyframe_step: 关键帧是否是下一个目标时刻附近的那个.
+ * 目标时刻是 keyframe_step 的整数倍, 接受距离目标半个间隔以内或更晚的关键帧.
+ */
+static int keyframe_step_accept(InputFile *ifile, InputStream *ist, AVPacket *pkt)
+{
+    int64_t t = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+
+    if (t == AV_NOPTS_VALUE)
+        return 0;
+    t = av_rescale_q(t, ist->st->time_base, AV_TIME_BASE_Q);
+    if (ifile->keyframe_next != AV_NOPTS_VALUE &&
+        t < ifile->keyframe_next - ifile->keyframe_step / 2)
+        return 0;
+
+    // 这一帧对应最近的目标时刻, 下一个目标是它后面的那个
+    ifile->keyframe_next = (FFMAX(t + ifile->keyframe_step / 2, 0) / ifile->keyframe_step + 1) *
+                           ifile->keyframe_step;
+    return 1;
+}
+
+// -keyframe_step: 解码了一个关键帧后, seek到下一个目标时刻附近的关键帧
+static void keyframe_step_seek(InputFile *ifile, InputStream *ist, AVPacket *pkt)
+{
+    AVFormatContext *is = ifile->ctx;
+    // process_input() 给时间戳加上的偏移, seek时要去掉
+    int64_t offset = ifile->ts_offset + av_rescale_q(ifile->duration, ifile->time_base, AV_TIME_BASE_Q);
+    int64_t cur = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    int ret, i;
+
+    cur = av_rescale_q(cur, ist->st->time_base, AV_TIME_BASE_Q) - offset;
+    ret = avformat_seek_file(is, -1, cur + 1, ifile->keyframe_next - offset, INT64_MAX, 0);
+    if (ret < 0)
+    {
+        // 可能已经到了文件尾, 继续顺序读
+        av_log(is, AV_LOG_DEBUG, "-keyframe_step: seek to %s failed: %s\n",
+               av_ts2timestr(ifile->keyframe_next, &AV_TIME_BASE_Q), av_err2str(ret));
+        return;
+    }
+
+    // seek造成的时间戳跳变不是不连续, 不能让 process_input() 去修正 ts_offset
+    ifile->last_ts = AV_NOPTS_VALUE;
+    for (i = 0; i < ifile->nb_streams; i++)
+        input_streams[ifile->ist_index + i]->next_dts = AV_NOPTS_VALUE;
+}
+
 /*
  * Return 获取得到的包
  * - 0 -- one packet was read and processed
@@ -4475,11 +7059,31 @@ static int process_input(int file_index)
     int64_t pkt_dts;
 
     is = ifile->ctx;
-    // 获取一帧压缩编码数据AVPacket, 内部调用av_read_frame()
-    ret = get_input_packet(ifile, &pkt);
+    if (ifile->frame_cache_state == LOOP_CACHE_REPLAY)
+    {
+        // 从 -frame_cache_size 的缓存中回放, 不读包也不解码
+        ret = frame_cache_replay(ifile);
+        if (ret != AVERROR_EOF)
+        {
+            if (ret >= 0)
+                reset_eagain();
+            return ret;
+        }
+        if (ifile->loop)
+        {
+            ifile->frame_cache_pos = 0;
+            return seek_to_start(ifile, NULL);
+        }
+        // 最后一遍也回放完了, 按读到文件尾处理
+    }
+    else
+    {
+        // 获取一帧压缩编码数据AVPacket, 内部调用av_read_frame()
+        ret = get_input_packet(ifile, &pkt);
+    }
     if (ret == AVERROR(EAGAIN))
     {
-        ifile->eagain = 1;
+        set_input_eagain(ifile);
         return ret;
     }
     if (ret < 0 && ifile->loop)
@@ -4498,22 +7102,48 @@ static int process_input(int file_index)
                 avcodec_flush_buffers(avctx);
             }
         }
+        // 第一遍完整地缓存下来了, 以后都从内存回放
+        if (ifile->frame_cache_state == LOOP_CACHE_FILLING)
+            ifile->frame_cache_state = LOOP_CACHE_REPLAY;
+        if (ifile->loop_cache_state == LOOP_CACHE_FILLING)
+            ifile->loop_cache_state = LOOP_CACHE_REPLAY;
+
+        if (ifile->frame_cache_state == LOOP_CACHE_REPLAY)
+        {
+#if HAVE_THREADS
+            free_input_thread(file_index);
+#endif
+            ifile->frame_cache_pos = 0;
+            return seek_to_start(ifile, NULL);
+        }
+        else if (ifile->loop_cache_state == LOOP_CACHE_REPLAY)
+        {
+#if HAVE_THREADS
+            // 读线程已经读到文件尾, 不再需要
+            free_input_thread(file_index);
+#endif
+            ifile->loop_cache_pos = 0;
+            ret = seek_to_start(ifile, NULL);
+        }
+        else
+        {
 #if HAVE_THREADS
-        free_input_thread(file_index);
+            free_input_thread(file_index);
 #endif
-        ret = seek_to_start(ifile, is);
+            ret = seek_to_start(ifile, is);
 #if HAVE_THREADS
-        thread_ret = init_input_thread(file_index);
-        if (thread_ret < 0)
-            return thread_ret;
+            thread_ret = init_input_thread(file_index);
+            if (thread_ret < 0)
+                return thread_ret;
 #endif
+        }
         if (ret < 0)
             av_log(NULL, AV_LOG_WARNING, "Seek to start failed.\n");
         else
             ret = get_input_packet(ifile, &pkt);
         if (ret == AVERROR(EAGAIN))
         {
-            ifile->eagain = 1;
+            set_input_eagain(ifile);
             return ret;
         }
     }
@@ -4576,6 +7206,10 @@ static int process_input(int file_index)
 
     if (ist->discard)
         goto discard_packet;
+    if (ifile->keyframe_step &&
+        (!ist->decoding_needed || ist->dec_ctx->codec_type != AVMEDIA_TYPE_VIDEO ||
+         !(pkt.flags & AV_PKT_FLAG_KEY)))
+        goto discard_packet;
 
     if (pkt.flags & AV_PKT_FLAG_CORRUPT)
     {
@@ -4770,6 +7404,15 @@ static int process_input(int file_index)
                av_ts2timestr(input_files[ist->file_index]->ts_offset, &AV_TIME_BASE_Q));
     }
 
+    if (ifile->keyframe_step)
+    {
+        if (!keyframe_step_accept(ifile, ist, &pkt))
+            goto discard_packet;
+        process_input_packet(ist, &pkt, 0);
+        keyframe_step_seek(ifile, ist, &pkt);
+        goto discard_packet;
+    }
+
     process_input_packet(ist, &pkt, 0); // 到这里pts dts实际上还是AVStream的time_base
 
 discard_packet:
@@ -4795,7 +7438,9 @@ static int transcode_from_filter(FilterGraph *graph, InputStream **best_ist)
     InputStream *ist;
 
     *best_ist = NULL;
+    lock_filtergraph(graph);
     ret = avfilter_graph_request_oldest(graph->graph);
+    unlock_filtergraph(graph);
     if (ret >= 0)
         return reap_filters(0);
 
@@ -4809,6 +7454,7 @@ static int transcode_from_filter(FilterGraph *graph, InputStream **best_ist)
     if (ret != AVERROR(EAGAIN))
         return ret;
 
+    lock_filtergraph(graph);
     for (i = 0; i < graph->nb_inputs; i++)
     {
         ifilter = graph->inputs[i];
@@ -4823,10 +7469,17 @@ static int transcode_from_filter(FilterGraph *graph, InputStream **best_ist)
             *best_ist = ist;
         }
     }
+    unlock_filtergraph(graph);
 
+#if HAVE_THREADS
+    /* the frames (or EOF) still queued for the graph thread may be what the
+     * graph is waiting for, let it catch up before giving up on the outputs */
+    if (!*best_ist && graph->in_queue && filtergraph_wait_idle(graph))
+        return reap_filters(0);
+#endif
     if (!*best_ist)
         for (i = 0; i < graph->nb_outputs; i++)
-            graph->outputs[i]->ost->unavailable = 1;
+            set_ost_unavailable(graph->outputs[i]->ost);
 
     return 0;
 }
@@ -4849,8 +7502,8 @@ static int transcode_step(void)
     {
         if (got_eagain())
         {
+            wait_for_input();
             reset_eagain();
-            av_usleep(10000);
             return 0;
         }
         av_log(NULL, AV_LOG_VERBOSE, "No more inputs to read from, finishing.\n");
@@ -4919,7 +7572,7 @@ static int transcode_step(void)
     if (ret == AVERROR(EAGAIN))
     {
         if (input_files[ist->file_index]->eagain)
-            ost->unavailable = 1;
+            set_ost_unavailable(ost);
         return 0;
     }
 
@@ -4949,6 +7602,12 @@ static int transcode(void)
         goto fail;
     }
 
+    ret = init_output_scheduler();
+    if (ret < 0)
+    {
+        goto fail;
+    }
+
     if (stdin_interaction)
     {
         av_log(NULL, AV_LOG_INFO, "Press [q] to stop, [?] for help\n");
@@ -4961,6 +7620,26 @@ static int transcode(void)
     {
         goto fail;
     }
+    if ((ret = init_encoder_threads()) < 0)
+    {
+        goto fail;
+    }
+    if ((ret = init_filtergraph_threads()) < 0)
+    {
+        goto fail;
+    }
+    if ((ret = init_decoder_threads()) < 0)
+    {
+        goto fail;
+    }
+    if ((ret = init_mux_threads()) < 0)
+    {
+        goto fail;
+    }
+    if ((ret = init_closer_thread()) < 0)
+    {
+        goto fail;
+    }
 #endif
 
     while (!received_sigterm)
@@ -5005,8 +7684,19 @@ static int transcode(void)
             process_input_packet(ist, NULL, 0); // 如果没有读取完毕
         }
     }
+#if HAVE_THREADS
+    // 解码器都已经刷新完了; 等待过滤图线程和编码线程处理完剩余的帧
+    free_decoder_threads();
+    free_filtergraph_threads(0);
+    free_encoder_threads(0);
+#endif
     // 输出编码器中剩余的帧
     flush_encoders();
+#if HAVE_THREADS
+    // 写文件尾之前, 复用线程要写完队列中的包
+    free_mux_threads(0);
+    free_closer_thread();
+#endif
 
     term_exit();
     // 为输出文件写文件尾(有的不需要)
@@ -5021,9 +7711,16 @@ static int transcode(void)
                    i, os->url);
             continue;
         }
-        if ((ret = av_write_trailer(os)) < 0)
+        if ((ret = av_write_trailer(output_files[i]->mux_ctx)) < 0)
+        {
+            av_log(NULL, AV_LOG_ERROR, "Error writing trailer of %s: %s\n", output_files[i]->mux_ctx->url, av_err2str(ret));
+            if (exit_on_error)
+                exit_program(1);
+        }
+        // write-behind 的块写完才算输出完成
+        else if (output_files[i]->aio_pb && (ret = async_io_flush(output_files[i]->aio_pb)) < 0)
         {
-            av_log(NULL, AV_LOG_ERROR, "Error writing trailer of %s: %s\n", os->url, av_err2str(ret));
+            av_log(NULL, AV_LOG_ERROR, "Error writing %s: %s\n", os->url, av_err2str(ret));
             if (exit_on_error)
                 exit_program(1);
         }
@@ -5064,11 +7761,19 @@ static int transcode(void)
     av_buffer_unref(&hw_device_ctx);
     hw_device_free_all();
 
+    // 编码或复用的致命错误: 输出已正常结束, 但转码失败
     ret = 0;
+    for (i = 0; i < nb_output_streams && !ret; i++)
+        ret = atomic_load(&output_streams[i]->enc_error);
     av_log(NULL, AV_LOG_INFO, "Finish\n");
 fail:
 #if HAVE_THREADS
     free_input_threads();
+    free_decoder_threads();
+    free_filtergraph_threads(1);
+    free_encoder_threads(1);
+    free_mux_threads(1);
+    free_closer_thread();
 #endif
 
     if (output_streams)
@@ -5148,6 +7853,674 @@ static void log_callback_null(void *ptr, int level, const char *fmt, va_list vl)
 {
 }
 
+#if HAVE_FORK_JOBS
+// -batch 任务文件中的一行命令
+typedef struct BatchJob
+{
+    int line;    /* line number in the job file */
+    char **args; /* arguments, without the program name */
+    int nb_args;
+    pid_t pid;
+    int64_t start_time;
+} BatchJob;
+
+/**
+ * 把任务文件的一行拆分成参数, 直接在 line 上修改.
+ * 支持单引号, 双引号和反斜杠转义, '#' 开头的行是注释.
+ */
+static int split_batch_line(char *line, BatchJob *job)
+{
+    char *src = line, *dst = line;
+
+    while (1)
+    {
+        char quote = 0;
+        char *arg;
+
+        while (*src == ' ' || *src == '\t' || *src == '\r')
+            src++;
+        if (!*src || (*src == '#' && !job->nb_args))
+            break;
+
+        arg = dst;
+        while (*src && (quote || (*src != ' ' && *src != '\t' && *src != '\r')))
+        {
+            if (quote && *src == quote)
+                quote = 0;
+            else if (!quote && (*src == '\'' || *src == '"'))
+                quote = *src;
+            else if (*src == '\\' && quote != '\'' && src[1])
+                *dst++ = *++src;
+            else
+                *dst++ = *src;
+            src++;
+        }
+        if (quote)
+            return AVERROR(EINVAL);
+        if (*src)
+            src++;
+        *dst++ = 0;
+
+        GROW_ARRAY(job->args, job->nb_args);
+        job->args[job->nb_args - 1] = arg;
+    }
+    return 0;
+}
+
+static int read_batch_file(const char *filename, char **buf, BatchJob **jobs, int *nb_jobs)
+{
+    AVIOContext *pb = NULL;
+    AVBPrint bp;
+    char *line, *next;
+    int ret, line_no = 0;
+
+    if ((ret = avio_open2(&pb, filename, AVIO_FLAG_READ, &int_cb, NULL)) < 0)
+    {
+        av_log(NULL, AV_LOG_FATAL, "Cannot open batch file %s: %s\n", filename, av_err2str(ret));
+        return ret;
+    }
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+    ret = avio_read_to_bprint(pb, &bp, SIZE_MAX);
+    avio_closep(&pb);
+    if (ret < 0 || (ret = av_bprint_finalize(&bp, buf)) < 0)
+    {
+        av_bprint_finalize(&bp, NULL);
+        return ret;
+    }
+
+    for (line = *buf; line; line = next)
+    {
+        BatchJob job = {++line_no};
+
+        if ((next = strchr(line, '\n')))
+            *next++ = 0;
+        if ((ret = split_batch_line(line, &job)) < 0)
+        {
+            av_log(NULL, AV_LOG_FATAL, "%s:%d: unterminated quote\n", filename, line_no);
+            return ret;
+        }
+        if (!job.nb_args)
+            continue;
+
+        GROW_ARRAY(*jobs, *nb_jobs);
+        (*jobs)[*nb_jobs - 1] = job;
+    }
+    return 0;
+}
+
+// 拼接两组参数, 返回以NULL结尾的新数组
+static char **join_args(char **a, int nb_a, char **b, int nb_b)
+{
+    char **args = av_malloc_array(nb_a + nb_b + 1, sizeof(*args));
+
+    if (!args)
+        exit_program(1);
+    memcpy(args, a, nb_a * sizeof(*args));
+    memcpy(args + nb_a, b, nb_b * sizeof(*args));
+    args[nb_a + nb_b] = NULL;
+    return args;
+}
+
+// 把 b 接到 a 之后, 释放 a
+static char **append_args(char **a, int *nb_a, char **b, int nb_b)
+{
+    char **args = join_args(a, *nb_a, b, nb_b);
+
+    av_free(a);
+    *nb_a += nb_b;
+    return args;
+}
+
+/**
+ * fork 一个子进程运行 job_argv 描述的转码, job_argv 由 join_args() 分配.
+ * 子进程中返回0, *argc 和 *argv 被替换为 job_argv, 由调用者返回到 main() 继续执行;
+ * 父进程中返回子进程的 pid, 失败返回 -1.
+ */
+static pid_t fork_job(int *argc, char ***argv, char **job_argv, int job_argc)
+{
+    pid_t pid;
+
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "fork failed: %s\n", strerror(errno));
+        av_free(job_argv);
+        return -1;
+    }
+    if (!pid)
+    {
+        // 多个任务不能同时读取标准输入
+        stdin_interaction = 0;
+        *argc = job_argc;
+        *argv = job_argv;
+        return 0;
+    }
+    av_free(job_argv);
+    return pid;
+}
+
+// 等待任意一个任务结束, 同时取得它的 CPU 时间 (用户态+内核态) 和峰值内存, 不支持时为0
+static pid_t wait_batch_job(int *status, int64_t *cpu_usec, int64_t *maxrss)
+{
+#if HAVE_SYS_RESOURCE_H
+    struct rusage ru;
+    pid_t pid = wait4(-1, status, 0, &ru);
+
+    *cpu_usec = *maxrss = 0;
+    if (pid > 0)
+    {
+        *cpu_usec = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL +
+                    ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#if HAVE_STRUCT_RUSAGE_RU_MAXRSS
+        *maxrss = (int64_t)ru.ru_maxrss * 1024;
+#endif
+    }
+    return pid;
+#else
+    *cpu_usec = *maxrss = 0;
+    return waitpid(-1, status, 0);
+#endif
+}
+
+// 不能再等待任意子进程时, 结束还在运行的任务并逐个回收, 返回结束的任务数
+static int kill_batch_jobs(BatchJob *jobs, int nb_jobs)
+{
+    int i, status, nb_killed = 0;
+
+    for (i = 0; i < nb_jobs; i++)
+        if (jobs[i].pid > 0)
+            kill(jobs[i].pid, SIGTERM);
+    for (i = 0; i < nb_jobs; i++)
+    {
+        if (jobs[i].pid <= 0)
+            continue;
+        while (waitpid(jobs[i].pid, &status, 0) < 0 && errno == EINTR)
+            ;
+        av_log(NULL, AV_LOG_ERROR, "Batch job %d (line %d) terminated\n", i, jobs[i].line);
+        jobs[i].pid = 0;
+        nb_killed++;
+    }
+    return nb_killed;
+}
+
+/**
+ * -batch 模式: 每行命令是一个独立的转码任务, 最多同时运行 -batch_jobs 个.
+ * 任务在 fork 出的子进程中运行, 子进程继承父进程已完成的初始化,
+ * 不需要重新加载程序, 一个任务出错也不影响其他任务.
+ * 在子进程中返回, *argc 和 *argv 被替换为该任务的命令行; 父进程不返回.
+ */
+static void run_batch(int *argc, char ***argv)
+{
+    int idx = locate_option(*argc, *argv, options, "batch");
+    int nb_workers = av_cpu_count();
+    char **common = NULL, *buf = NULL;
+    int nb_common = 0, nb_running = 0, nb_failed = 0, next_job = 0;
+    BatchJob *jobs = NULL;
+    int nb_jobs = 0, i;
+    const char *filename;
+    int64_t batch_start;
+
+    if (idx + 1 >= *argc)
+    {
+        av_log(NULL, AV_LOG_FATAL, "Missing argument for option 'batch'\n");
+        exit_program(1);
+    }
+    filename = (*argv)[idx + 1];
+    if ((idx = locate_option(*argc, *argv, options, "batch_jobs")) && idx + 1 < *argc)
+        nb_workers = parse_number_or_die("batch_jobs", (*argv)[idx + 1], OPT_INT, 1, INT_MAX);
+
+    // 除 -batch 和 -batch_jobs 以外的参数作为所有任务的公共参数
+    GROW_ARRAY(common, nb_common);
+    common[0] = (*argv)[0];
+    for (i = 1; i < *argc; i++)
+    {
+        const char *opt = (*argv)[i];
+        if (!strcmp(opt, "-batch") || !strcmp(opt, "-batch_jobs"))
+        {
+            i++;
+            continue;
+        }
+        GROW_ARRAY(common, nb_common);
+        common[nb_common - 1] = (*argv)[i];
+    }
+
+    if (read_batch_file(filename, &buf, &jobs, &nb_jobs) < 0)
+        exit_program(1);
+    av_log(NULL, AV_LOG_INFO, "Batch: %d jobs from %s, %d at a time\n",
+           nb_jobs, filename, nb_workers);
+
+    term_init();
+    batch_start = av_gettime_relative();
+
+    while (1)
+    {
+        int64_t cpu_usec, maxrss;
+        int status;
+        pid_t pid;
+
+        while (nb_running < nb_workers && next_job < nb_jobs && !received_nb_signals)
+        {
+            BatchJob *job = &jobs[next_job++];
+
+            job->start_time = av_gettime_relative();
+            pid = fork_job(argc, argv, join_args(common, nb_common, job->args, job->nb_args),
+                           nb_common + job->nb_args);
+            if (pid < 0)
+            {
+                nb_failed++;
+                continue;
+            }
+            if (!pid)
+                return;
+            job->pid = pid;
+            nb_running++;
+            av_log(NULL, AV_LOG_VERBOSE, "Batch job %d (line %d) started, pid %d\n",
+                   (int)(job - jobs), job->line, (int)pid);
+        }
+        if (!nb_running)
+            break;
+
+        pid = wait_batch_job(&status, &cpu_usec, &maxrss);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            av_log(NULL, AV_LOG_ERROR, "waitpid failed: %s\n", strerror(errno));
+            nb_failed += kill_batch_jobs(jobs, next_job);
+            break;
+        }
+        for (i = 0; i < next_job; i++)
+        {
+            BatchJob *job = &jobs[i];
+            int failed;
+
+            if (job->pid != pid)
+                continue;
+            failed = !WIFEXITED(status) || WEXITSTATUS(status);
+            nb_failed += failed;
+            nb_running--;
+            job->pid = 0;
+            if (WIFEXITED(status))
+                av_log(NULL, failed ? AV_LOG_ERROR : AV_LOG_INFO,
+                       "Batch job %d (line %d) exited with code %d after %0.3fs, "
+                       "cpu=%0.3fs maxrss=%"PRId64"kB\n",
+                       i, job->line, WEXITSTATUS(status),
+                       (av_gettime_relative() - job->start_time) / 1000000.0,
+                       cpu_usec / 1000000.0, maxrss / 1024);
+            else
+                av_log(NULL, AV_LOG_ERROR,
+                       "Batch job %d (line %d) killed by signal %d after %0.3fs, "
+                       "cpu=%0.3fs maxrss=%"PRId64"kB\n",
+                       i, job->line, WIFSIGNALED(status) ? WTERMSIG(status) : 0,
+                       (av_gettime_relative() - job->start_time) / 1000000.0,
+                       cpu_usec / 1000000.0, maxrss / 1024);
+            break;
+        }
+    }
+
+    av_log(NULL, AV_LOG_INFO, "Batch: %d of %d jobs succeeded in %0.3fs%s\n",
+           next_job - nb_failed, nb_jobs,
+           (av_gettime_relative() - batch_start) / 1000000.0,
+           next_job < nb_jobs ? " (interrupted)" : "");
+
+    for (i = 0; i < nb_jobs; i++)
+        av_freep(&jobs[i].args);
+    av_freep(&jobs);
+    av_freep(&common);
+    av_freep(&buf);
+    exit_program(nb_failed || next_job < nb_jobs);
+}
+
+// 从 ts 开始(含)的第一个关键帧的时间, AV_TIME_BASE 为单位
+static int64_t find_keyframe_from(AVFormatContext *ic, int stream, int64_t ts)
+{
+    AVStream *st = ic->streams[stream];
+    int64_t key_ts = AV_NOPTS_VALUE;
+    AVPacket pkt;
+
+    if (avformat_seek_file(ic, -1, INT64_MIN, ts, ts, 0) < 0)
+        return AV_NOPTS_VALUE;
+
+    while (av_read_frame(ic, &pkt) >= 0)
+    {
+        if (pkt.stream_index == stream && (pkt.flags & AV_PKT_FLAG_KEY) &&
+            pkt.pts != AV_NOPTS_VALUE &&
+            av_rescale_q(pkt.pts, st->time_base, AV_TIME_BASE_Q) >= ts)
+        {
+            key_ts = av_rescale_q(pkt.pts, st->time_base, AV_TIME_BASE_Q);
+            av_packet_unref(&pkt);
+            break;
+        }
+        av_packet_unref(&pkt);
+    }
+    return key_ts;
+}
+
+static char *format_seconds(int64_t us)
+{
+    char *str = av_asprintf("%" PRId64 ".%06d", us / 1000000, (int)(us % 1000000));
+    if (!str)
+        exit_program(1);
+    return str;
+}
+
+// 最终文件的复用器选项 (-f 和 AVFormatContext 及该复用器的私有选项), 传给拼接的子进程
+static int is_muxer_option(const char *opt, const AVOutputFormat *ofmt)
+{
+    const AVClass *fclass = avformat_get_class();
+
+    if (!strcmp(opt, "f"))
+        return 1;
+    return av_opt_find(&fclass, opt, NULL, AV_OPT_FLAG_ENCODING_PARAM, AV_OPT_SEARCH_FAKE_OBJ) ||
+           (ofmt && ofmt->priv_class &&
+            av_opt_find((void *)&ofmt->priv_class, opt, NULL, 0, AV_OPT_SEARCH_FAKE_OBJ));
+}
+
+static pid_t wait_jobs(int *status)
+{
+    pid_t pid;
+
+    while ((pid = waitpid(-1, status, 0)) < 0 && errno == EINTR)
+        ;
+    return pid;
+}
+
+/**
+ * -segment_parallel N: 把一个可 seek 的输入在关键帧处切成 N 段,
+ * 每段的视频在一个子进程中用 -ss/-t 单独转码成临时文件, 最后用 concat demuxer 无损拼接,
+ * concat demuxer 按每段的时长修正时间戳.
+ * 音频编码器在开头有前导, 结尾有补齐, 分段编码时每个接缝处都会有间隙或重复,
+ * 所以音频在另一个子进程中整段编码, 拼接时与视频合并.
+ * 与 run_batch() 一样, 在子进程中返回, 父进程不返回.
+ */
+static void run_segment_parallel(int *argc, char ***argv)
+{
+    static const char *const unsupported[] = {
+        "ss", "t", "to", "sseof", "stream_loop", "filter_complex", "lavfi", "batch"};
+    static const char *const passthrough[] = {"-y", "-n", "-hide_banner", "-nostats", "-loglevel", "-v"};
+    int idx = locate_option(*argc, *argv, options, "segment_parallel");
+    int input_idx = locate_option(*argc, *argv, options, "i");
+    int nb_segments = 0, nb_failed = 0, nb_args, ret, i, j;
+    const char *input, *output, *ext, *name, *format = NULL;
+    char **args, *list_name, *audio_name = NULL, *seg_ss = NULL, *seg_t = NULL;
+    char *parts[256];
+    int64_t starts[256], start;
+    pid_t pids[256 + 1], pid; /* the segments, then the audio */
+    AVFormatContext *ic = NULL;
+    AVIOContext *list = NULL;
+    const AVOutputFormat *ofmt;
+    int base_len, status, vst, has_audio = 0;
+
+    if (idx + 1 >= *argc)
+    {
+        av_log(NULL, AV_LOG_FATAL, "Missing argument for option 'segment_parallel'\n");
+        exit_program(1);
+    }
+    nb_segments = parse_number_or_die("segment_parallel", (*argv)[idx + 1], OPT_INT, 1, FF_ARRAY_ELEMS(parts));
+
+    for (i = 0; i < FF_ARRAY_ELEMS(unsupported); i++)
+        if (locate_option(*argc, *argv, options, unsupported[i]))
+        {
+            av_log(NULL, AV_LOG_FATAL, "-%s cannot be combined with -segment_parallel\n", unsupported[i]);
+            exit_program(1);
+        }
+    output = (*argv)[*argc - 1];
+    // 其他输出文件会被每个子进程同时写入
+    if (count_output_files(*argc, *argv) != 1 ||
+        !input_idx || input_idx + 1 >= *argc - 1 ||
+        locate_option(*argc - input_idx, *argv + input_idx, options, "i") ||
+        output[0] == '-' || strstr(output, "://") || !strncmp(output, "pipe:", 5))
+    {
+        av_log(NULL, AV_LOG_FATAL, "-segment_parallel needs exactly one input and "
+                                   "one output file given as the last argument\n");
+        exit_program(1);
+    }
+    input = (*argv)[input_idx + 1];
+
+    // 找到各段的起点
+    if ((ret = avformat_open_input(&ic, input, NULL, NULL)) < 0 ||
+        (ret = avformat_find_stream_info(ic, NULL)) < 0)
+    {
+        print_error(input, ret);
+        exit_program(1);
+    }
+    if (ic->duration <= 0 || !ic->pb || !(ic->pb->seekable & AVIO_SEEKABLE_NORMAL))
+    {
+        av_log(NULL, AV_LOG_FATAL, "-segment_parallel needs a seekable input with a known duration\n");
+        exit_program(1);
+    }
+    start = ic->start_time == AV_NOPTS_VALUE ? 0 : ic->start_time;
+    vst = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    for (i = 0; i < ic->nb_streams; i++)
+        has_audio |= ic->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO;
+    has_audio &= !locate_option(*argc, *argv, options, "an");
+    // 音频单独编码时 -map 选择的流要分给两个子进程, 不支持
+    if (has_audio && locate_option(*argc, *argv, options, "map"))
+    {
+        av_log(NULL, AV_LOG_FATAL, "-segment_parallel encodes the audio in a separate pass and "
+                                   "cannot be combined with -map, unless -an is given\n");
+        exit_program(1);
+    }
+    starts[0] = start;
+    for (i = 1, j = 1; i < nb_segments; i++)
+    {
+        int64_t ts = start + av_rescale(ic->duration, i, nb_segments);
+        if (vst >= 0)
+            ts = find_keyframe_from(ic, vst, ts);
+        // 关键帧间隔比段长还大时, 段数会变少
+        if (ts == AV_NOPTS_VALUE || ts <= starts[j - 1])
+            continue;
+        starts[j++] = ts;
+    }
+    nb_segments = j;
+    avformat_close_input(&ic);
+
+    ext = strrchr(output, '.');
+    if (ext && strchr(ext, '/'))
+        ext = NULL;
+    base_len = ext ? ext - output : strlen(output);
+    list_name = av_asprintf("%.*s.parts.txt", base_len, output);
+    if (!list_name)
+        exit_program(1);
+
+    term_init();
+    av_log(NULL, AV_LOG_INFO, "Transcoding %s in %d segments\n", input, nb_segments);
+
+    // 每段的命令行: 在 -i 前插入 -ss/-t, 输出换成临时文件
+    for (i = 0; i < nb_segments; i++)
+    {
+        char *seg_args[4], **tmp;
+        int nb_seg_args = 0;
+
+        parts[i] = av_asprintf("%.*s.part%02d%s", base_len, output, i, ext ? ext : "");
+        if (!parts[i])
+            exit_program(1);
+        seg_ss = format_seconds(starts[i] - start);
+        seg_t = i + 1 < nb_segments ? format_seconds(starts[i + 1] - starts[i]) : NULL;
+
+        args = NULL;
+        nb_args = 0;
+        for (j = 0; j < *argc - 1; j++)
+        {
+            if (j == idx || j == idx + 1)
+                continue;
+            if (j == input_idx)
+            {
+                seg_args[nb_seg_args++] = "-ss";
+                seg_args[nb_seg_args++] = seg_ss;
+                if (seg_t)
+                {
+                    seg_args[nb_seg_args++] = "-t";
+                    seg_args[nb_seg_args++] = seg_t;
+                }
+                tmp = join_args(args, nb_args, seg_args, nb_seg_args);
+                av_free(args);
+                args = tmp;
+                nb_args += nb_seg_args;
+            }
+            GROW_ARRAY(args, nb_args);
+            args[nb_args - 1] = (*argv)[j];
+        }
+        if (has_audio)
+        {
+            GROW_ARRAY(args, nb_args);
+            args[nb_args - 1] = "-an";
+        }
+        GROW_ARRAY(args, nb_args);
+        args[nb_args - 1] = "-y";
+        GROW_ARRAY(args, nb_args);
+        args[nb_args - 1] = parts[i];
+
+        pids[i] = fork_job(argc, argv, join_args(args, nb_args, NULL, 0), nb_args);
+        av_freep(&args);
+        if (!pids[i])
+            return;
+        if (pids[i] < 0)
+            nb_failed++;
+        av_log(NULL, AV_LOG_VERBOSE, "Segment %d: start %ss duration %ss\n",
+               i, seg_ss, seg_t ? seg_t : "-");
+        av_freep(&seg_ss);
+        av_freep(&seg_t);
+    }
+
+    // 音频: 原来的命令行去掉视频, 整段编码
+    pids[nb_segments] = 0;
+    if (has_audio)
+    {
+        static char *audio_args[] = {"-vn", "-sn", "-dn", "-y", NULL};
+
+        audio_name = av_asprintf("%.*s.audio%s", base_len, output, ext ? ext : "");
+        if (!audio_name)
+            exit_program(1);
+        audio_args[4] = audio_name;
+        args = NULL;
+        nb_args = 0;
+        for (j = 0; j < *argc - 1; j++)
+        {
+            if (j == idx || j == idx + 1)
+                continue;
+            GROW_ARRAY(args, nb_args);
+            args[nb_args - 1] = (*argv)[j];
+        }
+        pids[nb_segments] = fork_job(argc, argv, join_args(args, nb_args, audio_args, FF_ARRAY_ELEMS(audio_args)),
+                                     nb_args + FF_ARRAY_ELEMS(audio_args));
+        av_freep(&args);
+        if (!pids[nb_segments])
+            return;
+        if (pids[nb_segments] < 0)
+            nb_failed++;
+    }
+
+    for (i = 0; i <= nb_segments; i++)
+    {
+        if (pids[i] <= 0)
+            continue;
+        if ((pid = wait_jobs(&status)) < 0)
+            break;
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+        {
+            av_log(NULL, AV_LOG_ERROR, "Segment job %d failed\n", (int)pid);
+            nb_failed++;
+        }
+    }
+
+    // 拼接: 先写 concat 列表, 再用一个子进程 -c copy 输出到最终文件
+    if (!nb_failed && !received_nb_signals)
+    {
+        if ((ret = avio_open2(&list, list_name, AVIO_FLAG_WRITE, &int_cb, NULL)) < 0)
+        {
+            print_error(list_name, ret);
+            nb_failed++;
+        }
+        else
+        {
+            avio_printf(list, "ffconcat version 1.0\n");
+            for (i = 0; i < nb_segments; i++)
+            {
+                name = strrchr(parts[i], '/') ? strrchr(parts[i], '/') + 1 : parts[i];
+                avio_printf(list, "file '");
+                for (; *name; name++)
+                    if (*name == '\'')
+                        avio_printf(list, "'\\''");
+                    else
+                        avio_w8(list, *name);
+                avio_printf(list, "'\n");
+            }
+            avio_closep(&list);
+        }
+    }
+    if (!nb_failed && !received_nb_signals)
+    {
+        static char *concat_args[] = {"-f", "concat", "-safe", "0", "-i", NULL};
+        static char *audio_args[] = {"-i", NULL, "-map", "0", "-map", "1"};
+        static char *copy_args[] = {"-map", "0", "-c", "copy"};
+
+        args = NULL;
+        nb_args = 0;
+        GROW_ARRAY(args, nb_args);
+        args[0] = (*argv)[0];
+        for (j = 1; j < *argc - 1; j++)
+            for (i = 0; i < FF_ARRAY_ELEMS(passthrough); i++)
+                if (!strcmp((*argv)[j], passthrough[i]))
+                {
+                    GROW_ARRAY(args, nb_args);
+                    args[nb_args - 1] = (*argv)[j];
+                    if (!strcmp(passthrough[i], "-loglevel") || !strcmp(passthrough[i], "-v"))
+                    {
+                        GROW_ARRAY(args, nb_args);
+                        args[nb_args - 1] = (*argv)[++j];
+                    }
+                    break;
+                }
+        concat_args[5] = list_name;
+        audio_args[1] = audio_name;
+        args = append_args(args, &nb_args, concat_args, FF_ARRAY_ELEMS(concat_args));
+        if (has_audio)
+        {
+            args = append_args(args, &nb_args, audio_args, FF_ARRAY_ELEMS(audio_args));
+            args = append_args(args, &nb_args, copy_args + 2, 2);
+        }
+        else
+            args = append_args(args, &nb_args, copy_args, FF_ARRAY_ELEMS(copy_args));
+
+        // 输出的复用器选项, 如 -f mpegts out.bin
+        for (j = input_idx + 2; j < *argc - 2; j++)
+            if (!strcmp((*argv)[j], "-f"))
+                format = (*argv)[j + 1];
+        ofmt = av_guess_format(format, format ? NULL : output, NULL);
+        for (j = input_idx + 2; j < *argc - 2; j++)
+            if ((*argv)[j][0] == '-' && is_muxer_option((*argv)[j] + 1, ofmt))
+                args = append_args(args, &nb_args, *argv + j++, 2);
+        GROW_ARRAY(args, nb_args);
+        args[nb_args - 1] = (char *)output;
+
+        pid = fork_job(argc, argv, join_args(args, nb_args, NULL, 0), nb_args);
+        av_freep(&args);
+        if (!pid)
+            return;
+        if (pid < 0 || wait_jobs(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+            nb_failed++;
+    }
+
+    for (i = 0; i < nb_segments; i++)
+    {
+        unlink(parts[i]);
+        av_freep(&parts[i]);
+    }
+    unlink(list_name);
+    av_freep(&list_name);
+    if (audio_name)
+        unlink(audio_name);
+    av_freep(&audio_name);
+
+    if (nb_failed)
+        av_log(NULL, AV_LOG_ERROR, "Segment-parallel transcoding of %s failed\n", input);
+    exit_program(nb_failed || received_nb_signals);
+}
+#endif
+
 /* 
 (1) 初始化
     register_exit()
@@ -5192,6 +8565,26 @@ int main(int argc, char **argv)
 
     // show_banner(argc, argv, options);
 
+    // -batch: 父进程只负责调度, 子进程带着任务的命令行继续往下执行
+    if (locate_option(argc, argv, options, "batch"))
+    {
+#if HAVE_FORK_JOBS
+        run_batch(&argc, &argv);
+#else
+        av_log(NULL, AV_LOG_FATAL, "Batch mode is not supported on this platform\n");
+        exit_program(1);
+#endif
+    }
+    else if (locate_option(argc, argv, options, "segment_parallel"))
+    {
+#if HAVE_FORK_JOBS
+        run_segment_parallel(&argc, &argv);
+#else
+        av_log(NULL, AV_LOG_FATAL, "Segment-parallel mode is not supported on this platform\n");
+        exit_program(1);
+#endif
+    }
+
     // (2) 解析输入命令, 并打开输入,输出文件.
     ret = ffmpeg_parse_options(argc, argv);
     if (ret < 0)
@@ -3,6 +3,7 @@
 
 #include "config.h"
 
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <signal.h>
@@ -24,6 +25,10 @@
 #include "libavutil/threadmessage.h"
 #include "libswresample/swresample.h"
 
+#if HAVE_THREADS
+#include <pthread.h>
+#endif
+
 #define VSYNC_AUTO -1
 #define VSYNC_PASSTHROUGH 0
 #define VSYNC_CFR 1
@@ -106,6 +111,12 @@ typedef struct OptionsContext
     int rate_emu;
     int accurate_seek;
     int thread_queue_size;
+    int64_t readahead_size;
+    int64_t thread_queue_max_bytes;
+    int64_t loop_cache_size;
+    int64_t frame_cache_size;
+    int64_t keyframe_step;
+    int mmap_input;
 
     SpecifierOpt *ts_scale;
     int nb_ts_scale;
@@ -138,6 +149,11 @@ typedef struct OptionsContext
     uint64_t limit_filesize;
     float mux_preload;
     float mux_max_delay;
+    int mux_thread_queue_size;
+    int64_t rotate_time;
+    int64_t rotate_size;
+    int io_buffer_size;
+    const char *io_cache_mode;
     int shortest;
     int bitexact;
 
@@ -202,6 +218,8 @@ typedef struct OptionsContext
     int nb_passlogfiles;
     SpecifierOpt *max_muxing_queue_size;
     int nb_max_muxing_queue_size;
+    SpecifierOpt *muxing_queue_data_threshold;
+    int nb_muxing_queue_data_threshold;
     SpecifierOpt *guess_layout_max;
     int nb_guess_layout_max;
     SpecifierOpt *apad;
@@ -210,6 +228,8 @@ typedef struct OptionsContext
     int nb_discard;
     SpecifierOpt *disposition;
     int nb_disposition;
+    SpecifierOpt *share_encoders;
+    int nb_share_encoders;
     SpecifierOpt *program;
     int nb_program;
     SpecifierOpt *time_bases;
@@ -276,13 +296,38 @@ typedef struct FilterGraph
 
     AVFilterGraph *graph;
     int reconfiguration;
+    int nb_threads; /* filter threads from -threads_budget, 0 if not allotted */
 
     InputFilter **inputs;
     int nb_inputs;
     OutputFilter **outputs;
     int nb_outputs;
+
+#if HAVE_THREADS
+    /* -pipeline: a complex graph is run by its own thread, which pushes the
+     * decoded frames queued in in_queue into the graph */
+    AVThreadMessageQueue *in_queue;
+    pthread_t thread;
+    pthread_mutex_t lock;       /* held by whoever is using graph */
+    pthread_mutex_t queue_lock; /* protects nb_pending and thread_ret */
+    pthread_cond_t queue_cond;
+    int nb_pending;             /* messages sent but not processed by the thread yet */
+    int thread_ret;             /* first error of the thread */
+#endif
 } FilterGraph;
 
+/* the decoder context fields read after decoding; with -pipeline the
+ * decoder thread owns dec_ctx and copies them along with every result */
+typedef struct DecoderState
+{
+    int has_b_frames;
+    int width, height;
+    enum AVPixelFormat pix_fmt;
+    AVRational framerate;
+    int ticks_per_frame;
+    int sample_rate;
+} DecoderState;
+
 // 一个输入流可以连接到多个input filter
 typedef struct InputStream
 {
@@ -300,6 +345,7 @@ typedef struct InputStream
     AVCodec *dec;            // 解码器
     AVFrame *decoded_frame;  // 解码帧
     AVFrame *filter_frame;   /* 有filter时使用 a ref of decoded_frame, to be sent to filters */
+    int nb_threads;          /* decoder threads from -threads_budget, 0 if not allotted */
 
     int64_t start; /* 记录流开始的系统起始时间（和流本身没有关系） time when read started */
     /* predicted dts of the next packet read for this stream or (when there are
@@ -316,6 +362,21 @@ typedef struct InputStream
     int64_t min_pts; /* pts with the smallest value in a current stream */
     int64_t max_pts; /* pts with the higher value in a current stream */
 
+    /* -ss with accurate_seek: non-reference frames with a pts before this one
+     * (in stream time base) are cut by the trim filter anyway and are not decoded.
+     * AV_NOPTS_VALUE once the start point has been reached */
+    int64_t skip_nonref_until;
+    enum AVDiscard user_skip_frame; /* skip_frame of the decoder set by the user */
+
+    /* -decode_decimate: non-reference frames that the video sync of the only
+     * output stream would drop are not decoded */
+    int decimate;              /* -1 not decided yet (filtergraph not configured), 0 off, 1 on */
+    AVRational decimate_tb;    /* time base of the output frames, 1/-r */
+    double decimate_offset;    /* output start time, in decimate_tb */
+    double decimate_duration;  /* duration of an input frame, in decimate_tb */
+    double decimate_threshold; /* drop threshold of the vsync method, 1.1 for cfr, 0.6 for vfr */
+    double decimate_warmup;    /* frames before this time (in decimate_tb) are always decoded */
+
     // when forcing constant input framerate through -r,
     // this contains the pts that will be given to the next decoded frame
     int64_t cfr_next_pts;
@@ -368,8 +429,35 @@ typedef struct InputStream
     int nb_dts_buffer;
 
     int got_output;
+
+    DecoderState dec_state; /* dec_ctx as of the last decode() */
+
+#if HAVE_THREADS
+    /* -pipeline: audio and video packets are decoded on a thread of their own,
+     * the frames come back through a bounded queue */
+    AVFifoBuffer *dec_pkt_queue;   /* DecodePacket, NULL if decoding synchronously */
+    AVFifoBuffer *dec_frame_queue; /* DecodeResult */
+    pthread_t dec_thread;
+    pthread_mutex_t dec_lock;      /* protects both queues and dec_abort */
+    pthread_cond_t dec_cond;       /* signalled whenever either queue changes */
+    int dec_abort;
+    enum AVDiscard dec_skip_frame; /* skip_frame for the next packet sent to the thread */
+    AVPacket dec_pending;          /* packet the queue had no room for yet */
+    enum AVDiscard dec_pending_skip_frame; /* dec_skip_frame when dec_pending was queued */
+    int dec_has_pending;
+    int dec_error;    /* decoding error held back until dec_pending is sent */
+    int dec_flushing; /* a flush packet was sent, wait for frames until EOF */
+    int dec_eof;      /* the decoder returned EOF */
+#endif
 } InputStream;
 
+enum LoopCacheState
+{
+    LOOP_CACHE_OFF,     /* disabled, or the input did not fit */
+    LOOP_CACHE_FILLING, /* first pass, the packets read are cached */
+    LOOP_CACHE_REPLAY,  /* the loops are read from the cache */
+};
+
 typedef struct InputFile
 {
     AVFormatContext *ctx;
@@ -380,6 +468,30 @@ typedef struct InputFile
     int64_t duration;     /* actual duration of the longest stream in a file
                              at the moment when looping happens */
     AVRational time_base; /* time base of the duration  文件长度的 time_base*/
+
+    /* -loop_cache_size: the packets of the first pass, replayed for the other loops */
+    enum LoopCacheState loop_cache_state;
+    int64_t loop_cache_size;  /* memory cap in bytes */
+    int64_t loop_cache_bytes; /* payload bytes cached */
+    AVFifoBuffer *loop_cache; /* AVPacket references */
+    int loop_cache_pos;       /* byte offset of the next packet to replay */
+
+    /* -frame_cache_size: the decoded frames of the first pass, sent to the
+     * filters again for the other loops without decoding */
+    enum LoopCacheState frame_cache_state;
+    int64_t frame_cache_size;  /* memory cap in bytes */
+    int64_t frame_cache_bytes; /* frame data bytes cached */
+    AVFifoBuffer *frame_cache; /* FrameCacheEntry, in decoding order over all streams */
+    int frame_cache_pos;       /* byte offset of the next frame to replay */
+
+    /* -keyframe_step: only the video keyframe nearest to every multiple of
+     * keyframe_step is decoded, the demuxer seeks from one to the next */
+    int64_t keyframe_step; /* in AV_TIME_BASE units, 0 if off */
+    int64_t keyframe_next; /* next target timestamp, in AV_TIME_BASE units */
+
+    AVIOContext *mmap_pb; /* -mmap: custom AVIOContext reading from a mapping of the file */
+    AVIOContext *aio_pb;  /* -async_io: AVIOContext reading ahead on worker threads */
+
     int64_t input_ts_offset;
 
     int64_t ts_offset;
@@ -402,6 +514,25 @@ typedef struct InputFile
     int non_blocking;      /* reading packets from the thread should not block */
     int joined;            /* the thread has been joined */
     int thread_queue_size; /* maximum number of queued packets */
+    int thread_queue_alloc;    /* capacity of in_thread_queue, bound for thread_queue_size */
+    int thread_queue_min;      /* initial thread_queue_size, never shrunk below */
+    int thread_queue_adaptive; /* thread_queue_size grows and shrinks with the load */
+    int64_t thread_queue_max_bytes; /* the queue only grows while less is queued */
+
+    /* read-ahead: the packets in in_thread_queue are also limited in bytes */
+    int64_t readahead_size;  /* byte budget of the queue, 0 if unlimited */
+
+    /* the fields below are protected by queue_lock */
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_cond;
+    int nb_queued;           /* packets currently queued */
+    int64_t queued_bytes;    /* bytes currently queued */
+    int window_len, window_max; /* depth seen since the last resize check */
+
+    /* queue depth statistics, sampled for every packet sent */
+    int depth_min, depth_max;
+    int64_t depth_sum, nb_depth_samples;
+    int64_t blocked_sends;   /* packets for which the demuxer thread had to wait */
 #endif
 } InputFile;
 
@@ -493,11 +624,12 @@ typedef struct OutputStream
     char *filters_script; ///< filtergraph script associated to the -filter_script option
 
     AVDictionary *encoder_opts;
+    int nb_threads; /* encoder threads from -threads_budget, 0 if not allotted */
     AVDictionary *sws_dict;
     AVDictionary *swr_opts;
     AVDictionary *resample_opts;
     char *apad;
-    OSTFinished finished; /* no more packets should be written for this stream */
+    atomic_int finished;  /* OSTFinished flags, set from the main, encoder and mux threads */
     int unavailable;      /* true if the steram is unavailable (possibly temporarily) */
     int stream_copy;
 
@@ -508,6 +640,11 @@ typedef struct OutputStream
 
     int inputs_done;
 
+    /* position and cached key in the output scheduler heap, see choose_output() */
+    int sched_index;
+    int sched_class;
+    int64_t sched_opts;
+
     const char *attachment_filename;
     int copy_initial_nonkeyframes;
     int copy_prior_start;
@@ -532,11 +669,35 @@ typedef struct OutputStream
     /* the packets are buffered here until the muxer is ready to be initialized */
     AVFifoBuffer *muxing_queue;
 
+    /* packet data bytes held in muxing_queue; above the threshold the queue is
+     * limited to max_muxing_queue_size packets, or with -muxing_queue_spill_dir
+     * the data of further packets goes to muxing_queue_spill */
+    int64_t muxing_queue_data_size;
+    int64_t muxing_queue_data_threshold;
+    FILE *muxing_queue_spill;           /* spilled packet data, in queue order */
+    int64_t muxing_queue_spilled;       /* bytes written to muxing_queue_spill */
+
     /* packet picture type */
     int pict_type;
 
     /* frame encode sum of squared error values */
     int64_t error[4];
+
+    /* -share_encoder: this stream muxes the packets of enc_share's encoder
+     * instead of encoding; the encoding stream lists its users in enc_shares */
+    struct OutputStream *enc_share;
+    struct OutputStream **enc_shares;
+    int nb_enc_shares;
+
+    /* fatal error of encode_frame(), set in the thread encoding the stream
+     * instead of exit_program(); transcode() fails with it */
+    atomic_int enc_error;
+
+#if HAVE_THREADS
+    /* -pipeline: filtered frames waiting for this stream's encoder thread */
+    AVThreadMessageQueue *enc_queue;
+    pthread_t enc_thread;
+#endif
 } OutputStream;
 
 typedef struct OutputFile
@@ -551,6 +712,40 @@ typedef struct OutputFile
     int shortest;
 
     int header_written;
+
+    /* -rotate_time/-rotate_size: at a keyframe the output continues in the next
+     * file of rotate_pattern while the encoders keep running. ctx only holds
+     * the streams as a template and is never written, mux_ctx is the file
+     * being written */
+    AVFormatContext *mux_ctx;
+    char *rotate_pattern;
+    AVDictionary *rotate_opts; /* protocol and muxer options of every file */
+    int64_t rotate_time;       /* in AV_TIME_BASE units, 0 if off */
+    int64_t rotate_size;       /* in bytes, 0 if off */
+    int rotate_index;          /* number of the file being written, -1 before the first */
+    int rotate_stream;         /* files start at keyframes of this stream, -1 for any packet */
+    int64_t rotate_start;      /* timestamp of the first packet of the file, in AV_TIME_BASE units */
+    atomic_int_least64_t rotate_bytes; /* bytes written to the files before mux_ctx, trailers included */
+
+    AVIOContext *aio_pb; /* -async_io: AVIOContext writing behind on worker threads, of mux_ctx when rotating */
+    int io_buffer_size;  /* -io_buffer_size */
+    int io_cache_mode;   /* -io_cache_mode, enum IOCacheMode */
+
+#if HAVE_THREADS
+    pthread_mutex_t lock; /* serializes muxer access between the main and the encoder threads */
+
+    /* -mux_thread_queue_size: packets are written by a mux thread of the file,
+     * write_packet() only queues them */
+    int mux_queue_size;
+    AVThreadMessageQueue *mux_queue;
+    pthread_t mux_thread;
+    pthread_mutex_t mux_lock;   /* held by the mux thread while it uses the muxer */
+    int mux_error;              /* error of av_interleaved_write_frame() in the mux thread */
+    OutputStream *mux_error_ost;
+    int64_t mux_packets;        /* packets queued, protected by lock */
+    int64_t mux_blocked;        /* of which found the queue full */
+    int64_t mux_blocked_time;   /* time spent waiting on a full queue, in us */
+#endif
 } OutputFile;
 
 // 文件和流是分别保存的
@@ -581,6 +776,7 @@ extern int audio_volume; // 音频音量
 extern int audio_sync_method;
 extern int video_sync_method;
 extern float frame_drop_threshold;
+extern int decode_decimate;
 extern int do_benchmark;
 extern int do_benchmark_all;
 extern int do_deinterlace;
@@ -603,8 +799,17 @@ extern char *videotoolbox_pixfmt;
 extern int filter_nbthreads;
 extern int filter_complex_nbthreads;
 extern int vstats_version;
+extern int pipeline_mode;
+extern int pipeline_queue_size;
+extern int threads_budget;
+extern char *probe_cache_dir;
+extern int probe_cache_refresh;
+extern int async_io_depth;
+extern int async_io_block_size;
+extern char *muxing_queue_spill_dir;
 
 extern const AVIOInterruptCB int_cb;
+extern const AVIOInterruptCB input_int_cb;
 
 // 定义了所有的参数, 参数类型, 参数是否有值, 是放到全局变量中还是放到OptionsContext结构的某个变量中, 或者是调用一个函数来处理参数的值.
 extern const OptionDef options[];
@@ -644,6 +849,42 @@ void sub2video_update(InputStream *ist, AVSubtitle *sub);
 int ifilter_parameters_from_frame(InputFilter *ifilter, const AVFrame *frame);
 
 int ffmpeg_parse_options(int argc, char **argv);
+int count_output_files(int argc, char **argv);
+void free_mmap_input(AVIOContext **pb);
+int open_output_io(OutputFile *of, AVFormatContext *oc, const char *filename,
+                   AVDictionary **opts, AVIOContext **aio_pb);
+
+/* ffmpeg_aio.c */
+typedef struct AsyncIOStats
+{
+    int64_t nb_reads, read_bytes, read_time;    /* completed reads, time in us from queueing to completion */
+    int64_t nb_writes, write_bytes, write_time; /* completed writes, same */
+    int64_t ready;                              /* reads served by a block that had already completed */
+    int64_t waits;                              /* reads waiting for their block, writes waiting for a free block */
+    int64_t nb_syscalls;                        /* pread/pwrite and page cache calls */
+    int max_in_flight;
+} AsyncIOStats;
+
+/* -io_cache_mode */
+enum IOCacheMode
+{
+    IO_CACHE_DEFAULT,
+    IO_CACHE_DONTNEED, /* drop written blocks from the page cache */
+    IO_CACHE_DIRECT,   /* write aligned blocks with O_DIRECT */
+};
+
+/**
+ * Open a local file for reading or writing through a pool of -async_io
+ * worker threads. Outputs with a block_size > 0 (-io_buffer_size) or a
+ * cache_mode are opened here even without -async_io and written
+ * synchronously. Returns NULL if none of this applies to the file, the
+ * caller then opens it normally.
+ */
+AVIOContext *async_io_open(const char *filename, int write, int block_size, int cache_mode);
+/* wait for the writes in flight, returns the first write error */
+int async_io_flush(AVIOContext *pb);
+int async_io_close(AVIOContext **pb);
+void async_io_get_stats(AVIOContext *pb, AsyncIOStats *stats);
 
 int videotoolbox_init(AVCodecContext *s);
 int qsv_init(AVCodecContext *s);
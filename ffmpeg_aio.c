@@ -0,0 +1,630 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * -async_io: 本地文件的异步读写.
+ * 输入: 读位置之后的 depth 个块由线程池并行 pread(), 解复用器读到时通常已经完成.
+ * 输出: 复用器写入的每个块交给线程池 pwrite() 后立即返回 (write-behind),
+ *       最多 depth 个块同时在写.
+ * 对延迟高的网络块存储, 队列深度比单次读写的速度重要得多.
+ *
+ * 输出文件的 -io_buffer_size/-io_cache_mode 也使用这里的写入方式, 没有 -async_io 时
+ * 在写入的线程中同步 pwrite(). 大块写入减少系统调用, dontneed 写完的数据不留在
+ * page cache 中, direct 对齐的块用 O_DIRECT 写入.
+ */
+
+// O_DIRECT 和 sync_file_range() 是 GNU 扩展, 需在包含任何系统头文件之前定义
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libavutil/avstring.h"
+#include "libavutil/time.h"
+
+#include "ffmpeg.h"
+
+#if HAVE_THREADS && HAVE_UNISTD_H
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum AsyncBlockState
+{
+    BLOCK_EMPTY,
+    BLOCK_QUEUED,  /* waiting for a worker */
+    BLOCK_RUNNING, /* a worker is reading or writing it */
+    BLOCK_DONE,
+};
+
+typedef struct AsyncBlock
+{
+    enum AsyncBlockState state;
+    int64_t offset;
+    uint8_t *data;
+    int skew; /* written data starts at data + skew, which has the alignment of offset */
+    int size; /* bytes to write, or bytes read */
+    int ret;  /* result of pread()/pwrite(), <0 is an AVERROR */
+    int64_t queued_time;
+} AsyncBlock;
+
+typedef struct AsyncIO
+{
+    int fd;
+    int direct_fd; /* O_DIRECT descriptor for the aligned blocks, -1 if none */
+    int cache_mode;
+    int write;
+    int64_t pos;  /* read or write position of the AVIOContext */
+    int64_t size; /* file size for reading, end of the written data for writing */
+    int block_size;
+    int depth;     /* number of worker threads, 0 writes synchronously */
+    int nb_blocks;
+    int error; /* first write error, reported by the next write/seek/flush */
+
+    AsyncBlock *blocks;
+    pthread_t *workers;
+    int nb_workers;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* signalled whenever a block changes state */
+    int abort;
+
+    AsyncIOStats stats;
+} AsyncIO;
+
+#define IO_ALIGN 4096
+
+// O_DIRECT 要求缓冲区按块设备的块大小对齐
+static uint8_t *alloc_block(int size)
+{
+#if HAVE_POSIX_MEMALIGN
+    void *p = NULL;
+    return posix_memalign(&p, IO_ALIGN, size) ? NULL : p;
+#else
+    return av_malloc(size);
+#endif
+}
+
+static void free_block(uint8_t *p)
+{
+#if HAVE_POSIX_MEMALIGN
+    free(p);
+#else
+    av_free(p);
+#endif
+}
+
+// pwrite() 直到写完 size 字节, 返回0或AVERROR
+static int write_range(int fd, const uint8_t *data, int size, int64_t offset, int64_t *syscalls)
+{
+    int done, ret;
+
+    for (done = 0; done < size; done += ret)
+    {
+        ++*syscalls;
+        if ((ret = pwrite(fd, data + done, size - done, offset + done)) < 0)
+            return AVERROR(errno);
+    }
+    return 0;
+}
+
+/**
+ * 写入 offset 处的 size 字节, 返回写入的字节数或AVERROR, *syscalls 增加用到的系统调用数.
+ * 在工作线程中不加锁调用.
+ */
+static int write_data(AsyncIO *a, const uint8_t *data, int size, int64_t offset, int64_t *syscalls)
+{
+    int head = 0, body = 0, ret;
+    int64_t prev;
+
+    // O_DIRECT 只写中间对齐的部分, 不满 IO_ALIGN 的头尾 (如改写的文件头) 走普通的描述符.
+    // 缓冲区与 offset 的对齐相同时才能切分, async_io_write() 保证这一点
+    if (a->direct_fd >= 0 && (int64_t)((uintptr_t)data % IO_ALIGN) == offset % IO_ALIGN)
+    {
+        head = FFMIN((IO_ALIGN - offset % IO_ALIGN) % IO_ALIGN, size);
+        body = (size - head) & ~(IO_ALIGN - 1);
+    }
+    if ((ret = write_range(a->fd, data, head, offset, syscalls)) < 0 ||
+        (ret = write_range(a->direct_fd, data + head, body, offset + head, syscalls)) < 0 ||
+        (ret = write_range(a->fd, data + head + body, size - head - body, offset + head + body, syscalls)) < 0)
+        return ret;
+
+    if (a->cache_mode == IO_CACHE_DONTNEED)
+    {
+        // 开始回写这一块, 等上一块回写完后从 page cache 中丢弃.
+        // 上一块按 IO_ALIGN 对齐, 否则首尾不完整的页不会被丢弃
+        prev = (offset & ~(int64_t)(IO_ALIGN - 1)) - a->block_size;
+#ifdef SYNC_FILE_RANGE_WRITE
+        ++*syscalls;
+        sync_file_range(a->fd, offset, size, SYNC_FILE_RANGE_WRITE);
+        if (prev >= 0)
+        {
+            ++*syscalls;
+            sync_file_range(a->fd, prev, a->block_size,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        }
+#endif
+#ifdef POSIX_FADV_DONTNEED
+        if (prev >= 0)
+        {
+            ++*syscalls;
+            posix_fadvise(a->fd, prev, a->block_size, POSIX_FADV_DONTNEED);
+        }
+#endif
+    }
+    return size;
+}
+
+static void *async_io_worker(void *arg)
+{
+    AsyncIO *a = arg;
+    AsyncBlock *b;
+    int64_t done, syscalls;
+    int i, ret;
+
+    pthread_mutex_lock(&a->lock);
+    while (1)
+    {
+        for (i = 0, b = NULL; i < a->nb_blocks && !b; i++)
+            if (a->blocks[i].state == BLOCK_QUEUED)
+                b = &a->blocks[i];
+        if (!b)
+        {
+            if (a->abort)
+                break;
+            pthread_cond_wait(&a->cond, &a->lock);
+            continue;
+        }
+        b->state = BLOCK_RUNNING;
+        pthread_mutex_unlock(&a->lock);
+
+        syscalls = 0;
+        if (a->write)
+            ret = write_data(a, b->data + b->skew, b->size, b->offset, &syscalls);
+        else
+        {
+            for (done = 0, ret = 0; done < a->block_size; done += ret)
+            {
+                syscalls++;
+                if ((ret = pread(a->fd, b->data + done, a->block_size - done, b->offset + done)) <= 0)
+                    break;
+            }
+            ret = ret < 0 ? AVERROR(errno) : done;
+        }
+
+        pthread_mutex_lock(&a->lock);
+        a->stats.nb_syscalls += syscalls;
+        b->ret = ret;
+        if (!a->write)
+            b->size = FFMAX(ret, 0);
+        b->state = BLOCK_DONE;
+        if (a->write)
+        {
+            a->stats.nb_writes++;
+            a->stats.write_bytes += FFMAX(ret, 0);
+            a->stats.write_time += av_gettime_relative() - b->queued_time;
+            if (ret < 0 && !a->error)
+                a->error = ret;
+        }
+        else
+        {
+            a->stats.nb_reads++;
+            a->stats.read_bytes += b->size;
+            a->stats.read_time += av_gettime_relative() - b->queued_time;
+        }
+        pthread_cond_broadcast(&a->cond);
+    }
+    pthread_mutex_unlock(&a->lock);
+
+    return NULL;
+}
+
+static int in_flight(AsyncIO *a)
+{
+    int i, n = 0;
+
+    for (i = 0; i < a->nb_blocks; i++)
+        n += a->blocks[i].state == BLOCK_QUEUED || a->blocks[i].state == BLOCK_RUNNING;
+    return n;
+}
+
+static void queue_block(AsyncIO *a, AsyncBlock *b, int64_t offset)
+{
+    b->offset = offset;
+    b->state = BLOCK_QUEUED;
+    b->queued_time = av_gettime_relative();
+    a->stats.max_in_flight = FFMAX(a->stats.max_in_flight, in_flight(a));
+    pthread_cond_broadcast(&a->cond);
+}
+
+static AsyncBlock *find_block(AsyncIO *a, int64_t offset)
+{
+    int i;
+
+    for (i = 0; i < a->nb_blocks; i++)
+        if (a->blocks[i].state != BLOCK_EMPTY && a->blocks[i].offset == offset)
+            return &a->blocks[i];
+    return NULL;
+}
+
+/**
+ * 找一个可以用来读 offset 处的块: 空的, 或者不在 [window, window + depth 个块) 内的
+ * 已完成/未开始的块. 没有时返回NULL.
+ */
+static AsyncBlock *free_read_block(AsyncIO *a, int64_t window)
+{
+    int64_t window_end = window + (int64_t)a->depth * a->block_size;
+    int i;
+
+    for (i = 0; i < a->nb_blocks; i++)
+        if (a->blocks[i].state == BLOCK_EMPTY)
+            return &a->blocks[i];
+    for (i = 0; i < a->nb_blocks; i++)
+    {
+        AsyncBlock *b = &a->blocks[i];
+        if (b->state != BLOCK_RUNNING && (b->offset < window || b->offset >= window_end))
+            return b;
+    }
+    return NULL;
+}
+
+static int async_io_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    AsyncIO *a = opaque;
+    int64_t offset = a->pos / a->block_size * a->block_size;
+    AsyncBlock *b;
+    int i, size;
+
+    pthread_mutex_lock(&a->lock);
+    if (a->pos >= a->size)
+    {
+        pthread_mutex_unlock(&a->lock);
+        return AVERROR_EOF;
+    }
+
+    // seek 之后所有块可能都还在读旧位置, 先等出一个块给当前位置
+    while (!(b = find_block(a, offset)))
+    {
+        if ((b = free_read_block(a, offset)))
+        {
+            queue_block(a, b, offset);
+            break;
+        }
+        pthread_cond_wait(&a->cond, &a->lock);
+    }
+
+    // 之后的块都在读或者已经读好
+    for (i = 1; i < a->depth; i++)
+    {
+        int64_t o = offset + (int64_t)i * a->block_size;
+        AsyncBlock *next;
+        if (o >= a->size)
+            break;
+        if (!find_block(a, o) && (next = free_read_block(a, offset)))
+            queue_block(a, next, o);
+    }
+
+    if (b->state == BLOCK_DONE)
+        a->stats.ready++;
+    else
+        a->stats.waits++;
+    while (b->state != BLOCK_DONE)
+        pthread_cond_wait(&a->cond, &a->lock);
+
+    if (b->ret < 0)
+    {
+        size = b->ret;
+        b->state = BLOCK_EMPTY; // 下次重新读
+    }
+    else
+    {
+        size = FFMIN(buf_size, b->size - (a->pos - offset));
+        if (size <= 0)
+            size = AVERROR_EOF;
+        else
+        {
+            memcpy(buf, b->data + (a->pos - offset), size);
+            a->pos += size;
+        }
+    }
+    pthread_mutex_unlock(&a->lock);
+    return size;
+}
+
+// 等待所有在写的块完成
+static void wait_writes(AsyncIO *a)
+{
+    while (in_flight(a))
+        pthread_cond_wait(&a->cond, &a->lock);
+}
+
+static int async_io_write(void *opaque, uint8_t *buf, int buf_size)
+{
+    AsyncIO *a = opaque;
+    AsyncBlock *b = NULL;
+    int64_t syscalls = 0, t;
+    int i, ret = buf_size;
+
+    pthread_mutex_lock(&a->lock);
+    while (!a->error)
+    {
+        for (i = 0; i < a->nb_blocks && !b; i++)
+            if (a->blocks[i].state == BLOCK_EMPTY || a->blocks[i].state == BLOCK_DONE)
+                b = &a->blocks[i];
+        if (b)
+            break;
+        a->stats.waits++;
+        pthread_cond_wait(&a->cond, &a->lock);
+    }
+    if (a->error)
+    {
+        ret = a->error;
+        goto end;
+    }
+
+    if (buf_size > a->block_size)
+    {
+        free_block(b->data);
+        if (!(b->data = alloc_block(buf_size + IO_ALIGN)))
+        {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+    }
+    // 数据在块中的位置与文件位置同样对齐, write_data() 可以用 O_DIRECT 写其中对齐的部分
+    b->skew = a->direct_fd >= 0 ? a->pos % IO_ALIGN : 0;
+    memcpy(b->data + b->skew, buf, buf_size);
+    b->size = buf_size;
+    if (a->depth)
+        queue_block(a, b, a->pos);
+    else
+    {
+        // 没有工作线程, 直接写入
+        t = av_gettime_relative();
+        ret = write_data(a, b->data + b->skew, buf_size, a->pos, &syscalls);
+        a->stats.nb_syscalls += syscalls;
+        a->stats.nb_writes++;
+        a->stats.write_time += av_gettime_relative() - t;
+        if (ret < 0)
+        {
+            a->error = ret;
+            goto end;
+        }
+        a->stats.write_bytes += ret;
+        ret = buf_size;
+    }
+    a->pos += buf_size;
+    a->size = FFMAX(a->size, a->pos);
+
+end:
+    pthread_mutex_unlock(&a->lock);
+    return ret;
+}
+
+static int64_t async_io_seek(void *opaque, int64_t offset, int whence)
+{
+    AsyncIO *a = opaque;
+    int64_t pos;
+
+    pthread_mutex_lock(&a->lock);
+    switch (whence & ~AVSEEK_FORCE)
+    {
+    case AVSEEK_SIZE:
+        pos = a->size;
+        goto end;
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = a->pos + offset;
+        break;
+    case SEEK_END:
+        pos = a->size + offset;
+        break;
+    default:
+        pos = AVERROR(EINVAL);
+        goto end;
+    }
+    if (pos < 0)
+    {
+        pos = AVERROR(EINVAL);
+        goto end;
+    }
+
+    // 复用器回头改写文件头时, 之前写的块必须先落盘, 否则可能覆盖新写的内容
+    if (a->write)
+    {
+        wait_writes(a);
+        if (a->error)
+        {
+            pos = a->error;
+            goto end;
+        }
+    }
+    a->pos = pos;
+
+end:
+    pthread_mutex_unlock(&a->lock);
+    return pos;
+}
+
+static void async_io_free(AsyncIO *a)
+{
+    int i;
+
+    pthread_mutex_lock(&a->lock);
+    a->abort = 1;
+    pthread_cond_broadcast(&a->cond);
+    pthread_mutex_unlock(&a->lock);
+    for (i = 0; i < a->nb_workers; i++)
+        pthread_join(a->workers[i], NULL);
+
+    for (i = 0; a->blocks && i < a->nb_blocks; i++)
+        free_block(a->blocks[i].data);
+    av_free(a->blocks);
+    av_free(a->workers);
+    pthread_mutex_destroy(&a->lock);
+    pthread_cond_destroy(&a->cond);
+#ifdef POSIX_FADV_DONTNEED
+    if (a->cache_mode == IO_CACHE_DONTNEED)
+        posix_fadvise(a->fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    if (a->direct_fd >= 0)
+        close(a->direct_fd);
+    close(a->fd);
+    av_free(a);
+}
+
+AVIOContext *async_io_open(const char *filename, int write, int block_size, int cache_mode)
+{
+    const char *proto = avio_find_protocol_name(filename);
+    AVIOContext *pb = NULL;
+    AsyncIO *a;
+    struct stat st;
+    uint8_t *buf = NULL;
+    int i, ret;
+
+    // 读取只有 -async_io 时才使用, 写入时输出文件的参数也可以单独使用
+    if (async_io_depth <= 0 && (!write || (block_size <= 0 && cache_mode == IO_CACHE_DEFAULT)))
+        return NULL;
+    if (!proto || strcmp(proto, "file"))
+        return NULL;
+    av_strstart(filename, "file:", &filename);
+    // 只处理普通文件, 设备, 管道等仍由 file 协议处理
+    if (stat(filename, &st) < 0 ? !write || errno != ENOENT : !S_ISREG(st.st_mode))
+        return NULL;
+
+    a = av_mallocz(sizeof(*a));
+    if (!a)
+        return NULL;
+    a->write = write;
+    a->depth = FFMAX(async_io_depth, 0);
+    a->nb_blocks = FFMAX(a->depth, 1);
+    a->block_size = FFALIGN(FFMAX(block_size > 0 ? block_size : async_io_block_size, IO_ALIGN), IO_ALIGN);
+    a->cache_mode = cache_mode;
+    a->direct_fd = -1;
+    a->fd = open(filename, write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY, 0666);
+    if (a->fd < 0)
+    {
+        av_free(a);
+        return NULL;
+    }
+    if (write && cache_mode == IO_CACHE_DIRECT)
+    {
+#ifdef O_DIRECT
+        a->direct_fd = open(filename, O_WRONLY | O_DIRECT);
+#endif
+        if (a->direct_fd < 0)
+            av_log(NULL, AV_LOG_WARNING, "Cannot open %s for direct I/O, writing it through the page cache\n", filename);
+    }
+    if (!write && fstat(a->fd, &st) >= 0)
+        a->size = st.st_size;
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->cond, NULL);
+
+    a->blocks = av_mallocz_array(a->nb_blocks, sizeof(*a->blocks));
+    a->workers = av_mallocz_array(a->nb_blocks, sizeof(*a->workers));
+    if (!a->blocks || !a->workers)
+        goto fail;
+    for (i = 0; i < a->nb_blocks; i++)
+        if (!(a->blocks[i].data = alloc_block(a->block_size + (write ? IO_ALIGN : 0))))
+            goto fail;
+    for (; a->nb_workers < a->depth; a->nb_workers++)
+    {
+        if ((ret = pthread_create(&a->workers[a->nb_workers], NULL, async_io_worker, a)))
+        {
+            av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
+            goto fail;
+        }
+    }
+
+    // 写入时AVIOContext的缓冲区与块一样大, 每次回调写一整块
+    buf = av_malloc(write ? a->block_size : 32768);
+    if (buf)
+        pb = avio_alloc_context(buf, write ? a->block_size : 32768, write, a,
+                                write ? NULL : async_io_read,
+                                write ? async_io_write : NULL, async_io_seek);
+    if (!pb)
+        goto fail;
+    return pb;
+
+fail:
+    av_free(buf);
+    async_io_free(a);
+    return NULL;
+}
+
+int async_io_flush(AVIOContext *pb)
+{
+    AsyncIO *a = pb->opaque;
+    int ret;
+
+    avio_flush(pb);
+    pthread_mutex_lock(&a->lock);
+    wait_writes(a);
+    ret = a->error;
+    pthread_mutex_unlock(&a->lock);
+    return ret < 0 ? ret : pb->error;
+}
+
+int async_io_close(AVIOContext **pb)
+{
+    int ret;
+
+    if (!*pb)
+        return 0;
+    ret = (*pb)->write_flag ? async_io_flush(*pb) : 0;
+    async_io_free((*pb)->opaque);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+    return ret;
+}
+
+void async_io_get_stats(AVIOContext *pb, AsyncIOStats *stats)
+{
+    AsyncIO *a = pb->opaque;
+
+    pthread_mutex_lock(&a->lock);
+    *stats = a->stats;
+    pthread_mutex_unlock(&a->lock);
+}
+
+#else
+
+AVIOContext *async_io_open(const char *filename, int write, int block_size, int cache_mode)
+{
+    return NULL;
+}
+
+int async_io_flush(AVIOContext *pb)
+{
+    return 0;
+}
+
+int async_io_close(AVIOContext **pb)
+{
+    return 0;
+}
+
+void async_io_get_stats(AVIOContext *pb, AsyncIOStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+#endif
@@ -1104,6 +1104,8 @@ int configure_filtergraph(FilterGraph *fg)
     {
         fg->graph->nb_threads = filter_complex_nbthreads;
     }
+    if (fg->nb_threads > 0) // -threads_budget
+        fg->graph->nb_threads = fg->nb_threads;
     //解析并创建filter, ffmpeg.c的graph_desc只是中间过程的描述
     if ((ret = avfilter_graph_parse2(fg->graph, graph_desc, &inputs, &outputs)) < 0)
         goto fail;
@@ -1,4 +1,12 @@
-﻿#include <stdint.h>
+﻿#include "config.h"
+
+#include <stdint.h>
+#include <sys/stat.h>
+#if HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include "ffmpeg.h"
 #include "cmdutils.h"
@@ -12,16 +20,30 @@
 #include "libavutil/avassert.h"
 #include "libavutil/avstring.h"
 #include "libavutil/avutil.h"
+#include "libavutil/base64.h"
+#include "libavutil/bprint.h"
 #include "libavutil/channel_layout.h"
 #include "libavutil/intreadwrite.h"
 #include "libavutil/fifo.h"
 #include "libavutil/mathematics.h"
+#include "libavutil/md5.h"
 #include "libavutil/opt.h"
 #include "libavutil/parseutils.h"
 #include "libavutil/pixdesc.h"
 #include "libavutil/pixfmt.h"
+#include "libavutil/random_seed.h"
 
 #define DEFAULT_PASS_LOGFILENAME_PREFIX "ffmpeg2pass"
+
+/* -mmap -1 maps regular files of at least this size */
+#define MMAP_INPUT_AUTO_SIZE (64 << 20)
+/* how far ahead of the read position the mapping is paged in */
+#define MMAP_INPUT_READAHEAD (8 << 20)
+
+/* limits for an input thread queue which size was not set by the user */
+#define THREAD_QUEUE_MAX_PACKETS 4096
+#define THREAD_QUEUE_MAX_BYTES   (16 << 20)
+
 // 查找
 #define MATCH_PER_STREAM_OPT(name, type, outvar, fmtctx, st)          \
     {                                                                 \
@@ -73,6 +95,7 @@ int audio_volume = 256;
 int audio_sync_method = 0;
 int video_sync_method = VSYNC_AUTO;
 float frame_drop_threshold = 0;
+int decode_decimate = 0;
 int do_deinterlace = 0;
 int do_benchmark = 0;
 int do_benchmark_all = 0;
@@ -92,6 +115,14 @@ float max_error_rate = 2.0 / 3;
 int filter_nbthreads = 0;
 int filter_complex_nbthreads = 0;
 int vstats_version = 2;
+int pipeline_mode = 0;
+int pipeline_queue_size = 8;
+int threads_budget = 0;
+char *probe_cache_dir = NULL;
+int probe_cache_refresh = 0;
+int async_io_depth = 0;
+int async_io_block_size = 1 << 20;
+char *muxing_queue_spill_dir = NULL;
 
 static int intra_only = 0;
 static int file_overwrite = 0;
@@ -102,6 +133,7 @@ static int input_stream_potentially_available = 0;
 static int ignore_unknown_streams = 0;
 static int copy_unknown_streams = 0;
 static int find_stream_info = 1;
+static int input_threads_planned = 0; /* the inputs will be read by demuxer threads */
 
 static void uninit_options(OptionsContext *o)
 {
@@ -214,6 +246,22 @@ static int opt_sameq(void *optctx, const char *opt, const char *arg)
     return AVERROR(EINVAL);
 }
 
+/*
+ * -batch 和 -batch_jobs 在 main() 中由 run_batch() 处理, 任务的命令行中不再有这两个参数.
+ * 解析到这里说明 -batch_jobs 没有和 -batch 一起使用.
+ */
+static int opt_batch(void *optctx, const char *opt, const char *arg)
+{
+    av_log(NULL, AV_LOG_FATAL, "Option '%s' can only be used together with -batch.\n", opt);
+    return AVERROR(EINVAL);
+}
+
+// -segment_parallel 在 main() 中由 run_segment_parallel() 处理, 子进程的命令行中已去掉
+static int opt_segment_parallel(void *optctx, const char *opt, const char *arg)
+{
+    return 0;
+}
+
 static int opt_video_channel(void *optctx, const char *opt, const char *arg)
 {
     av_log(NULL, AV_LOG_WARNING, "This option is deprecated, use -channel.\n");
@@ -991,6 +1039,56 @@ static void add_input_streams(OptionsContext *o, AVFormatContext *ic)
     }
 }
 
+// -io_cache_mode
+static int parse_io_cache_mode(const char *mode)
+{
+    if (!mode || !strcmp(mode, "default"))
+        return IO_CACHE_DEFAULT;
+    if (!strcmp(mode, "dontneed"))
+        return IO_CACHE_DONTNEED;
+    if (!strcmp(mode, "direct"))
+        return IO_CACHE_DIRECT;
+    av_log(NULL, AV_LOG_FATAL, "Invalid -io_cache_mode %s, use default, dontneed or direct\n", mode);
+    exit_program(1);
+    return IO_CACHE_DEFAULT;
+}
+
+// opts 中是否有 file 协议或 URLContext 的参数, ffmpeg_aio.c 不能处理它们
+static int has_protocol_opts(AVDictionary *opts)
+{
+    static const char *const url_opts[] = {"protocol_whitelist", "protocol_blacklist", "rw_timeout", NULL};
+    const AVClass *file_class = avio_protocol_get_class("file");
+    AVDictionaryEntry *e = NULL;
+    int i;
+
+    while ((e = av_dict_get(opts, "", e, AV_DICT_IGNORE_SUFFIX)))
+    {
+        if (file_class && av_opt_find(&file_class, e->key, NULL, 0, AV_OPT_SEARCH_FAKE_OBJ))
+            return 1;
+        for (i = 0; url_opts[i]; i++)
+            if (!strcmp(e->key, url_opts[i]))
+                return 1;
+    }
+    return 0;
+}
+
+/**
+ * 打开输出文件的 AVIOContext. 适用 -async_io, -io_buffer_size, -io_cache_mode 的本地文件
+ * 由 ffmpeg_aio.c 写入, *aio_pb 指向它; 否则用 avio_open2() 打开, 消耗 opts 中的协议参数.
+ * 指定了协议参数时不使用 ffmpeg_aio.c, 以免这些参数被忽略.
+ * 第0个文件和 -rotate_time/-rotate_size 之后的文件都由这里打开.
+ */
+int open_output_io(OutputFile *of, AVFormatContext *oc, const char *filename,
+                   AVDictionary **opts, AVIOContext **aio_pb)
+{
+    *aio_pb = oc->pb = NULL;
+    if (!has_protocol_opts(*opts))
+        *aio_pb = oc->pb = async_io_open(filename, 1, of->io_buffer_size, of->io_cache_mode);
+    if (oc->pb)
+        return 0;
+    return avio_open2(&oc->pb, filename, AVIO_FLAG_WRITE, &oc->interrupt_callback, opts);
+}
+
 static void assert_file_overwrite(const char *filename)
 {
     const char *proto_name = avio_find_protocol_name(filename);
@@ -1085,17 +1183,460 @@ avformat_alloc_context()
 avformat_open_input()
 avformat_find_stream_info()
  */
-static int open_input_file(OptionsContext *o, const char *filename)
+/**
+ * -probe_cache 的缓存文件路径: 由文件路径, 大小, 修改时间, -f 和探测参数的md5命名.
+ * format_opts (probesize, analyzeduration 等) 要在 avformat_open_input() 取走之前传入.
+ * 只缓存本地文件, 其它输入返回NULL.
+ */
+static char *probe_cache_path(const char *filename, AVInputFormat *iformat,
+                              AVDictionary *format_opts, AVDictionary *codec_opts)
 {
-    // 每个输入文件都有一个InputFile的封装, 也会对应一个 解复用上下文, 解复用器
-    InputFile *f;
+    struct stat st;
+    uint8_t md5[16];
+    char *key, *path, *p, *fmt_str = NULL, *codec_str = NULL;
+    int64_t mtime_ns = 0;
+    int i;
+
+    av_strstart(filename, "file:", &filename);
+    if (!probe_cache_dir || stat(filename, &st) < 0 || !S_ISREG(st.st_mode))
+        return NULL;
+#if HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+    mtime_ns = st.st_mtim.tv_nsec;
+#endif
+    if (av_dict_get_string(format_opts, &fmt_str, '=', ':') < 0 ||
+        av_dict_get_string(codec_opts, &codec_str, '=', ':') < 0)
+    {
+        av_free(fmt_str);
+        return NULL;
+    }
+
+    // 库的版本也放进去, 编解码器ID等枚举值在不同版本间可能不同
+    key = av_asprintf("%s|%"PRId64"|%"PRId64".%09"PRId64"|%s|%s|%s|%u|%u", filename, (int64_t)st.st_size,
+                      (int64_t)st.st_mtime, mtime_ns, iformat ? iformat->name : "",
+                      fmt_str, codec_str, LIBAVFORMAT_VERSION_INT, LIBAVCODEC_VERSION_INT);
+    av_free(fmt_str);
+    av_free(codec_str);
+    if (!key)
+        return NULL;
+    av_md5_sum(md5, key, strlen(key));
+    av_free(key);
+
+    path = av_malloc(strlen(probe_cache_dir) + 2 * sizeof(md5) + 8);
+    if (!path)
+        return NULL;
+    p = path + sprintf(path, "%s/", probe_cache_dir);
+    for (i = 0; i < sizeof(md5); i++)
+        p += sprintf(p, "%02x", md5[i]);
+    strcpy(p, ".probe");
+    return path;
+}
+
+static void dict_set_q(AVDictionary **d, const char *key, AVRational q)
+{
+    char buf[64];
+
+    snprintf(buf, sizeof(buf), "%d/%d", q.num, q.den);
+    av_dict_set(d, key, buf, 0);
+}
+
+static int64_t dict_get_int(AVDictionary *d, const char *key, int64_t def)
+{
+    AVDictionaryEntry *e = av_dict_get(d, key, NULL, 0);
+    return e ? strtoll(e->value, NULL, 10) : def;
+}
+
+static AVRational dict_get_q(AVDictionary *d, const char *key)
+{
+    AVDictionaryEntry *e = av_dict_get(d, key, NULL, 0);
+    AVRational q = {0, 1};
+
+    if (e && sscanf(e->value, "%d/%d", &q.num, &q.den) != 2)
+        q = (AVRational){0, 1};
+    return q;
+}
+
+// 写一行 key=value:key=value...
+static int bprint_dict_line(AVBPrint *bp, AVDictionary **d)
+{
+    char *line = NULL;
+    int ret = av_dict_get_string(*d, &line, '=', ':');
+
+    av_dict_free(d);
+    if (ret < 0)
+        return ret;
+    av_bprintf(bp, "%s\n", line);
+    av_free(line);
+    return 0;
+}
+
+/**
+ * 把 avformat_find_stream_info() 得到的流参数写入 -probe_cache.
+ * 第一行是文件级的参数, 之后每个流一行. 先写临时文件再改名, 并发的任务不会读到写了一半的缓存.
+ */
+static void probe_cache_store(const char *path, AVFormatContext *ic)
+{
+    AVDictionary *d = NULL;
+    AVIOContext *pb = NULL;
+    AVBPrint bp;
+    char *tmp;
+    int i, ret = 0;
+
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+    av_dict_set(&d, "format", ic->iformat->name, 0);
+    av_dict_set_int(&d, "nb_streams", ic->nb_streams, 0);
+    av_dict_set_int(&d, "start_time", ic->start_time, 0);
+    av_dict_set_int(&d, "duration", ic->duration, 0);
+    av_dict_set_int(&d, "bit_rate", ic->bit_rate, 0);
+    ret = bprint_dict_line(&bp, &d);
+
+    for (i = 0; i < ic->nb_streams && ret >= 0; i++)
+    {
+        AVStream *st = ic->streams[i];
+        AVCodecParameters *par = st->codecpar;
+
+        av_dict_set_int(&d, "codec_type", par->codec_type, 0);
+        av_dict_set_int(&d, "codec_id", par->codec_id, 0);
+        av_dict_set_int(&d, "codec_tag", par->codec_tag, 0);
+        av_dict_set_int(&d, "format", par->format, 0);
+        av_dict_set_int(&d, "bit_rate", par->bit_rate, 0);
+        av_dict_set_int(&d, "bits_per_coded_sample", par->bits_per_coded_sample, 0);
+        av_dict_set_int(&d, "bits_per_raw_sample", par->bits_per_raw_sample, 0);
+        av_dict_set_int(&d, "profile", par->profile, 0);
+        av_dict_set_int(&d, "level", par->level, 0);
+        av_dict_set_int(&d, "width", par->width, 0);
+        av_dict_set_int(&d, "height", par->height, 0);
+        dict_set_q(&d, "sample_aspect_ratio", par->sample_aspect_ratio);
+        av_dict_set_int(&d, "field_order", par->field_order, 0);
+        av_dict_set_int(&d, "color_range", par->color_range, 0);
+        av_dict_set_int(&d, "color_primaries", par->color_primaries, 0);
+        av_dict_set_int(&d, "color_trc", par->color_trc, 0);
+        av_dict_set_int(&d, "color_space", par->color_space, 0);
+        av_dict_set_int(&d, "chroma_location", par->chroma_location, 0);
+        av_dict_set_int(&d, "video_delay", par->video_delay, 0);
+        av_dict_set_int(&d, "channel_layout", par->channel_layout, 0);
+        av_dict_set_int(&d, "channels", par->channels, 0);
+        av_dict_set_int(&d, "sample_rate", par->sample_rate, 0);
+        av_dict_set_int(&d, "block_align", par->block_align, 0);
+        av_dict_set_int(&d, "frame_size", par->frame_size, 0);
+        av_dict_set_int(&d, "initial_padding", par->initial_padding, 0);
+        av_dict_set_int(&d, "trailing_padding", par->trailing_padding, 0);
+        if (par->extradata_size > 0)
+        {
+            char *b64 = av_malloc(AV_BASE64_SIZE(par->extradata_size));
+            if (!b64 || !av_base64_encode(b64, AV_BASE64_SIZE(par->extradata_size),
+                                          par->extradata, par->extradata_size))
+            {
+                av_free(b64);
+                av_dict_free(&d);
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            av_dict_set(&d, "extradata", b64, AV_DICT_DONT_STRDUP_VAL);
+        }
+        dict_set_q(&d, "time_base", st->time_base);
+        av_dict_set_int(&d, "start_time", st->start_time, 0);
+        av_dict_set_int(&d, "duration", st->duration, 0);
+        av_dict_set_int(&d, "nb_frames", st->nb_frames, 0);
+        dict_set_q(&d, "r_frame_rate", st->r_frame_rate);
+        dict_set_q(&d, "avg_frame_rate", st->avg_frame_rate);
+        dict_set_q(&d, "stream_sample_aspect_ratio", st->sample_aspect_ratio);
+        ret = bprint_dict_line(&bp, &d);
+    }
+
+    tmp = av_asprintf("%s.%08x.tmp", path, av_get_random_seed());
+    if (ret >= 0 && av_bprint_is_complete(&bp) && tmp &&
+        (ret = avio_open(&pb, tmp, AVIO_FLAG_WRITE)) >= 0)
+    {
+        avio_write(pb, bp.str, bp.len);
+        ret = avio_closep(&pb);
+        if (ret >= 0 && rename(tmp, path) < 0)
+            ret = AVERROR(errno);
+        if (ret < 0)
+            remove(tmp);
+    }
+    if (ret < 0)
+        av_log(NULL, AV_LOG_WARNING, "Could not write probe cache %s: %s\n", path, av_err2str(ret));
+    av_free(tmp);
+    av_bprint_finalize(&bp, NULL);
+}
+
+/**
+ * 从 -probe_cache 中恢复流参数. 缓存与 avformat_open_input() 的结果
+ * (解复用器, 流的数量, 类型和时基) 不一致时视为未命中.
+ * 返回值: 0命中, <0未命中.
+ */
+static int probe_cache_load(const char *path, AVFormatContext *ic)
+{
+    AVDictionary **dicts = NULL;
+    AVIOContext *pb = NULL;
+    AVDictionaryEntry *e;
+    AVBPrint bp;
+    char *line, *next;
+    int i, nb_lines = 0, ret;
+
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+    if ((ret = avio_open(&pb, path, AVIO_FLAG_READ)) < 0)
+        goto end;
+    ret = avio_read_to_bprint(pb, &bp, INT_MAX);
+    avio_closep(&pb);
+    if (ret < 0 || !av_bprint_is_complete(&bp))
+        goto fail;
+
+    dicts = av_mallocz_array(ic->nb_streams + 1, sizeof(*dicts));
+    if (!dicts)
+        goto fail;
+    for (line = av_strtok(bp.str, "\n", &next); line; line = av_strtok(NULL, "\n", &next))
+    {
+        if (nb_lines > ic->nb_streams || av_dict_parse_string(&dicts[nb_lines++], line, "=", ":", 0) < 0)
+            goto fail;
+    }
+    if (nb_lines != ic->nb_streams + 1 ||
+        !(e = av_dict_get(dicts[0], "format", NULL, 0)) || strcmp(e->value, ic->iformat->name) ||
+        dict_get_int(dicts[0], "nb_streams", -1) != ic->nb_streams)
+        goto fail;
+    for (i = 0; i < ic->nb_streams; i++)
+    {
+        AVStream *st = ic->streams[i];
+        AVRational tb = dict_get_q(dicts[i + 1], "time_base");
+
+        if (dict_get_int(dicts[i + 1], "codec_type", AVMEDIA_TYPE_UNKNOWN) != st->codecpar->codec_type ||
+            av_cmp_q(tb, st->time_base))
+            goto fail;
+    }
+
+    ic->start_time = dict_get_int(dicts[0], "start_time", AV_NOPTS_VALUE);
+    ic->duration = dict_get_int(dicts[0], "duration", AV_NOPTS_VALUE);
+    ic->bit_rate = dict_get_int(dicts[0], "bit_rate", 0);
+    for (i = 0; i < ic->nb_streams; i++)
+    {
+        AVDictionary *d = dicts[i + 1];
+        AVStream *st = ic->streams[i];
+        AVCodecParameters *par = st->codecpar;
+
+        par->codec_id = dict_get_int(d, "codec_id", AV_CODEC_ID_NONE);
+        par->codec_tag = dict_get_int(d, "codec_tag", 0);
+        par->format = dict_get_int(d, "format", -1);
+        par->bit_rate = dict_get_int(d, "bit_rate", 0);
+        par->bits_per_coded_sample = dict_get_int(d, "bits_per_coded_sample", 0);
+        par->bits_per_raw_sample = dict_get_int(d, "bits_per_raw_sample", 0);
+        par->profile = dict_get_int(d, "profile", FF_PROFILE_UNKNOWN);
+        par->level = dict_get_int(d, "level", FF_LEVEL_UNKNOWN);
+        par->width = dict_get_int(d, "width", 0);
+        par->height = dict_get_int(d, "height", 0);
+        par->sample_aspect_ratio = dict_get_q(d, "sample_aspect_ratio");
+        par->field_order = dict_get_int(d, "field_order", AV_FIELD_UNKNOWN);
+        par->color_range = dict_get_int(d, "color_range", AVCOL_RANGE_UNSPECIFIED);
+        par->color_primaries = dict_get_int(d, "color_primaries", AVCOL_PRI_UNSPECIFIED);
+        par->color_trc = dict_get_int(d, "color_trc", AVCOL_TRC_UNSPECIFIED);
+        par->color_space = dict_get_int(d, "color_space", AVCOL_SPC_UNSPECIFIED);
+        par->chroma_location = dict_get_int(d, "chroma_location", AVCHROMA_LOC_UNSPECIFIED);
+        par->video_delay = dict_get_int(d, "video_delay", 0);
+        par->channel_layout = dict_get_int(d, "channel_layout", 0);
+        par->channels = dict_get_int(d, "channels", 0);
+        par->sample_rate = dict_get_int(d, "sample_rate", 0);
+        par->block_align = dict_get_int(d, "block_align", 0);
+        par->frame_size = dict_get_int(d, "frame_size", 0);
+        par->initial_padding = dict_get_int(d, "initial_padding", 0);
+        par->trailing_padding = dict_get_int(d, "trailing_padding", 0);
+        if ((e = av_dict_get(d, "extradata", NULL, 0)))
+        {
+            int size = AV_BASE64_DECODE_SIZE(strlen(e->value));
+            uint8_t *extradata = av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE);
+
+            if (!extradata || (size = av_base64_decode(extradata, e->value, size)) < 0)
+            {
+                av_free(extradata);
+                goto fail;
+            }
+            av_freep(&par->extradata);
+            par->extradata = extradata;
+            par->extradata_size = size;
+        }
+        st->start_time = dict_get_int(d, "start_time", AV_NOPTS_VALUE);
+        st->duration = dict_get_int(d, "duration", AV_NOPTS_VALUE);
+        st->nb_frames = dict_get_int(d, "nb_frames", 0);
+        st->r_frame_rate = dict_get_q(d, "r_frame_rate");
+        st->avg_frame_rate = dict_get_q(d, "avg_frame_rate");
+        st->sample_aspect_ratio = dict_get_q(d, "stream_sample_aspect_ratio");
+    }
+    ret = 0;
+    goto end;
+
+fail:
+    av_log(NULL, AV_LOG_VERBOSE, "Ignoring stale or damaged probe cache %s\n", path);
+    ret = AVERROR_INVALIDDATA;
+end:
+    for (i = 0; dicts && i <= ic->nb_streams; i++)
+        av_dict_free(&dicts[i]);
+    av_free(dicts);
+    av_bprint_finalize(&bp, NULL);
+    return ret;
+}
+
+#if HAVE_MMAP
+// -mmap: 通过内存映射读取的本地文件
+typedef struct MmapInput
+{
+    uint8_t *data;
+    int64_t size;
+    int64_t pos;
+    int64_t advised; /* end of the range already passed to posix_madvise(POSIX_MADV_WILLNEED) */
+} MmapInput;
+
+// 在读位置之后保持 MMAP_INPUT_READAHEAD 的预读, 不用等缺页时才从磁盘读
+static void mmap_input_advise(MmapInput *m)
+{
+    // posix_madvise() 不需要 _GNU_SOURCE/_DEFAULT_SOURCE, madvise() 的 MADV_* 需要
+#ifdef POSIX_MADV_WILLNEED
+    int64_t page = sysconf(_SC_PAGESIZE);
+    int64_t start, end;
+
+    if (m->advised >= m->size || m->pos + MMAP_INPUT_READAHEAD / 2 < m->advised)
+        return;
+    start = FFMAX(m->pos, m->advised) / page * page;
+    end = FFMIN(m->pos + MMAP_INPUT_READAHEAD, m->size);
+    if (end > start)
+        posix_madvise(m->data + start, end - start, POSIX_MADV_WILLNEED);
+    m->advised = end;
+#endif
+}
+
+// 读包直接从映射中复制到调用者的缓冲区 (AVIOContext.direct), 不经过 AVIOContext 的缓冲
+static int mmap_input_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    MmapInput *m = opaque;
+    int size = FFMIN(buf_size, m->size - m->pos);
+
+    if (size <= 0)
+        return AVERROR_EOF;
+    memcpy(buf, m->data + m->pos, size);
+    m->pos += size;
+    mmap_input_advise(m);
+    return size;
+}
+
+static int64_t mmap_input_seek(void *opaque, int64_t offset, int whence)
+{
+    MmapInput *m = opaque;
+    int64_t pos;
+
+    switch (whence & ~AVSEEK_FORCE)
+    {
+    case AVSEEK_SIZE:
+        return m->size;
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = m->pos + offset;
+        break;
+    case SEEK_END:
+        pos = m->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (pos < 0)
+        return AVERROR(EINVAL);
+
+    // seek后从新位置重新预读
+    m->pos = pos;
+    m->advised = FFMIN(pos, m->size);
+    mmap_input_advise(m);
+    return pos;
+}
+
+/**
+ * 为本地的普通文件创建读取内存映射的 AVIOContext.
+ * force 为0时只映射不小于 MMAP_INPUT_AUTO_SIZE 的文件.
+ */
+static AVIOContext *open_mmap_input(const char *filename, int force)
+{
+    AVIOContext *pb;
+    MmapInput *m;
+    struct stat st;
+    uint8_t *buf;
+    void *data;
+    int fd;
+
+    av_strstart(filename, "file:", &filename);
+    if (stat(filename, &st) < 0 || !S_ISREG(st.st_mode) || !st.st_size ||
+        (!force && st.st_size < MMAP_INPUT_AUTO_SIZE) || st.st_size > SIZE_MAX)
+        return NULL;
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
+        return NULL;
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+#ifdef POSIX_MADV_SEQUENTIAL
+    posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+#endif
+
+    m = av_mallocz(sizeof(*m));
+    buf = av_malloc(32768);
+    pb = m && buf ? avio_alloc_context(buf, 32768, 0, m, mmap_input_read, NULL, mmap_input_seek) : NULL;
+    if (!pb)
+    {
+        av_free(buf);
+        av_free(m);
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    m->data = data;
+    m->size = st.st_size;
+    pb->direct = 1;
+    mmap_input_advise(m);
+    return pb;
+}
+#endif
+
+void free_mmap_input(AVIOContext **pb)
+{
+#if HAVE_MMAP
+    MmapInput *m;
+
+    if (!*pb)
+        return;
+    m = (*pb)->opaque;
+    munmap(m->data, m->size);
+    av_free(m);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+#endif
+}
+
+/* 打开一个输入文件的中间状态. 有多个输入时, avformat_open_input() 和
+ * avformat_find_stream_info() 在各自的线程中并行执行, 其余步骤仍然在主线程中按输入的顺序完成 */
+typedef struct InputOpenContext
+{
+    OptionsContext o;
+    const char *filename;
     AVFormatContext *ic;
-    AVInputFormat *file_iformat = NULL;
+    AVInputFormat *file_iformat;
+    AVDictionary **info_opts; // avformat_find_stream_info() 每个流的参数
+    int orig_nb_streams;
+    int scan_all_pmts_set;
+    AVIOContext *mmap_pb;
+    AVIOContext *aio_pb;
+    char *probe_cache_path; // -probe_cache 的缓存文件, NULL表示不使用缓存
+    int probe_cached;       // 流参数来自缓存, 不需要探测
+    int find_stream_info;   // 解析这一组参数后的 -find_stream_info, 之后的组会改变全局变量
+    int ret; // 在线程中执行的那一步的返回值
+#if HAVE_THREADS
+    pthread_t thread;
+    int thread_started;
+#endif
+} InputOpenContext;
 
-    int err, i, ret;
-    int64_t timestamp;
-    AVDictionary *unused_opts = NULL;
-    AVDictionaryEntry *e = NULL;
+// 第一步: 处理输入参数, 创建解复用上下文
+static void prepare_input_file(InputOpenContext *c)
+{
+    OptionsContext *o = &c->o;
+    const char *filename = c->filename;
+    AVFormatContext *ic;
+    AVInputFormat *file_iformat = NULL;
     char *video_codec_name = NULL; // 视频解码器的名字
     char *audio_codec_name = NULL; // 音频解码器的名字
     char *subtitle_codec_name = NULL;
@@ -1215,10 +1756,29 @@ static int open_input_file(OptionsContext *o, const char *filename)
     ic->subtitle_codec_id = subtitle_codec_name ? ic->subtitle_codec->id : AV_CODEC_ID_NONE;
     ic->data_codec_id = data_codec_name ? ic->data_codec->id : AV_CODEC_ID_NONE;
 
-    ic->flags |= AVFMT_FLAG_NONBLOCK; // 设置成非阻塞
+    /* inputs read by a demuxer thread may block in the demuxer instead of
+     * returning EAGAIN, only the main thread needs non-blocking reads.
+     * Same condition as init_input_thread(): -keyframe_step is read on the main thread */
+    if (!(input_threads_planned || o->readahead_size > 0) || o->keyframe_step)
+        ic->flags |= AVFMT_FLAG_NONBLOCK; // 设置成非阻塞
     if (o->bitexact)
         ic->flags |= AVFMT_FLAG_BITEXACT;
-    ic->interrupt_callback = int_cb;
+    ic->interrupt_callback = input_int_cb;
+
+    // -async_io 优先于自动的 -mmap: 映射的缺页读取是同步的, 一次只有一个
+    if (async_io_depth > 0 && o->mmap_input <= 0 && !(file_iformat && (file_iformat->flags & AVFMT_NOFILE)) &&
+        !has_protocol_opts(o->g->format_opts))
+        c->aio_pb = ic->pb = async_io_open(filename, 0, 0, IO_CACHE_DEFAULT);
+
+#if HAVE_MMAP
+    // 本地文件通过内存映射读取, 代替 file 协议的 read()
+    if (!ic->pb && o->mmap_input && !(file_iformat && (file_iformat->flags & AVFMT_NOFILE)))
+    {
+        c->mmap_pb = ic->pb = open_mmap_input(filename, o->mmap_input > 0);
+        if (!ic->pb && o->mmap_input > 0)
+            av_log(NULL, AV_LOG_WARNING, "Cannot memory-map %s, reading it normally\n", filename);
+    }
+#endif
 
     if (!av_dict_get(o->g->format_opts, "scan_all_pmts", NULL, AV_DICT_MATCH_CASE))
     {
@@ -1226,34 +1786,91 @@ static int open_input_file(OptionsContext *o, const char *filename)
         scan_all_pmts_set = 1;
     }
 
-    err = avformat_open_input(&ic, filename, file_iformat, &o->g->format_opts);
-    if (err < 0)
+    c->filename = filename;
+    c->ic = ic;
+    c->file_iformat = file_iformat;
+    c->scan_all_pmts_set = scan_all_pmts_set;
+    if (c->find_stream_info)
+        c->probe_cache_path = probe_cache_path(filename, file_iformat, o->g->format_opts, o->g->codec_opts);
+}
+
+// 第二步, 可以在线程中执行
+static void *open_input_worker(void *arg)
+{
+    InputOpenContext *c = arg;
+
+    c->ret = avformat_open_input(&c->ic, c->filename, c->file_iformat, &c->o.g->format_opts);
+    return NULL;
+}
+
+// 第三步: 检查打开的结果, 选择解码器
+static void opened_input_file(InputOpenContext *c)
+{
+    OptionsContext *o = &c->o;
+    AVFormatContext *ic = c->ic;
+    int i;
+
+    if (c->ret < 0)
     {
-        print_error(filename, err);
-        if (err == AVERROR_PROTOCOL_NOT_FOUND)
-            av_log(NULL, AV_LOG_ERROR, "Did you mean file:%s?\n", filename);
+        print_error(c->filename, c->ret);
+        if (c->ret == AVERROR_PROTOCOL_NOT_FOUND)
+            av_log(NULL, AV_LOG_ERROR, "Did you mean file:%s?\n", c->filename);
         exit_program(1);
     }
-    if (scan_all_pmts_set)
+    if (c->scan_all_pmts_set)
     {
         av_dict_set(&o->g->format_opts, "scan_all_pmts", NULL, AV_DICT_MATCH_CASE);
     }
     remove_avoptions(&o->g->format_opts, o->g->codec_opts);
     assert_avoptions(o->g->format_opts);
 
+    if (c->probe_cache_path)
+    {
+        c->probe_cached = !probe_cache_refresh && probe_cache_load(c->probe_cache_path, ic) >= 0;
+        if (c->probe_cached)
+            av_log(NULL, AV_LOG_VERBOSE, "%s: using cached stream parameters from %s\n",
+                   c->filename, c->probe_cache_path);
+    }
+
     for (i = 0; i < ic->nb_streams; i++)       // 输入文件有多少个stream
         choose_decoder(o, ic, ic->streams[i]); // 解码器
 
-    if (find_stream_info) // 一般都是1
+    if (c->find_stream_info && !c->probe_cached) // 一般都是1
     {
-        AVDictionary **opts = setup_find_stream_info_opts(ic, o->g->codec_opts);
-        int orig_nb_streams = ic->nb_streams;
+        c->info_opts = setup_find_stream_info_opts(ic, o->g->codec_opts);
+        c->orig_nb_streams = ic->nb_streams;
+    }
+}
 
-        ret = avformat_find_stream_info(ic, opts);
+// 第四步, 可以在线程中执行
+static void *probe_input_worker(void *arg)
+{
+    InputOpenContext *c = arg;
 
-        for (i = 0; i < orig_nb_streams; i++)
-            av_dict_free(&opts[i]);
-        av_freep(&opts);
+    c->ret = c->find_stream_info && !c->probe_cached ? avformat_find_stream_info(c->ic, c->info_opts) : 0;
+    return NULL;
+}
+
+// 最后一步: 处理 -ss/-sseof, 添加输入流, 创建 InputFile
+static int open_input_file(InputOpenContext *c)
+{
+    // 每个输入文件都有一个InputFile的封装, 也会对应一个 解复用上下文, 解复用器
+    OptionsContext *o = &c->o;
+    const char *filename = c->filename;
+    AVFormatContext *ic = c->ic;
+    InputFile *f;
+    int i, ret;
+    int64_t timestamp;
+    AVDictionary *unused_opts = NULL;
+    AVDictionaryEntry *e = NULL;
+
+    if (c->find_stream_info)
+    {
+        ret = c->ret;
+
+        for (i = 0; i < c->orig_nb_streams; i++)
+            av_dict_free(&c->info_opts[i]);
+        av_freep(&c->info_opts);
 
         if (ret < 0)
         {
@@ -1264,6 +1881,9 @@ static int open_input_file(OptionsContext *o, const char *filename)
                 exit_program(1);
             }
         }
+        else if (c->probe_cache_path && !c->probe_cached)
+            probe_cache_store(c->probe_cache_path, ic);
+        av_freep(&c->probe_cache_path);
     }
 
     // start_time 和 start_time_eof, 不允许2个同时使用. 对应命令: -ss, -sseof(从结尾开始算, 和-ss对称)
@@ -1343,6 +1963,8 @@ static int open_input_file(OptionsContext *o, const char *filename)
     input_files[nb_input_files - 1] = f;
 
     f->ctx = ic;                                      // 文件保存相应信息
+    f->mmap_pb = c->mmap_pb;
+    f->aio_pb = c->aio_pb;
     f->ist_index = nb_input_streams - ic->nb_streams; // 输入文件和输入流相关联, 对应stream的起始位置, 因为同一个文件的流都排列在一起.
     f->start_time = o->start_time;                    // 起始位置 对应-ss选项
     f->recording_time = o->recording_time;            // 对应 timestamp
@@ -1354,8 +1976,34 @@ static int open_input_file(OptionsContext *o, const char *filename)
     f->loop = o->loop;                   // 是否循环输出
     f->duration = 0;                     // 持续时长，先设置为0
     f->time_base = (AVRational){1, 1};   // 时基
+    // 第一遍从 -ss 处开始时, 缓存的包不是完整的一遍, 不能用来回放
+    if (f->loop && o->loop_cache_size > 0 && o->start_time == AV_NOPTS_VALUE)
+    {
+        f->loop_cache_size = o->loop_cache_size;
+        f->loop_cache = av_fifo_alloc(64 * sizeof(AVPacket));
+        if (!f->loop_cache)
+            exit_program(1);
+        f->loop_cache_state = LOOP_CACHE_FILLING;
+    }
+    // 是否可以缓存解码后的帧要等输出流都建立后在 init_frame_caches() 中确定
+    if (f->loop && o->frame_cache_size > 0 && o->start_time == AV_NOPTS_VALUE)
+        f->frame_cache_size = o->frame_cache_size;
+    if (o->keyframe_step < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "-keyframe_step must not be negative\n");
+        exit_program(1);
+    }
+    f->keyframe_step = o->keyframe_step;
+    f->keyframe_next = AV_NOPTS_VALUE;
 #if HAVE_THREADS
+    f->readahead_size = FFMAX(o->readahead_size, 0);
+    // 指定了 -thread_queue_size 时队列大小固定, 否则从8个包开始自适应
+    f->thread_queue_adaptive = o->thread_queue_size <= 0;
     f->thread_queue_size = o->thread_queue_size > 0 ? o->thread_queue_size : 8;
+    f->thread_queue_min = f->thread_queue_size;
+    f->thread_queue_alloc = f->thread_queue_adaptive ? THREAD_QUEUE_MAX_PACKETS : f->thread_queue_size;
+    f->thread_queue_max_bytes = o->thread_queue_max_bytes > 0 ? o->thread_queue_max_bytes :
+                                f->readahead_size ? f->readahead_size : THREAD_QUEUE_MAX_BYTES;
 #endif
 
     /* check if all codec options have been used */
@@ -1531,6 +2179,38 @@ static int choose_encoder(OptionsContext *o, AVFormatContext *s, OutputStream *o
     return 0;
 }
 
+/**
+ * 解析 -share_encoder 的参数 "file:stream", 返回之前的输出文件中一个编码的
+ * 音视频流, 新的流直接复用它编码出的包.
+ */
+static OutputStream *find_shared_encoder(const char *arg, enum AVMediaType type)
+{
+    OutputStream *ost;
+    char *p;
+    int file_idx, stream_idx;
+
+    file_idx = strtol(arg, &p, 0);
+    stream_idx = *p == ':' ? strtol(p + 1, &p, 0) : -1;
+    if (*p || file_idx < 0 || file_idx >= nb_output_files - 1 ||
+        stream_idx < 0 || stream_idx >= output_files[file_idx]->ctx->nb_streams)
+    {
+        av_log(NULL, AV_LOG_FATAL, "Invalid -share_encoder %s: expected file:stream of an earlier output file\n", arg);
+        exit_program(1);
+    }
+
+    ost = output_streams[output_files[file_idx]->ost_index + stream_idx];
+    if (ost->enc_share)
+        ost = ost->enc_share;
+    if (!ost->encoding_needed || ost->st->codecpar->codec_type != type ||
+        (type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO))
+    {
+        av_log(NULL, AV_LOG_FATAL, "Output stream #%d:%d is not an encoded %s stream, "
+               "it cannot be shared\n", file_idx, stream_idx, av_get_media_type_string(type));
+        exit_program(1);
+    }
+    return ost;
+}
+
 // audio/video共用
 static OutputStream *new_output_stream(OptionsContext *o, AVFormatContext *oc, enum AVMediaType type, int source_index)
 {
@@ -1538,7 +2218,7 @@ static OutputStream *new_output_stream(OptionsContext *o, AVFormatContext *oc, e
     AVStream *st = avformat_new_stream(oc, NULL);
     int idx = oc->nb_streams - 1, ret = 0;
     const char *bsfs = NULL, *time_base = NULL;
-    char *next, *codec_tag = NULL;
+    char *next, *codec_tag = NULL, *share_encoder = NULL;
     double qscale = -1;
     int i;
 
@@ -1562,13 +2242,65 @@ static OutputStream *new_output_stream(OptionsContext *o, AVFormatContext *oc, e
     ost->forced_kf_ref_pts = AV_NOPTS_VALUE;
     st->codecpar->codec_type = type;
 
-    ret = choose_encoder(o, oc, ost);
-    if (ret < 0)
+    MATCH_PER_STREAM_OPT(share_encoders, str, share_encoder, oc, st);
+    if (share_encoder)
     {
-        av_log(NULL, AV_LOG_FATAL, "Error selecting an encoder for stream "
-                                   "%d:%d\n",
-               ost->file_index, ost->index);
-        exit_program(1);
+        // 既不编码也不是流拷贝, 包由 enc_share 的编码器分发过来
+        OutputStream *src = find_shared_encoder(share_encoder, type);
+        char *codec_name = NULL, *filters = NULL, *filters_script = NULL;
+        AVDictionary *enc_opts;
+
+        // 输入和编码参数都由共享的编码器决定, 不能为这个流另外指定
+        if (source_index < 0 || source_index != src->source_index)
+        {
+            av_log(NULL, AV_LOG_FATAL, "Output stream #%d:%d is not mapped from the input stream "
+                   "encoded by -share_encoder %s\n", ost->file_index, ost->index, share_encoder);
+            exit_program(1);
+        }
+        MATCH_PER_STREAM_OPT(codec_names, str, codec_name, oc, st);
+        MATCH_PER_STREAM_OPT(filters, str, filters, oc, st);
+        MATCH_PER_STREAM_OPT(filter_scripts, str, filters_script, oc, st);
+        enc_opts = filter_codec_opts(o->g->codec_opts, src->enc->id, oc, st, src->enc);
+        if (codec_name || filters || filters_script || av_dict_count(enc_opts))
+        {
+            av_log(NULL, AV_LOG_FATAL, "Codec or filter options cannot be set for output stream #%d:%d, "
+                   "it uses -share_encoder %s\n", ost->file_index, ost->index, share_encoder);
+            exit_program(1);
+        }
+        av_dict_free(&enc_opts);
+        // 编码器按它自己的输出文件决定是否只在 extradata 中输出全局头
+        if ((oc->oformat->flags & AVFMT_GLOBALHEADER) &&
+            !(output_files[src->file_index]->ctx->oformat->flags & AVFMT_GLOBALHEADER))
+        {
+            av_log(NULL, AV_LOG_FATAL, "Output stream #%d:%d needs global headers, which the encoder "
+                   "of -share_encoder %s does not output for %s\n", ost->file_index, ost->index,
+                   share_encoder, output_files[src->file_index]->ctx->oformat->name);
+            exit_program(1);
+        }
+        // 编码后的包无法按另一个起始位置裁剪, -t 则在 share_packet() 中按各自的文件处理
+        if (o->start_time != output_files[src->file_index]->start_time)
+        {
+            av_log(NULL, AV_LOG_FATAL, "Output stream #%d:%d must use the same -ss as the output "
+                   "of -share_encoder %s\n", ost->file_index, ost->index, share_encoder);
+            exit_program(1);
+        }
+
+        ost->enc_share = src;
+        ost->enc = src->enc;
+        st->codecpar->codec_id = src->enc->id;
+        GROW_ARRAY(src->enc_shares, src->nb_enc_shares);
+        src->enc_shares[src->nb_enc_shares - 1] = ost;
+    }
+    else
+    {
+        ret = choose_encoder(o, oc, ost);
+        if (ret < 0)
+        {
+            av_log(NULL, AV_LOG_FATAL, "Error selecting an encoder for stream "
+                                       "%d:%d\n",
+                   ost->file_index, ost->index);
+            exit_program(1);
+        }
     }
 
     ost->enc_ctx = avcodec_alloc_context3(ost->enc);
@@ -1752,6 +2484,9 @@ static OutputStream *new_output_stream(OptionsContext *o, AVFormatContext *oc, e
     MATCH_PER_STREAM_OPT(max_muxing_queue_size, i, ost->max_muxing_queue_size, oc, st);
     ost->max_muxing_queue_size *= sizeof(AVPacket);
 
+    ost->muxing_queue_data_threshold = 50 * 1024 * 1024;
+    MATCH_PER_STREAM_OPT(muxing_queue_data_threshold, i64, ost->muxing_queue_data_threshold, oc, st);
+
     if (oc->oformat->flags & AVFMT_GLOBALHEADER)
         ost->enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
@@ -2214,7 +2949,7 @@ static OutputStream *new_attachment_stream(OptionsContext *o, AVFormatContext *o
 {
     OutputStream *ost = new_output_stream(o, oc, AVMEDIA_TYPE_ATTACHMENT, source_index);
     ost->stream_copy = 1;
-    ost->finished = 1;
+    atomic_store(&ost->finished, 1);
     return ost;
 }
 
@@ -2387,6 +3122,7 @@ static int open_output_file(OptionsContext *o, const char *filename)
     AVDictionary *unused_opts = NULL;
     AVDictionaryEntry *e = NULL;
     int format_flags = 0;
+    char segment_name[1024];
 
     // -t and -to 不能同时使用
     if (o->stop_time != INT64_MAX && o->recording_time != INT64_MAX)
@@ -2416,6 +3152,16 @@ static int open_output_file(OptionsContext *o, const char *filename)
         exit_program(1);
     }
     output_files[nb_output_files - 1] = of; // 加入输出文件数组
+#if HAVE_THREADS
+    {
+        // 使用检错锁, 出错退出时 ffmpeg_cleanup() 可以安全地解锁
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+        pthread_mutex_init(&of->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+#endif
 
     of->ost_index = nb_output_streams; // 文件和流对应, 对应的输出流索引. 默认从0开始.
 
@@ -2424,6 +3170,9 @@ static int open_output_file(OptionsContext *o, const char *filename)
     of->start_time = o->start_time; // 起始时间
     of->limit_filesize = o->limit_filesize;
     of->shortest = o->shortest; // -shortest
+#if HAVE_THREADS
+    of->mux_queue_size = o->mux_thread_queue_size;
+#endif
     av_dict_copy(&of->opts, o->g->format_opts, 0);
 
     if (!strcmp(filename, "-"))
@@ -2431,6 +3180,25 @@ static int open_output_file(OptionsContext *o, const char *filename)
         filename = "pipe:";
     }
 
+    // 分段输出: 文件名是带 %d 的模板, 先写第0个文件
+    if (o->rotate_time > 0 || o->rotate_size > 0)
+    {
+        if (av_get_frame_filename2(segment_name, sizeof(segment_name), filename, 0, 0) < 0)
+        {
+            av_log(NULL, AV_LOG_FATAL, "-rotate_time and -rotate_size need a %%d pattern in the output filename, "
+                   "got %s\n", filename);
+            exit_program(1);
+        }
+        of->rotate_pattern = av_strdup(filename);
+        of->rotate_time = FFMAX(o->rotate_time, 0);
+        of->rotate_size = FFMAX(o->rotate_size, 0);
+        of->rotate_start = AV_NOPTS_VALUE;
+        of->rotate_index = -1;
+        if (!of->rotate_pattern)
+            exit_program(1);
+        filename = segment_name;
+    }
+
     // 对应参数"-f", 根据此参数和filename分配一个输出文件格式结构体变量oc. o->format 是-f选项.
     err = avformat_alloc_output_context2(&oc, NULL, o->format, filename);
     if (!oc)
@@ -2440,6 +3208,7 @@ static int open_output_file(OptionsContext *o, const char *filename)
     }
 
     of->ctx = oc; // 对应ffmpeg的输出文件句柄
+    of->mux_ctx = oc;
     if (o->recording_time != INT64_MAX)
     {
         oc->duration = o->recording_time;
@@ -2937,9 +3706,11 @@ static int open_output_file(OptionsContext *o, const char *filename)
         assert_file_overwrite(filename);
 
         /* open the file */
-        if ((err = avio_open2(&oc->pb, filename, AVIO_FLAG_WRITE,
-                              &oc->interrupt_callback,
-                              &of->opts)) < 0)
+        of->io_buffer_size = o->io_buffer_size;
+        of->io_cache_mode = parse_io_cache_mode(o->io_cache_mode);
+        // 分段输出时 oc 只是流的模板, 第0个文件在写文件头时由 open_next_muxer() 打开
+        if (!of->rotate_pattern &&
+            (err = open_output_io(of, oc, filename, &of->opts, &of->aio_pb)) < 0)
         {
             print_error(filename, err);
             exit_program(1);
@@ -2952,6 +3723,8 @@ static int open_output_file(OptionsContext *o, const char *filename)
     {
         av_dict_set_int(&of->opts, "preload", o->mux_preload * AV_TIME_BASE, 0);
     }
+    if (of->rotate_pattern)
+        av_dict_copy(&of->rotate_opts, of->opts, 0);
     oc->max_delay = (int)(o->mux_max_delay * AV_TIME_BASE);
 
     /* copy metadata */
@@ -3730,6 +4503,93 @@ static const OptionGroupDef groups[] = {
     [GROUP_INFILE] = {"input url", "i", OPT_INPUT}, // 输入文件 -i
 };
 
+// 在每个输入各自的线程中执行 step, 全部完成后返回
+static void run_input_step(InputOpenContext *c, int nb, void *(*step)(void *))
+{
+    int i;
+
+#if HAVE_THREADS
+    if (nb > 1)
+    {
+        for (i = 0; i < nb; i++)
+        {
+            c[i].thread_started = !pthread_create(&c[i].thread, NULL, step, &c[i]);
+            if (!c[i].thread_started)
+                step(&c[i]); // 创建线程失败就直接执行
+        }
+        for (i = 0; i < nb; i++)
+            if (c[i].thread_started)
+                pthread_join(c[i].thread, NULL);
+        return;
+    }
+#endif
+    for (i = 0; i < nb; i++)
+        step(&c[i]);
+}
+
+/**
+ * 打开所有的输入文件. 打开和探测码流信息这两步在所有输入间并行,
+ * 所以启动时间取决于最慢的输入, 而不是所有输入的总和.
+ * 参数处理和错误信息仍然按输入的顺序在主线程中完成.
+ */
+static int open_input_files(OptionGroupList *l)
+{
+    InputOpenContext *c;
+    int i, nb_init = 0, ret = 0;
+
+    if (!l->nb_groups)
+        return 0;
+    c = av_mallocz_array(l->nb_groups, sizeof(*c));
+    if (!c)
+        return AVERROR(ENOMEM);
+
+    for (i = 0; i < l->nb_groups; i++)
+    {
+        OptionGroup *g = &l->groups[i];
+
+        init_options(&c[i].o);
+        c[i].o.g = g;
+        c[i].filename = g->arg;
+        nb_init++;
+
+        ret = parse_optgroup(&c[i].o, g);
+        if (ret < 0)
+        {
+            av_log(NULL, AV_LOG_ERROR, "Error parsing options for input file "
+                                       "%s.\n",
+                   g->arg);
+            goto end;
+        }
+        c[i].find_stream_info = find_stream_info;
+
+        av_log(NULL, AV_LOG_DEBUG, "Opening an input file: %s.\n", g->arg);
+        prepare_input_file(&c[i]);
+    }
+
+    run_input_step(c, l->nb_groups, open_input_worker);
+    for (i = 0; i < l->nb_groups; i++)
+        opened_input_file(&c[i]);
+
+    run_input_step(c, l->nb_groups, probe_input_worker);
+    for (i = 0; i < l->nb_groups; i++)
+    {
+        ret = open_input_file(&c[i]);
+        if (ret < 0)
+        {
+            av_log(NULL, AV_LOG_ERROR, "Error opening input file %s.\n",
+                   l->groups[i].arg);
+            goto end;
+        }
+        av_log(NULL, AV_LOG_DEBUG, "Successfully opened the file.\n");
+    }
+
+end:
+    for (i = 0; i < nb_init; i++)
+        uninit_options(&c[i].o);
+    av_free(c);
+    return ret;
+}
+
 static int open_files(OptionGroupList *l, const char *inout,
                       int (*open_file)(OptionsContext *, const char *))
 {
@@ -3753,7 +4613,7 @@ static int open_files(OptionGroupList *l, const char *inout,
         }
 
         av_log(NULL, AV_LOG_DEBUG, "Opening an %s file: %s.\n", inout, g->arg);
-        ret = open_file(&o, g->arg); // open_input_file()/open_output_file(), 一次只打开一路码流
+        ret = open_file(&o, g->arg); // open_output_file(), 一次只打开一路码流
 
         uninit_options(&o);
         if (ret < 0)
@@ -3826,6 +4686,20 @@ void show_option_parse_context(OptionParseContext *octx)
 }
 
 // 解析输入命令, 并打开输入输出文件, 创建输入输出流
+// 按 ffmpeg_parse_options() 的规则拆分命令行, 返回输出文件的个数
+int count_output_files(int argc, char **argv)
+{
+    OptionParseContext octx;
+    int ret;
+
+    memset(&octx, 0, sizeof(octx));
+    ret = split_commandline(&octx, argc, argv, options, groups, FF_ARRAY_ELEMS(groups));
+    if (ret >= 0)
+        ret = octx.groups[GROUP_OUTFILE].nb_groups;
+    uninit_parse_context(&octx);
+    return ret;
+}
+
 int ffmpeg_parse_options(int argc, char **argv)
 {
     OptionParseContext octx; // 保存命令行解析的参数
@@ -3855,8 +4729,13 @@ int ffmpeg_parse_options(int argc, char **argv)
 
     term_init();
 
+#if HAVE_THREADS
+    // 与 init_input_thread() 的判断一致
+    input_threads_planned = pipeline_mode || octx.groups[GROUP_INFILE].nb_groups > 1;
+#endif
+
     // 打开输入文件
-    ret = open_files(&octx.groups[GROUP_INFILE], "input", open_input_file);
+    ret = open_input_files(&octx.groups[GROUP_INFILE]);
     if (ret < 0)
     {
         av_log(NULL, AV_LOG_FATAL, "Error opening input files: ");
@@ -3926,7 +4805,12 @@ const OptionDef options[] = {
     {"map_chapters", HAS_ARG | OPT_INT | OPT_EXPERT | OPT_OFFSET | OPT_OUTPUT, {.off = OFFSET(chapters_input_file)}, "set chapters mapping", "input_file_index"},
     {"t", HAS_ARG | OPT_TIME | OPT_OFFSET | OPT_INPUT | OPT_OUTPUT, {.off = OFFSET(recording_time)}, "record or transcode \"duration\" seconds of audio/video", "duration"},
     {"to", HAS_ARG | OPT_TIME | OPT_OFFSET | OPT_INPUT | OPT_OUTPUT, {.off = OFFSET(stop_time)}, "record or transcode stop time", "time_stop"},
-    {"fs", HAS_ARG | OPT_INT64 | OPT_OFFSET | OPT_OUTPUT, {.off = OFFSET(limit_filesize)}, "set the limit file size in bytes", "limit_size"},
+    {"fs", HAS_ARG | OPT_INT64 | OPT_OFFSET | OPT_OUTPUT, {.off = OFFSET(limit_filesize)}, "set the limit file size in bytes, of all the files together with -rotate_time/-rotate_size", "limit_size"},
+    {"rotate_time", HAS_ARG | OPT_TIME | OPT_OFFSET | OPT_EXPERT | OPT_OUTPUT, {.off = OFFSET(rotate_time)}, "continue the output in the next file of the %d filename pattern at the first keyframe after this duration", "duration"},
+    {"rotate_size", HAS_ARG | OPT_INT64 | OPT_OFFSET | OPT_EXPERT | OPT_OUTPUT, {.off = OFFSET(rotate_size)}, "continue the output in the next file of the %d filename pattern at the first keyframe after this many bytes", "bytes"},
+    {"io_buffer_size", HAS_ARG | OPT_INT | OPT_OFFSET | OPT_EXPERT | OPT_OUTPUT, {.off = OFFSET(io_buffer_size)}, "write the local output file in aligned blocks of this size", "bytes"},
+    {"io_cache_mode", HAS_ARG | OPT_STRING | OPT_OFFSET | OPT_EXPERT | OPT_OUTPUT, {.off = OFFSET(io_cache_mode)}, "set how the local output file uses the page cache (default, dontneed, direct)", "mode"},
+    {"mux_thread_queue_size", HAS_ARG | OPT_INT | OPT_OFFSET | OPT_EXPERT | OPT_OUTPUT, {.off = OFFSET(mux_thread_queue_size)}, "write the packets of the output file on a separate thread, queueing up to this many packets (0 = off)", "packets"},
     {"ss", HAS_ARG | OPT_TIME | OPT_OFFSET | OPT_INPUT | OPT_OUTPUT, {.off = OFFSET(start_time)}, "set the start time offset", "time_off"},
     {"sseof", HAS_ARG | OPT_TIME | OPT_OFFSET | OPT_INPUT, {.off = OFFSET(start_time_eof)}, "set the start time offset relative to EOF", "time_off"},
     {"seek_timestamp", HAS_ARG | OPT_INT | OPT_OFFSET | OPT_INPUT, {.off = OFFSET(seek_timestamp)}, "enable/disable seeking by timestamp with -ss"},
@@ -3949,6 +4833,7 @@ const OptionDef options[] = {
                                                                              "with optional prefixes \"pal-\", \"ntsc-\" or \"film-\")",
      "type"},
     {"vsync", HAS_ARG | OPT_EXPERT, {.func_arg = opt_vsync}, "video sync method", ""},
+    {"decode_decimate", OPT_VIDEO | OPT_BOOL | OPT_EXPERT, {&decode_decimate}, "do not decode the non-reference frames that -r would drop anyway"},
     {"frame_drop_threshold", HAS_ARG | OPT_FLOAT | OPT_EXPERT, {&frame_drop_threshold}, "frame drop threshold", ""},
     {"async", HAS_ARG | OPT_INT | OPT_EXPERT, {&audio_sync_method}, "audio sync method", ""},
     {"adrift_threshold", HAS_ARG | OPT_FLOAT | OPT_EXPERT, {&audio_drift_threshold}, "audio drift threshold", "threshold"},
@@ -3975,6 +4860,7 @@ const OptionDef options[] = {
     {"reinit_filter", HAS_ARG | OPT_INT | OPT_SPEC | OPT_INPUT, {.off = OFFSET(reinit_filters)}, "reinit filtergraph on input parameter changes", ""},
     {"filter_complex", HAS_ARG | OPT_EXPERT, {.func_arg = opt_filter_complex}, "create a complex filtergraph", "graph_description"},
     {"filter_complex_threads", HAS_ARG | OPT_INT, {&filter_complex_nbthreads}, "number of threads for -filter_complex"},
+    {"threads_budget", HAS_ARG | OPT_INT | OPT_EXPERT, {&threads_budget}, "split this many threads among the decoders, encoders and filtergraphs", "number"},
     {"lavfi", HAS_ARG | OPT_EXPERT, {.func_arg = opt_filter_complex}, "create a complex filtergraph", "graph_description"},
     {"filter_complex_script", HAS_ARG | OPT_EXPERT, {.func_arg = opt_filter_complex_script}, "read complex filtergraph description from a file", "filename"},
     {
@@ -3986,12 +4872,29 @@ const OptionDef options[] = {
     {"attach", HAS_ARG | OPT_PERFILE | OPT_EXPERT | OPT_OUTPUT, {.func_arg = opt_attach}, "add an attachment to the output file", "filename"},
     {"dump_attachment", HAS_ARG | OPT_STRING | OPT_SPEC | OPT_EXPERT | OPT_INPUT, {.off = OFFSET(dump_attachment)}, "extract an attachment into a file", "filename"},
     {"stream_loop", OPT_INT | HAS_ARG | OPT_EXPERT | OPT_INPUT | OPT_OFFSET, {.off = OFFSET(loop)}, "set number of times input stream shall be looped", "loop count"},
+    {"mmap", HAS_ARG | OPT_INT | OPT_OFFSET | OPT_EXPERT | OPT_INPUT, {.off = OFFSET(mmap_input)}, "read a local input file through a memory mapping (0 = never (default), 1 = always, -1 = files of 64 MiB and more)", "mode"},
+    {"keyframe_step", HAS_ARG | OPT_TIME | OPT_OFFSET | OPT_EXPERT | OPT_INPUT, {.off = OFFSET(keyframe_step)}, "decode only the video keyframe nearest to every multiple of this duration, seeking in between", "duration"},
+    {"frame_cache_size", HAS_ARG | OPT_INT64 | OPT_OFFSET | OPT_EXPERT | OPT_INPUT, {.off = OFFSET(frame_cache_size)}, "replay the loops of -stream_loop as decoded frames if they fit in this many bytes", "bytes"},
+    {"loop_cache_size", HAS_ARG | OPT_INT64 | OPT_OFFSET | OPT_EXPERT | OPT_INPUT, {.off = OFFSET(loop_cache_size)}, "replay the loops of -stream_loop from memory if the input fits in this many bytes", "bytes"},
     {"debug_ts", OPT_BOOL | OPT_EXPERT, {&debug_ts}, "print timestamp debugging info"},
     {"max_error_rate", HAS_ARG | OPT_FLOAT, {&max_error_rate}, "ratio of errors (0.0: no errors, 1.0: 100% errors) above which ffmpeg returns an error instead of success.", "maximum error rate"},
     {"discard", OPT_STRING | HAS_ARG | OPT_SPEC | OPT_INPUT, {.off = OFFSET(discard)}, "discard", ""},
     {"disposition", OPT_STRING | HAS_ARG | OPT_SPEC | OPT_OUTPUT, {.off = OFFSET(disposition)}, "disposition", ""},
+    {"share_encoder", OPT_STRING | HAS_ARG | OPT_SPEC | OPT_EXPERT | OPT_OUTPUT, {.off = OFFSET(share_encoders)}, "mux the packets of the encoder of an earlier output stream instead of encoding again", "file:stream"},
     {"thread_queue_size", HAS_ARG | OPT_INT | OPT_OFFSET | OPT_EXPERT | OPT_INPUT, {.off = OFFSET(thread_queue_size)}, "set the maximum number of queued packets from the demuxer"},
+    {"thread_queue_max_bytes", HAS_ARG | OPT_INT64 | OPT_OFFSET | OPT_EXPERT | OPT_INPUT, {.off = OFFSET(thread_queue_max_bytes)}, "set the memory cap up to which the demuxer queue may grow", "bytes"},
+    {"readahead_size", HAS_ARG | OPT_INT64 | OPT_OFFSET | OPT_EXPERT | OPT_INPUT, {.off = OFFSET(readahead_size)}, "read the input on a separate thread, buffering up to this many bytes of packets", "bytes"},
     {"find_stream_info", OPT_BOOL | OPT_PERFILE | OPT_INPUT | OPT_EXPERT, {&find_stream_info}, "read and decode the streams to fill missing information with heuristics"},
+    {"pipeline", OPT_BOOL | OPT_EXPERT, {&pipeline_mode}, "run demuxing, decoding, complex filtergraphs and encoding on their own worker threads; "
+                                                    "streams stay interleaved only within -max_interleave_delta"},
+    {"pipeline_queue_size", HAS_ARG | OPT_INT | OPT_EXPERT, {&pipeline_queue_size}, "set the maximum number of frames queued between pipeline stages", "size"},
+    {"probe_cache", HAS_ARG | OPT_STRING | OPT_EXPERT, {&probe_cache_dir}, "cache the probed stream parameters of local input files in this directory", "dir"},
+    {"probe_cache_refresh", OPT_BOOL | OPT_EXPERT, {&probe_cache_refresh}, "probe the inputs again and rewrite their -probe_cache entries"},
+    {"async_io", HAS_ARG | OPT_INT | OPT_EXPERT, {&async_io_depth}, "read and write local files on worker threads, keeping this many blocks in flight (0 = off)", "depth"},
+    {"async_io_block_size", HAS_ARG | OPT_INT | OPT_EXPERT, {&async_io_block_size}, "set the size of the -async_io blocks", "bytes"},
+    {"batch", HAS_ARG | OPT_EXPERT, {.func_arg = opt_batch}, "run every command line of a file as an independent job", "jobfile"},
+    {"segment_parallel", HAS_ARG | OPT_EXPERT, {.func_arg = opt_segment_parallel}, "split the input at keyframes and transcode this many segments in parallel", "number"},
+    {"batch_jobs", HAS_ARG | OPT_EXPERT, {.func_arg = opt_batch}, "set the number of batch jobs run at the same time", "number"},
 
     /* video options */
     {"vframes", OPT_VIDEO | HAS_ARG | OPT_PERFILE | OPT_OUTPUT, {.func_arg = opt_video_frames}, "set the number of video frames to output", "number"},
@@ -4089,6 +4992,8 @@ const OptionDef options[] = {
     {"fpre", HAS_ARG | OPT_EXPERT | OPT_PERFILE | OPT_OUTPUT, {.func_arg = opt_preset}, "set options from indicated preset file", "filename"},
 
     {"max_muxing_queue_size", HAS_ARG | OPT_INT | OPT_SPEC | OPT_EXPERT | OPT_OUTPUT, {.off = OFFSET(max_muxing_queue_size)}, "maximum number of packets that can be buffered while waiting for all streams to initialize", "packets"},
+    {"muxing_queue_data_threshold", HAS_ARG | OPT_INT64 | OPT_SPEC | OPT_EXPERT | OPT_OUTPUT, {.off = OFFSET(muxing_queue_data_threshold)}, "set the packet data size above which max_muxing_queue_size is enforced, or packets are spilled to disk", "bytes"},
+    {"muxing_queue_spill_dir", HAS_ARG | OPT_STRING | OPT_EXPERT, {&muxing_queue_spill_dir}, "buffer the muxing queue data above muxing_queue_data_threshold in temporary files in this directory", "dir"},
 
     /* data codec support */
     {"dcodec", HAS_ARG | OPT_DATA | OPT_PERFILE | OPT_EXPERT | OPT_INPUT | OPT_OUTPUT, {.func_arg = opt_data_codec}, "force data codec ('copy' to copy stream)", "codec"},